@@ -0,0 +1,73 @@
+#pragma once
+// Arduino core subset for the host build of CAN_Lib: pins, the external
+// interrupts INT0/INT1 and time, all on top of host_avr.h.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <util/delay.h>
+#include "WString.h"
+#include "HardwareSerial.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH          1
+#define LOW           0
+#define INPUT         0
+#define OUTPUT        1
+#define INPUT_PULLUP  2
+#define CHANGE        1
+#define FALLING       2
+#define RISING        3
+
+#define SS            10
+#define MOSI          11
+#define MISO          12
+#define SCK           13
+
+#define NOT_A_PORT    0
+#define PB            2
+#define PC            3
+#define PD            4
+
+#define digitalPinToPort(p)     ((p) < 8 ? PD : ((p) < 14 ? PB : PC))
+#define digitalPinToBitMask(p)  _BV((p) < 8 ? (p) : ((p) < 14 ? (p) - 8 : (p) - 14))
+#define portModeRegister(port)  ((port) == PB ? &DDRB : ((port) == PC ? &DDRC : &DDRD))
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : ((p) == 3 ? 1 : -1))
+
+#define clockCyclesPerMicrosecond() (F_CPU / 1000000L)
+
+#define noInterrupts()  cli()
+#define interrupts()    sei()
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) (bitvalue ? bitSet(value, bit) : bitClear(value, bit))
+#define lowByte(w) ((uint8_t)((w) & 0xff))
+#define highByte(w) ((uint8_t)((w) >> 8))
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+// 32 bit like on the AVR, so wrap-around behaves the same
+uint32_t millis(void);
+uint32_t micros(void);
+void delay(uint32_t ms);
+void delayMicroseconds(unsigned int us);
+
+inline long map(long x, long in_min, long in_max, long out_min, long out_max)
+{
+  return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+void attachInterrupt(uint8_t interruptNum, void (*userFunc)(void), int mode);
+void detachInterrupt(uint8_t interruptNum);
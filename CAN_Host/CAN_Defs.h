@@ -0,0 +1,2 @@
+#pragma once
+// Build options of the host build; a node program may bring its own
@@ -0,0 +1,39 @@
+#pragma once
+// Serial of the host build: what the firmware writes collects in an output
+// buffer, what a test or the bus simulator feeds in is read back.
+// A byte costs its 10 bit times at the configured baudrate. The UART
+// registers (UDR0, UCSR0A) work on the same buffers for firmwares that
+// drive UART0 themselves.
+
+#include "Stream.h"
+
+#define HOST_SERIAL_SIZE 256
+
+class HardwareSerial : public Stream
+{
+  public:
+    HardwareSerial();
+    void begin(unsigned long baud);
+    void end() {}
+    virtual int available();
+    virtual int read();
+    virtual int peek();
+    virtual void flush() {}
+    virtual size_t write(uint8_t c);
+    using Print::write;
+    operator bool() { return true; }
+
+    // host side: feed input, take output
+    size_t feed(const char *data, size_t size);
+    size_t drain(char *data, size_t size);
+    // output of UDR0, the UART model keeps the time
+    void put(uint8_t c);
+
+  private:
+    uint8_t in[HOST_SERIAL_SIZE];
+    uint8_t out[HOST_SERIAL_SIZE];
+    uint16_t inHead, inTail, outHead, outTail;
+    uint32_t byteCycles;
+};
+
+extern HardwareSerial Serial;
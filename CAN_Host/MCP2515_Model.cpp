@@ -0,0 +1,508 @@
+#include "MCP2515_Model.h"
+#include "host_avr.h"
+
+MCP2515_Model hostMCP;
+
+// Start of the registers READ RX BUFFER and LOAD TX BUFFER point at
+static const uint8_t rxStart[4] = {MCP2515_RXB0SIDH, MCP2515_RXB0D0, MCP2515_RXB1SIDH, MCP2515_RXB1D0};
+static const uint8_t txStart[6] = {MCP2515_TXB0SIDH, MCP2515_TXB0D0, MCP2515_TXB1SIDH,
+                                   MCP2515_TXB1D0, MCP2515_TXB2SIDH, MCP2515_TXB2D0};
+
+// SID<10:0>, EID<17:0> as 29 bits from a SIDH, SIDL, EID8, EID0 quadruple
+static uint32_t id29(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 21) | ((uint32_t)(p[1] & 0xE0) << 13) |
+         ((uint32_t)(p[1] & 0x03) << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+MCP2515_Model::MCP2515_Model()
+{
+  busBitrate = 0;
+  autoTx = true;
+  onTx = 0;
+  spiCommands = 0;
+  framesIn = 0;
+  framesLost = 0;
+  framesOut = 0;
+  selected = false;
+  reset();
+}
+
+void MCP2515_Model::reset()
+{
+  memset(reg, 0, sizeof(reg));
+  reg[MCP2515_CANCTRL] = 0x87;  // REQOP config, CLKEN, CLKPRE 1:8
+  reg[MCP2515_CANSTAT] = MCP2515_MODE_CONFIG;
+  count = 0;
+  clearIF = 0;
+}
+
+void MCP2515_Model::select()
+{
+  selected = true;
+  count = 0;
+  clearIF = 0;
+}
+
+void MCP2515_Model::deselect()
+{
+  if (!selected)
+  {
+    return;
+  }
+  selected = false;
+  // READ RX BUFFER clears its RXnIF when CS goes high
+  reg[MCP2515_CANINTF] &= ~clearIF;
+  clearIF = 0;
+  count = 0;
+  runTx();
+  updateInt();
+}
+
+uint8_t MCP2515_Model::transfer(uint8_t mosi)
+{
+  uint8_t miso = 0xFF;
+  uint8_t n;
+
+  if (!selected)
+  {
+    return miso;
+  }
+  if (count++ == 0)
+  {
+    cmd = mosi;
+    spiCommands++;
+    if (cmd == MCP2515_SPI_RESET)
+    {
+      reset();
+      count = 1;
+    }
+    else if ((cmd & 0xF9) == MCP2515_READ_RX_BUFFER_0_ID)
+    {
+      n = (cmd >> 1) & 0x03;
+      addr = rxStart[n];
+      clearIF = n < 2 ? _BV(MCP2515_RX0IF) : _BV(MCP2515_RX1IF);
+    }
+    else if ((cmd & 0xF8) == MCP2515_LOAD_TX_BUFFER_0_ID && (cmd & 0x07) < 6)
+    {
+      addr = txStart[cmd & 0x07];
+    }
+    else if ((cmd & 0xF8) == 0x80)
+    {
+      // RTS: TXREQ for each buffer named in the low bits
+      for (n = 0; n < 3; n++)
+      {
+        if (cmd & _BV(n))
+        {
+          reg[MCP2515_TXB0CTRL + 0x10 * n] |= _BV(MCP2515_TXREQ);
+        }
+      }
+    }
+    return miso;
+  }
+  if (cmd == MCP2515_SPI_READ || cmd == MCP2515_SPI_WRITE || cmd == MCP2515_SPI_BIT_MODIFY)
+  {
+    if (count == 2)
+    {
+      addr = mosi & 0x7F;
+      return miso;
+    }
+    if (cmd == MCP2515_SPI_READ)
+    {
+      miso = reg[(addr & 0x0E) == 0x0E ? (addr & 0x0F) : addr];
+      addr = (addr + 1) & 0x7F;
+    }
+    else if (cmd == MCP2515_SPI_WRITE)
+    {
+      writeReg(addr, mosi);
+      addr = (addr + 1) & 0x7F;
+    }
+    else if (count == 3)
+    {
+      mask = mosi;
+    }
+    else if (count == 4)
+    {
+      modifyReg(addr, mask, mosi);
+    }
+  }
+  else if ((cmd & 0xF9) == MCP2515_READ_RX_BUFFER_0_ID)
+  {
+    miso = reg[addr];
+    addr = (addr + 1) & 0x7F;
+  }
+  else if ((cmd & 0xF8) == MCP2515_LOAD_TX_BUFFER_0_ID && (cmd & 0x07) < 6)
+  {
+    reg[addr] = mosi;
+    addr = (addr + 1) & 0x7F;
+  }
+  else if (cmd == MCP2515_SPI_READ_STATUS)
+  {
+    miso = readStatus();
+  }
+  else if (cmd == MCP2515_SPI_RX_STATUS)
+  {
+    miso = rxStatus();
+  }
+  return miso;
+}
+
+void MCP2515_Model::writeReg(uint8_t a, uint8_t value)
+{
+  uint8_t low = a & 0x0F;
+
+  if (low == 0x0E || low == 0x0F)
+  {
+    // CANSTAT is read only, CANCTRL appears at every xFh
+    if (low == 0x0F)
+    {
+      reg[MCP2515_CANCTRL] = value;
+      // a new mode waits for the pending transmissions, see txDone()
+      if (pendingTx() < 0)
+      {
+        setMode(value & MCP2515_REQOPn);
+      }
+    }
+    return;
+  }
+  if (a == MCP2515_TEC || a == MCP2515_REC)
+  {
+    return;
+  }
+  // filters, masks, TXRTSCTRL and the CNF registers only take writes in config mode
+  if (mode() != MCP2515_MODE_CONFIG &&
+      (a < MCP2515_BFPCTRL || a == MCP2515_TXRTSCTRL ||
+       (a >= MCP2515_RXF3SIDH && a <= MCP2515_RXF5EID0) || (a >= MCP2515_RXM0SIDH && a <= MCP2515_CNF1)))
+  {
+    return;
+  }
+  switch (a)
+  {
+    case MCP2515_TXB0CTRL:
+    case MCP2515_TXB1CTRL:
+    case MCP2515_TXB2CTRL:
+      // ABTF, MLOA, TXERR are status bits
+      reg[a] = (reg[a] & 0x70) | (value & 0x0B);
+      break;
+    case MCP2515_RXB0CTRL:
+      // RXM and BUKT; BUKT1 mirrors BUKT
+      reg[a] = (reg[a] & 0x09) | (value & 0x64) | ((value & 0x04) >> 1);
+      break;
+    case MCP2515_RXB1CTRL:
+      reg[a] = (reg[a] & 0x0F) | (value & 0x60);
+      break;
+    case MCP2515_EFLG:
+      // only the overflow flags can be cleared
+      reg[a] = (reg[a] & 0x3F) | (value & reg[a] & 0xC0);
+      break;
+    default:
+      reg[a] = value;
+  }
+}
+
+void MCP2515_Model::modifyReg(uint8_t a, uint8_t m, uint8_t value)
+{
+  uint8_t low = a & 0x0F;
+
+  // BIT MODIFY on other registers writes all bits
+  if (!(a == MCP2515_BFPCTRL || a == MCP2515_TXRTSCTRL || low == 0x0F ||
+        (a >= MCP2515_CNF3 && a <= MCP2515_EFLG) ||
+        a == MCP2515_TXB0CTRL || a == MCP2515_TXB1CTRL || a == MCP2515_TXB2CTRL ||
+        a == MCP2515_RXB0CTRL || a == MCP2515_RXB1CTRL))
+  {
+    m = 0xFF;
+  }
+  writeReg(a, (reg[low == 0x0F ? MCP2515_CANCTRL : a] & ~m) | (value & m));
+}
+
+void MCP2515_Model::setMode(uint8_t opmod)
+{
+  reg[MCP2515_CANSTAT] = (reg[MCP2515_CANSTAT] & ~MCP2515_REQOPn) | opmod;
+}
+
+uint8_t MCP2515_Model::readStatus() const
+{
+  uint8_t intf = reg[MCP2515_CANINTF];
+
+  return (intf & 0x03) |
+         ((reg[MCP2515_TXB0CTRL] & _BV(MCP2515_TXREQ)) >> 1) | ((intf & _BV(MCP2515_TX0IF)) << 1) |
+         ((reg[MCP2515_TXB1CTRL] & _BV(MCP2515_TXREQ)) << 1) | ((intf & _BV(MCP2515_TX1IF)) << 2) |
+         ((reg[MCP2515_TXB2CTRL] & _BV(MCP2515_TXREQ)) << 3) | ((intf & _BV(MCP2515_TX2IF)) << 3);
+}
+
+uint8_t MCP2515_Model::rxStatus() const
+{
+  uint8_t intf = reg[MCP2515_CANINTF];
+  uint8_t status = 0, base, filhit;
+
+  if (intf & _BV(MCP2515_RX0IF))
+  {
+    status |= MCP2515_RX_STATUS_RXB0;
+  }
+  if (intf & _BV(MCP2515_RX1IF))
+  {
+    status |= MCP2515_RX_STATUS_RXB1;
+  }
+  if (!status)
+  {
+    return status;
+  }
+  // type and filter of the frame in RXB0, or RXB1 if RXB0 is empty
+  base = (intf & _BV(MCP2515_RX0IF)) ? MCP2515_RXB0CTRL : MCP2515_RXB1CTRL;
+  if (reg[base + 2] & _BV(MCP2515_IDE))
+  {
+    status |= MCP2515_RX_STATUS_EXTENDED;
+  }
+  if (reg[base] & _BV(MCP2515_RXRTR))
+  {
+    status |= MCP2515_RX_STATUS_REMOTE;
+  }
+  filhit = reg[base] & 0x07;
+  if (base == MCP2515_RXB0CTRL)
+  {
+    filhit &= 0x01;
+  }
+  else if (filhit < 2)
+  {
+    filhit += 6;  // RXF0/RXF1 rolled over into RXB1
+  }
+  return status | filhit;
+}
+
+bool MCP2515_Model::filterHit(const MCP2515_Buffer &frame, uint8_t m, uint8_t f) const
+{
+  uint32_t id, bits = id29(&reg[m]);
+  bool ext = frame.sidl & _BV(MCP2515_IDE);
+
+  if (ext != ((reg[f + 1] & _BV(MCP2515_EXIDE)) != 0))
+  {
+    return false;
+  }
+  if (ext)
+  {
+    id = id29(&frame.sidh);
+  }
+  else
+  {
+    // standard frames match the EID bits against the first two data bytes
+    id = (id29(&frame.sidh) & 0x1FFC0000UL) | ((uint16_t)frame.data[0] << 8) | frame.data[1];
+    bits &= ~0x30000UL;
+  }
+  return ((id ^ id29(&reg[f])) & bits) == 0;
+}
+
+void MCP2515_Model::store(uint8_t rxb, const MCP2515_Buffer &frame, uint8_t filhit)
+{
+  uint8_t base = rxb ? MCP2515_RXB1CTRL : MCP2515_RXB0CTRL;
+  uint8_t *p = &reg[base + 1];
+  bool ext = frame.sidl & _BV(MCP2515_IDE);
+  bool rtr = frame.dlc & _BV(MCP2515_RTR);
+
+  // the bus carries RTR in one place, the RX buffer splits it into SRR and RTR
+  p[0] = frame.sidh;
+  p[1] = (frame.sidl & 0xEB) | ((!ext && rtr) ? _BV(MCP2515_SRR) : 0);
+  p[2] = frame.eid8;
+  p[3] = frame.eid0;
+  p[4] = (frame.dlc & MCP2515_DLC) | ((ext && rtr) ? _BV(MCP2515_RTR) : 0);
+  memcpy(&p[5], frame.data, 8);
+  if (rxb)
+  {
+    reg[base] = (reg[base] & 0x60) | (rtr ? _BV(MCP2515_RXRTR) : 0) | filhit;
+  }
+  else
+  {
+    reg[base] = (reg[base] & 0x66) | (rtr ? _BV(MCP2515_RXRTR) : 0) | filhit;
+  }
+  reg[MCP2515_CANINTF] |= rxb ? _BV(MCP2515_RX1IF) : _BV(MCP2515_RX0IF);
+  framesIn++;
+}
+
+bool MCP2515_Model::receive(const MCP2515_Buffer &frame)
+{
+  bool taken = accept(frame, false);
+
+  updateInt();
+  return taken;
+}
+
+bool MCP2515_Model::accept(const MCP2515_Buffer &frame, bool own)
+{
+  uint8_t intf = reg[MCP2515_CANINTF];
+  uint8_t m = mode();
+  int8_t hit = -1;
+  uint8_t f;
+
+  if (m == MCP2515_MODE_SLEEP && !own)
+  {
+    // bus activity wakes the chip into listen-only; the frame itself is lost
+    if (reg[MCP2515_CANINTE] & _BV(MCP2515_WAKIE))
+    {
+      reg[MCP2515_CANINTF] |= _BV(MCP2515_WAKIF);
+      setMode(MCP2515_MODE_LISTEN);
+    }
+    framesLost++;
+    return false;
+  }
+  if (m == MCP2515_MODE_CONFIG || (m == MCP2515_MODE_LOOPBACK) != own)
+  {
+    return false;
+  }
+  if (!own && busBitrate && bitrate() != busBitrate)
+  {
+    reg[MCP2515_CANINTF] |= _BV(MCP2515_MERRF);
+    framesLost++;
+    return false;
+  }
+  // RXB0 with masks 0 and filters 0, 1
+  if ((reg[MCP2515_RXB0CTRL] & MCP2515_RXMn) == MCP2515_RXMn)
+  {
+    hit = 0;
+  }
+  else
+  {
+    for (f = 0; f < 2 && hit < 0; f++)
+    {
+      if (filterHit(frame, MCP2515_RXM0SIDH, MCP2515_RXF0SIDH + 4 * f))
+      {
+        hit = f;
+      }
+    }
+  }
+  if (hit >= 0)
+  {
+    if (!(intf & _BV(MCP2515_RX0IF)))
+    {
+      store(0, frame, hit);
+      return true;
+    }
+    if (!(reg[MCP2515_RXB0CTRL] & _BV(MCP2515_BUKT)))
+    {
+      reg[MCP2515_EFLG] |= _BV(MCP2515_RX0OVR);
+      reg[MCP2515_CANINTF] |= _BV(MCP2515_ERRIF);
+      framesLost++;
+      return false;
+    }
+  }
+  else
+  {
+    // RXB1 with mask 1 and filters 2..5
+    if ((reg[MCP2515_RXB1CTRL] & MCP2515_RXMn) == MCP2515_RXMn)
+    {
+      hit = 2;
+    }
+    else
+    {
+      for (f = 2; f < 6 && hit < 0; f++)
+      {
+        if (filterHit(frame, MCP2515_RXM1SIDH, f < 3 ? MCP2515_RXF2SIDH : MCP2515_RXF3SIDH + 4 * (f - 3)))
+        {
+          hit = f;
+        }
+      }
+    }
+    if (hit < 0)
+    {
+      return false;
+    }
+  }
+  if (!(intf & _BV(MCP2515_RX1IF)))
+  {
+    store(1, frame, hit);
+    return true;
+  }
+  reg[MCP2515_EFLG] |= _BV(MCP2515_RX1OVR);
+  reg[MCP2515_CANINTF] |= _BV(MCP2515_ERRIF);
+  framesLost++;
+  return false;
+}
+
+int8_t MCP2515_Model::pendingTx() const
+{
+  int8_t best = -1;
+  uint8_t n, ctrl;
+
+  if (mode() != MCP2515_MODE_NORMAL && mode() != MCP2515_MODE_LOOPBACK)
+  {
+    return best;
+  }
+  // highest TXP wins, the higher buffer number on a tie
+  for (n = 0; n < 3; n++)
+  {
+    ctrl = reg[MCP2515_TXB0CTRL + 0x10 * n];
+    if ((ctrl & _BV(MCP2515_TXREQ)) &&
+        (best < 0 || (ctrl & 0x03) >= (reg[MCP2515_TXB0CTRL + 0x10 * best] & 0x03)))
+    {
+      best = n;
+    }
+  }
+  return best;
+}
+
+MCP2515_Buffer MCP2515_Model::txFrame(uint8_t n) const
+{
+  MCP2515_Buffer frame;
+
+  memcpy(&frame, &reg[MCP2515_TXB0SIDH + 0x10 * n], sizeof(frame));
+  frame.dlc &= _BV(MCP2515_RTR) | MCP2515_DLC;
+  return frame;
+}
+
+void MCP2515_Model::txDone(uint8_t n)
+{
+  MCP2515_Buffer frame = txFrame(n);
+
+  reg[MCP2515_TXB0CTRL + 0x10 * n] &= ~_BV(MCP2515_TXREQ);
+  reg[MCP2515_CANINTF] |= _BV(MCP2515_TX0IF + n);
+  framesOut++;
+  accept(frame, true);
+  if (pendingTx() < 0)
+  {
+    // last pending frame is out: now take the mode REQOP asks for
+    setMode(reg[MCP2515_CANCTRL] & MCP2515_REQOPn);
+  }
+  updateInt();
+}
+
+void MCP2515_Model::txRtsPin(uint8_t n)
+{
+  if (reg[MCP2515_TXRTSCTRL] & _BV(MCP2515_B0RTSM + n))
+  {
+    reg[MCP2515_TXB0CTRL + 0x10 * n] |= _BV(MCP2515_TXREQ);
+    runTx();
+    updateInt();
+  }
+}
+
+void MCP2515_Model::runTx()
+{
+  int8_t n;
+
+  if (!autoTx)
+  {
+    return;
+  }
+  while ((n = pendingTx()) >= 0)
+  {
+    if (onTx)
+    {
+      onTx(txFrame(n));
+    }
+    txDone(n);
+  }
+}
+
+uint32_t MCP2515_Model::bitrate() const
+{
+  uint8_t cnf1 = reg[MCP2515_CNF1], cnf2 = reg[MCP2515_CNF2], cnf3 = reg[MCP2515_CNF3];
+  uint8_t prop = (cnf2 & 0x07) + 1;
+  uint8_t ps1 = ((cnf2 >> 3) & 0x07) + 1;
+  // without BTLMODE PS2 is the larger of PS1 and the 2 TQ processing time
+  uint8_t ps2 = (cnf2 & _BV(MCP2515_BTLMODE)) ? (cnf3 & 0x07) + 1 : (ps1 > 2 ? ps1 : 2);
+
+  return MCP2515_OSC / (2UL * ((cnf1 & 0x3F) + 1) * (1 + prop + ps1 + ps2));
+}
+
+void MCP2515_Model::updateInt()
+{
+  hostSetPin(HOST_PIN_MCPINT, intActive() ? LOW : HIGH);
+}
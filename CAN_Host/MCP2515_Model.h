@@ -0,0 +1,76 @@
+#pragma once
+// Register level model of the MCP2515 behind the host SPI port.
+//
+// It decodes the SPI instructions CAN_Lib sends (RESET, READ, WRITE,
+// READ RX BUFFER, LOAD TX BUFFER, RTS, READ STATUS, RX STATUS, BIT MODIFY),
+// keeps the 128 registers, runs acceptance filters, rollover and overflow on
+// frames handed to receive() and drives the INT pin from CANINTF & CANINTE.
+// Like the chip it changes mode only once no transmission is pending.
+// Bit timing is not simulated: a frame is either seen at the configured
+// bitrate or, if that differs from busBitrate, shows up as MERRF.
+
+#include "CAN.h"
+
+class MCP2515_Model
+{
+  public:
+    MCP2515_Model();
+
+    // RESET instruction and power-up: config mode, registers cleared
+    void reset();
+
+    // SPI side, called by the host ports
+    void select();
+    void deselect();
+    uint8_t transfer(uint8_t mosi);
+
+    // Frame seen on the bus; false if no RX buffer took it
+    bool receive(const MCP2515_Buffer &frame);
+    // Highest priority TX buffer with TXREQ set, -1 if none or not sending
+    int8_t pendingTx() const;
+    // The frame of TX buffer n left the controller: TXREQ off, TXnIF on
+    void txDone(uint8_t n);
+    // TX buffer n as it would go out on the bus
+    MCP2515_Buffer txFrame(uint8_t n) const;
+    // Falling edge on TXnRTS; sends TXBn if TXRTSCTRL gives the pin that role
+    void txRtsPin(uint8_t n);
+
+    // Bitrate the CNF registers select at MCP2515_OSC
+    uint32_t bitrate() const;
+    uint8_t mode() const { return reg[MCP2515_CANSTAT] & MCP2515_REQOPn; }
+    bool intActive() const { return (reg[MCP2515_CANINTF] & reg[MCP2515_CANINTE]) != 0; }
+
+    // Bitrate of the bus the node is on, 0 for whatever the node uses
+    uint32_t busBitrate;
+    // If set, transmit requests complete at once through onTx; otherwise
+    // the bus owner polls pendingTx() and calls txDone()
+    bool autoTx;
+    void (*onTx)(const MCP2515_Buffer &frame);
+
+    uint8_t reg[128];
+
+    // Traffic counters
+    uint32_t spiCommands;
+    uint32_t framesIn, framesLost, framesOut;
+
+  private:
+    void writeReg(uint8_t addr, uint8_t value);
+    void modifyReg(uint8_t addr, uint8_t mask, uint8_t value);
+    uint8_t readStatus() const;
+    uint8_t rxStatus() const;
+    bool accept(const MCP2515_Buffer &frame, bool own);
+    bool filterHit(const MCP2515_Buffer &frame, uint8_t mask, uint8_t filter) const;
+    void store(uint8_t rxb, const MCP2515_Buffer &frame, uint8_t filhit);
+    void setMode(uint8_t opmod);
+    void runTx();
+    void updateInt();
+
+    uint8_t cmd;      // instruction of the current CS low phase
+    uint8_t count;    // bytes seen in this phase, including cmd
+    uint8_t addr;     // register pointer
+    uint8_t mask;     // BIT MODIFY mask
+    uint8_t clearIF;  // RXnIF to clear at CS high after READ RX BUFFER
+    bool selected;
+};
+
+extern MCP2515_Model hostMCP;
@@ -0,0 +1,42 @@
+#pragma once
+// Arduino Print, enough for Serial and Wire on the host
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "WString.h"
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+class Print
+{
+  public:
+    Print() : writeError(0) {}
+    virtual ~Print() {}
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+
+    size_t print(const char *str) { return write(str); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(int n, int base = DEC) { return print((long)n, base); }
+    size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t println(void) { return write("\r\n"); }
+    template <typename T> size_t println(T x) { size_t n = print(x); return n + println(); }
+    template <typename T> size_t println(T x, int base) { size_t n = print(x, base); return n + println(); }
+
+    int getWriteError() { return writeError; }
+    void clearWriteError() { writeError = 0; }
+
+  protected:
+    void setWriteError(int err = 1) { writeError = err; }
+
+  private:
+    int writeError;
+};
@@ -0,0 +1,13 @@
+#pragma once
+// Arduino Stream without the parsing helpers
+
+#include "Print.h"
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+};
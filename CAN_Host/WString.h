@@ -0,0 +1,20 @@
+#pragma once
+// Arduino String as far as the firmwares use it
+
+#include <string>
+#include <avr/pgmspace.h>
+
+class String
+{
+  public:
+    String(const char *cstr = "") : s(cstr) {}
+    String &operator=(const char *cstr) { s = cstr; return *this; }
+    String &operator+=(char c) { s += c; return *this; }
+    String &operator+=(const char *cstr) { s += cstr; return *this; }
+    char charAt(unsigned int index) const { return index < s.size() ? s[index] : 0; }
+    unsigned int length() const { return s.size(); }
+    const char *c_str() const { return s.c_str(); }
+
+  private:
+    std::string s;
+};
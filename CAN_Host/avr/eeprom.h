@@ -0,0 +1,47 @@
+#pragma once
+// 1 KiB of EEPROM kept in RAM, erased (0xFF) at start. A write keeps the
+// EEPROM busy for 3.4 ms like on the ATmega328P; the next write waits for it.
+
+#include <stdint.h>
+#include "host_avr.h"
+
+#define E2END 0x3FF
+#define HOST_EEPROM_WRITE_CYCLES  (F_CPU / 1000000UL * 3400)
+
+extern uint8_t hostEeprom[E2END + 1];
+// hostCycles when the last write is done
+extern uint64_t hostEepromReady;
+
+static inline bool eeprom_is_ready(void)
+{
+  return hostCycles >= hostEepromReady;
+}
+
+static inline void eeprom_busy_wait(void)
+{
+  if (!eeprom_is_ready())
+  {
+    hostAdvance(hostEepromReady - hostCycles);
+  }
+}
+
+static inline uint8_t eeprom_read_byte(const uint8_t *p)
+{
+  eeprom_busy_wait();
+  return hostEeprom[(uintptr_t)p & E2END];
+}
+
+static inline void eeprom_write_byte(uint8_t *p, uint8_t value)
+{
+  eeprom_busy_wait();
+  hostEeprom[(uintptr_t)p & E2END] = value;
+  hostEepromReady = hostCycles + HOST_EEPROM_WRITE_CYCLES;
+}
+
+static inline void eeprom_update_byte(uint8_t *p, uint8_t value)
+{
+  if (eeprom_read_byte(p) != value)
+  {
+    eeprom_write_byte(p, value);
+  }
+}
@@ -0,0 +1,11 @@
+#pragma once
+// Setting the I bit runs pending handlers, see hostDispatch()
+
+#include "avr/io.h"
+
+#define sei()   (SREG |= 0x80)
+#define cli()   (SREG &= (uint8_t)~0x80)
+#define ISR(vector, ...) extern "C" void vector(void)
+#define ISR_NOBLOCK
+// old style handler, as in the Servo library
+#define SIGNAL(vector) extern "C" void vector(void)
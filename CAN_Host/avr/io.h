@@ -0,0 +1,86 @@
+#pragma once
+// ATmega328P registers as far as CAN_Lib and the firmwares touch them.
+// Registers with side effects are objects from host_avr.h, the rest is
+// plain memory.
+
+#include <stdint.h>
+#include "host_avr.h"
+
+#define _BV(bit) (1 << (bit))
+
+#define PORTB   hostPORTB
+#define PORTC   hostPORTC
+#define PORTD   hostPORTD
+#define SREG    hostSREG
+#define EIMSK   hostEIMSK
+#define SPDR    hostSPDR
+#define SPSR    hostSPSR
+#define UDR0    hostUDR0
+#define UCSR0A  hostUCSR0A
+#define UCSR0B  hostUCSR0B
+
+extern volatile uint8_t DDRB, DDRC, DDRD, PINB, PINC, PIND;
+extern volatile uint8_t SPCR, EIFR, EICRA, WDTCSR, SMCR, MCUCR, MCUSR;
+extern volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1;
+extern volatile uint8_t TWBR, TWSR;
+extern volatile uint8_t UCSR0C, UBRR0H, UBRR0L;
+extern volatile uint16_t TCNT1, ICR1, OCR1A, UBRR0;
+
+// SREG
+#define SREG_I  7
+// SPCR
+#define SPIE    7
+#define SPE     6
+#define DORD    5
+#define MSTR    4
+#define CPOL    3
+#define CPHA    2
+#define SPR1    1
+#define SPR0    0
+// SPSR
+#define SPIF    7
+#define WCOL    6
+#define SPI2X   0
+// EIMSK, EIFR
+#define INT1    1
+#define INT0    0
+#define INTF1   1
+#define INTF0   0
+// WDTCSR
+#define WDIF    7
+#define WDIE    6
+#define WDP3    5
+#define WDCE    4
+#define WDE     3
+#define WDP2    2
+#define WDP1    1
+#define WDP0    0
+// TCCR1A, TCCR1B, TIMSK1, TIFR1; Timer1 counts in normal mode only (host_avr.cpp),
+// TIMER1_COMPA_vect never fires
+#define WGM11   1
+#define WGM10   0
+#define ICNC1   7
+#define ICES1   6
+#define CS12    2
+#define CS11    1
+#define CS10    0
+#define ICIE1   5
+#define OCIE1A  1
+#define TOIE1   0
+#define ICF1    5
+#define OCF1A   1
+#define TOV1    0
+#define TOV1    0
+// UCSR0A, UCSR0B
+#define RXC0    7
+#define TXC0    6
+#define UDRE0   5
+#define U2X0    1
+#define RXCIE0  7
+#define TXCIE0  6
+#define UDRIE0  5
+#define RXEN0   4
+#define TXEN0   3
+// UCSR0C
+#define UCSZ01  2
+#define UCSZ00  1
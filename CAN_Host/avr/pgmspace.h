@@ -0,0 +1,16 @@
+#pragma once
+// Flash and RAM are the same memory on the host
+
+#include <stdint.h>
+#include <string.h>
+#include "avr/io.h"
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define pgm_read_ptr(addr) (*(void * const *)(addr))
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strcpy_P strcpy
@@ -0,0 +1,18 @@
+#pragma once
+// sleep_cpu() waits for the next interrupt when the program runs as a
+// node of the bus simulator and returns at once otherwise
+
+#include "avr/io.h"
+
+#define SLEEP_MODE_IDLE         0x00
+#define SLEEP_MODE_ADC          0x02
+#define SLEEP_MODE_PWR_DOWN     0x04
+#define SLEEP_MODE_PWR_SAVE     0x06
+#define SLEEP_MODE_STANDBY      0x0C
+#define SLEEP_MODE_EXT_STANDBY  0x0E
+
+#define set_sleep_mode(mode)  (SMCR = (SMCR & ~0x0E) | (mode))
+#define sleep_enable()        (SMCR |= 0x01)
+#define sleep_disable()       (SMCR &= ~0x01)
+#define sleep_cpu()           hostSleep()
+#define sleep_mode()          hostSleep()
@@ -0,0 +1,15 @@
+#pragma once
+// Watchdog of the host: only its interrupt, see host_avr.cpp; no reset
+
+#include "avr/io.h"
+
+#define WDTO_15MS   0
+#define WDTO_1S     6
+#define WDTO_8S     9
+
+// starts a new watchdog period
+void hostWdtReset(void);
+
+#define wdt_reset()           hostWdtReset()
+#define wdt_enable(timeout)   ((void)(timeout))
+#define wdt_disable()         (WDTCSR = 0)
@@ -0,0 +1,391 @@
+// canbench: cost of the CAN_MCP2515 hot paths on the MCP2515 model.
+//
+// Every path runs once per frame format (standard, extended) and DLC 0..8,
+// once with plain polling (begin() without options) and once with the
+// options the firmwares use (receive ring, transmit queue, rollover). With
+// the transmit queue fireCanFrame() is measured cold and after
+// armCanFrame() with two fresh bytes, the way hall2can sends S88_EVENT. Per
+// call it records
+//
+//   spi_cycles  emulated AVR cycles of SPI shifting and delays only; the
+//               CPU work of the driver is not in it
+//   spi         bytes shifted over SPI, command bytes included
+//   host_stack  stack bytes the call used in this x86 build, not on the AVR;
+//               only its changes mean something there
+//
+// Neither column is an AVR figure: without avr-gcc and a simulator the
+// real cycles and stack depth cannot be measured here.
+//
+// The table goes to stdout, tab separated with a '#' header:
+//
+//   ./canbench > bench.tsv
+//
+// With -c it is compared with a saved table instead; rows with more SPI
+// cycles or bytes are listed and the exit status is 1, so "make bench" fails
+// when a driver change makes a hot path dearer.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <string>
+#include <map>
+#include "CAN.h"
+#include "MCP2515_Model.h"
+
+#define BENCH_STACK_SIZE  (64 * 1024)
+#define BENCH_FILL        0xA5
+
+typedef struct
+{
+  uint32_t spiCycles;
+  uint32_t spi;
+  uint32_t hostStack;
+} Sample;
+
+static ucontext_t mainContext, benchContext;
+static uint8_t benchStack[BENCH_STACK_SIZE];
+static void (*benchFn)(void);
+static uint32_t stackBase;
+
+static CAN_Frame frame, received;
+static FILE *table;
+static MCP2515_Buffer raw, sent;
+static uint8_t fresh;
+
+static void trampoline(void)
+{
+  benchFn();
+}
+
+static void nothing(void)
+{
+}
+
+// Runs fn on a painted stack of its own
+static Sample measure(void (*fn)(void))
+{
+  Sample sample;
+  uint64_t cycles;
+  uint32_t spi, i;
+
+  memset(benchStack, BENCH_FILL, sizeof(benchStack));
+  getcontext(&benchContext);
+  benchContext.uc_stack.ss_sp = benchStack;
+  benchContext.uc_stack.ss_size = sizeof(benchStack);
+  benchContext.uc_link = &mainContext;
+  makecontext(&benchContext, trampoline, 0);
+  benchFn = fn;
+  cycles = hostCycles;
+  spi = hostSpiBytes;
+  swapcontext(&mainContext, &benchContext);
+  sample.spiCycles = hostCycles - cycles;
+  sample.spi = hostSpiBytes - spi;
+  // the stack grows down from the end of benchStack
+  for (i = 0; i < sizeof(benchStack) && benchStack[i] == BENCH_FILL; i++)
+  {
+  }
+  sample.hostStack = sizeof(benchStack) - i;
+  sample.hostStack = sample.hostStack > stackBase ? sample.hostStack - stackBase : 0;
+  return sample;
+}
+
+// The frame as the MCP2515 sees it on the bus
+static void makeRaw(void)
+{
+  memset(&raw, 0, sizeof(raw));
+  if (frame.extended)
+  {
+    raw.sidh = frame.id >> 21;
+    raw.sidl = (((frame.id >> 18) & 0x07) << 5) | _BV(MCP2515_EXIDE) | ((frame.id >> 16) & 0x03);
+    raw.eid8 = frame.id >> 8;
+    raw.eid0 = frame.id;
+  }
+  else
+  {
+    raw.sidh = frame.id >> 3;
+    raw.sidl = (frame.id & 0x07) << 5;
+  }
+  raw.dlc = frame.length;
+  memcpy(raw.data, frame.data, sizeof(raw.data));
+}
+
+static void makeFrame(bool extended, uint8_t dlc)
+{
+  uint8_t i;
+
+  memset(&frame, 0, sizeof(frame));
+  frame.extended = extended;
+  frame.valid = true;
+  frame.length = dlc;
+  for (i = 0; i < 8; i++)
+  {
+    frame.data[i] = 0x11 * (i + 1);
+  }
+  // a SWITCH_ACC answer, so the ownCAN paths see a Märklin frame
+  frame.cmd = SWITCH_ACC;
+  frame.resp_bit = true;
+  frame.hash = 0x4711;
+  frame.priority = 0;
+  frame.id = extended ? ((uint32_t)SWITCH_ACC << 17) | 0x10000UL | 0x4711 : 0x123;
+  makeRaw();
+}
+
+static void benchWrite(void)
+{
+  CAN.write(frame);
+}
+
+static void benchSend(void)
+{
+  sendCanFrame(frame);
+}
+
+static void benchAvailable(void)
+{
+  CAN.available();
+}
+
+static void benchRead(void)
+{
+  received = CAN.read();
+}
+
+static void benchGet(void)
+{
+  getCanFrame(received);
+}
+
+static void benchIsr(void)
+{
+  CAN.handleInterrupt();
+}
+
+static void benchFire(void)
+{
+  fireCanFrame(frame, 0, fresh);
+}
+
+static void onTx(const MCP2515_Buffer &frame)
+{
+  sent = frame;
+}
+
+// Clears what a path left behind: TX flags, queued and received frames
+static void settle(uint8_t opts)
+{
+  if (opts & MCP2515_OPT_RXRING)
+  {
+    CAN.handleInterrupt();
+    while (CAN.tryRead(received))
+    {
+    }
+  }
+  else
+  {
+    while (CAN.available())
+    {
+      CAN.read();
+    }
+  }
+  hostMCP.reg[MCP2515_CANINTF] = 0;
+}
+
+// A path that did not get the frame through measures nothing useful
+static void check(const char *mode, const char *path)
+{
+  if (!received.valid || received.id != frame.id || received.length != frame.length ||
+      memcmp(received.data, frame.data, frame.length))
+  {
+    fprintf(stderr, "canbench: %s %s did not return the frame\n", mode, path);
+    exit(2);
+  }
+}
+
+// Same for the frame a fire path put on the bus; SIDH carries the
+// priority ownCAN adds, so the check starts at the hash
+static void checkSent(const char *mode, const char *path)
+{
+  makeRaw();
+  if (memcmp(&sent.eid8, &raw.eid8, 3 + frame.length))
+  {
+    fprintf(stderr, "canbench: %s %s did not send the frame\n", mode, path);
+    exit(2);
+  }
+}
+
+static void row(const char *mode, const char *path, Sample s)
+{
+  fprintf(table, "%s\t%s\t%s\t%u\t%u\t%u\t%u\n", mode, path, frame.extended ? "ext" : "std",
+         frame.length, s.spiCycles, s.spi, s.hostStack);
+}
+
+// fireCanFrame() after armCanFrame() with the last fresh bytes changed in
+// between, as hall2can does with the contact time; must not load it again
+static void fireArmed(const char *mode, const char *path, uint8_t opts)
+{
+  uint16_t hits = CAN.stats.armHits;
+
+  armCanFrame(frame);
+  fresh = frame.length < 2 ? frame.length : 2;
+  if (fresh)
+  {
+    frame.data[frame.length - 1] ^= 0xFF;
+  }
+  memset(&sent, 0, sizeof(sent));
+  row(mode, path, measure(benchFire));
+  settle(opts);
+  checkSent(mode, path);
+  if (CAN.stats.armHits != hits + 1)
+  {
+    fprintf(stderr, "canbench: %s %s loaded the armed frame again\n", mode, path);
+    exit(2);
+  }
+  makeFrame(frame.extended, frame.length);
+}
+
+static void run(const char *mode, uint8_t opts)
+{
+  uint8_t ext, dlc;
+
+  hostReset();
+  hostMCP.onTx = onTx;
+  CAN.begin(CAN_BPS_250K, MCP2515_MODE_NORMAL, opts);
+  for (ext = 0; ext < 2; ext++)
+  {
+    for (dlc = 0; dlc <= 8; dlc++)
+    {
+      makeFrame(ext, dlc);
+
+      row(mode, "write", measure(benchWrite));
+      if (opts & MCP2515_OPT_TXQUEUE)
+      {
+        row(mode, "isr_tx", measure(benchIsr));
+      }
+      settle(opts);
+
+      hostMCP.receive(raw);
+      if (opts & MCP2515_OPT_RXRING)
+      {
+        row(mode, "isr_rx", measure(benchIsr));
+      }
+      row(mode, "available", measure(benchAvailable));
+      memset(&received, 0, sizeof(received));
+      row(mode, "read", measure(benchRead));
+      check(mode, "read");
+      settle(opts);
+
+      // the ownCAN layer only knows Märklin frames
+      if (ext)
+      {
+        row(mode, "sendCanFrame", measure(benchSend));
+        settle(opts);
+        hostMCP.receive(raw);
+        if (opts & MCP2515_OPT_RXRING)
+        {
+          CAN.handleInterrupt();
+        }
+        memset(&received, 0, sizeof(received));
+        row(mode, "getCanFrame", measure(benchGet));
+        check(mode, "getCanFrame");
+        settle(opts);
+      }
+
+      // only TXB0 can be armed, and only with the transmit queue
+      if (ext && (opts & MCP2515_OPT_TXQUEUE))
+      {
+        fresh = 0;
+        memset(&sent, 0, sizeof(sent));
+        row(mode, "fire", measure(benchFire));
+        settle(opts);
+        checkSent(mode, "fire");
+        fireArmed(mode, "fire_armed", opts);
+      }
+    }
+  }
+}
+
+// Lists the rows of the saved table that got dearer; 1 if any
+static int compare(const char *path, const char *current)
+{
+  std::map<std::string, std::pair<unsigned, unsigned> > saved;
+  char line[256], key[128];
+  const char *p;
+  unsigned spiCycles, spi, hostStack, dlc;
+  char mode[16], name[32], format[8];
+  FILE *f = fopen(path, "r");
+  int worse = 0;
+
+  if (!f)
+  {
+    perror(path);
+    return 2;
+  }
+  while (fgets(line, sizeof(line), f))
+  {
+    if (line[0] != '#' &&
+        sscanf(line, "%15s %31s %7s %u %u %u %u", mode, name, format, &dlc, &spiCycles, &spi, &hostStack) == 7)
+    {
+      snprintf(key, sizeof(key), "%s %s %s %u", mode, name, format, dlc);
+      saved[key] = std::make_pair(spiCycles, spi);
+    }
+  }
+  fclose(f);
+  for (p = current; *p; p = strchr(p, '\n') + 1)
+  {
+    if (*p != '#' &&
+        sscanf(p, "%15s %31s %7s %u %u %u %u", mode, name, format, &dlc, &spiCycles, &spi, &hostStack) == 7)
+    {
+      snprintf(key, sizeof(key), "%s %s %s %u", mode, name, format, dlc);
+      if (!saved.count(key))
+      {
+        printf("new   %s: %u SPI cycles, %u SPI bytes\n", key, spiCycles, spi);
+      }
+      else if (spiCycles > saved[key].first || spi > saved[key].second)
+      {
+        printf("worse %s: %u -> %u SPI cycles, %u -> %u SPI bytes\n", key, saved[key].first,
+               spiCycles, saved[key].second, spi);
+        worse = 1;
+      }
+      else if (spiCycles < saved[key].first || spi < saved[key].second)
+      {
+        printf("better %s: %u -> %u SPI cycles, %u -> %u SPI bytes\n", key, saved[key].first,
+               spiCycles, saved[key].second, spi);
+      }
+    }
+  }
+  return worse;
+}
+
+int main(int argc, char **argv)
+{
+  char *current = 0;
+  size_t size = 0;
+  int result = 0;
+
+  table = stdout;
+  if (argc == 3 && !strcmp(argv[1], "-c"))
+  {
+    table = open_memstream(&current, &size);
+  }
+  else if (argc != 1)
+  {
+    fprintf(stderr, "usage: canbench [-c saved.tsv]\n");
+    return 2;
+  }
+  stackBase = measure(nothing).hostStack;
+
+  fprintf(table, "# F_CPU %lu; spi_cycles: SPI shifting and delays only, host_stack: x86 build\n",
+          (unsigned long)F_CPU);
+  fprintf(table, "#mode\tpath\tframe\tdlc\tspi_cycles\tspi\thost_stack\n");
+  run("poll", 0);
+  run("ring", MCP2515_OPT_RXRING | MCP2515_OPT_TXQUEUE | MCP2515_OPT_ROLLOVER);
+
+  if (table != stdout)
+  {
+    fclose(table);
+    result = compare(argv[2], current);
+    free(current);
+  }
+  return result;
+}
@@ -0,0 +1,273 @@
+// cancheck: behaviour of CAN_MCP2515 and ownCAN on the MCP2515 model.
+//
+// Each scenario starts from hostReset() and begin() with the options the
+// firmwares use, drives the model the way the bus would and checks what
+// the driver made of it:
+//
+//   txqueue    a full bulk queue drops the next frame and counts it
+//   rollover   RXB0 rolls over into RXB1 and the ring keeps bus order;
+//              a third frame in the MCP2515 and a full ring are counted
+//   filters    masks and filters let SWITCH_ACC through and keep PING out
+//   fire       fireTx() of the armed frame only sends RTS, another frame
+//              is loaded whole; each counted as hit or miss
+//   hash       a frame of another board with our hash makes getCanFrame()
+//              take a new one
+//
+// Prints every failed check and exits with 1, so "make check" fails.
+
+#include <stdio.h>
+#include <string.h>
+#include "CAN.h"
+#include "MCP2515_Model.h"
+
+static int failures;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(bool ok, const char *what, int line)
+{
+  if (!ok)
+  {
+    fprintf(stderr, "cancheck.cpp:%d: %s\n", line, what);
+    failures++;
+  }
+}
+
+// A Märklin frame as the MCP2515 sees it on the bus
+static MCP2515_Buffer busFrame(uint8_t cmd, uint16_t hash, uint8_t tag)
+{
+  MCP2515_Buffer raw;
+  uint32_t id = ((uint32_t)cmd << 17) | hash;
+
+  memset(&raw, 0, sizeof(raw));
+  raw.sidh = id >> 21;
+  raw.sidl = (((id >> 18) & 0x07) << 5) | _BV(MCP2515_EXIDE) | ((id >> 16) & 0x03);
+  raw.eid8 = id >> 8;
+  raw.eid0 = id;
+  raw.dlc = 1;
+  raw.data[0] = tag;
+  return raw;
+}
+
+static CAN_Frame sendFrame(uint8_t priority, uint8_t tag)
+{
+  CAN_Frame frame;
+
+  memset(&frame, 0, sizeof(frame));
+  frame.id = ((uint32_t)priority << 25) | ((uint32_t)SWITCH_ACC << 17) | 0x4711;
+  frame.extended = CAN_EXTENDED_FRAME;
+  frame.priority = priority;
+  frame.length = 1;
+  frame.data[0] = tag;
+  return frame;
+}
+
+static void start(void)
+{
+  hostReset();
+  hostMCP.autoTx = false;
+  hostMCP.onTx = 0;
+  CAN.begin(CAN_BPS_250K, MCP2515_MODE_NORMAL, MCP2515_OPTS);
+  CAN.clearFilters();
+  memset(&CAN.stats, 0, sizeof(CAN.stats));
+}
+
+// Sends the frame of the TX buffer the MCP2515 picks on the bus, as cansim does
+static MCP2515_Buffer busSend(void)
+{
+  MCP2515_Buffer raw;
+  int8_t n = hostMCP.pendingTx();
+
+  memset(&raw, 0, sizeof(raw));
+  if (n >= 0)
+  {
+    raw = hostMCP.txFrame(n);
+    hostMCP.txDone(n);
+    CAN.handleInterrupt();
+  }
+  return raw;
+}
+
+// true if the next frame on the bus is raw; bytes past the DLC do not go out
+static bool sent(const MCP2515_Buffer &raw)
+{
+  MCP2515_Buffer bus = busSend();
+
+  return !memcmp(&bus, &raw, 5 + (raw.dlc & MCP2515_DLC));
+}
+
+static void txQueue(void)
+{
+  uint8_t i;
+
+  start();
+  // nothing leaves TXB0: it takes the first frame, the queue the next ones
+  for (i = 0; i < 1 + CAN_TX_QUEUE_SIZE; i++)
+  {
+    CHECK(CAN.tryWrite(sendFrame(PRIO_BULK, i)));
+  }
+  CHECK(CAN.txFree(PRIO_BULK) == 0);
+  CHECK(!CAN.tryWrite(sendFrame(PRIO_BULK, 0xEE)));
+  CHECK(CAN.stats.txDrops == 1);
+  // the other classes have queues of their own
+  CHECK(CAN.tryWrite(sendFrame(PRIO_FEEDBACK, 0xF0)));
+  CHECK(CAN.stats.txDrops == 1);
+  CHECK(busSend().data[0] == 0xF0);
+  // the bulk frames leave in the order they were written
+  for (i = 0; i < 1 + CAN_TX_QUEUE_SIZE; i++)
+  {
+    CHECK(busSend().data[0] == i);
+  }
+  CHECK(hostMCP.pendingTx() < 0);
+  CHECK(CAN.txFree(PRIO_BULK) == CAN_TX_QUEUE_SIZE);
+}
+
+static void rollover(void)
+{
+  CAN_Frame frame;
+  uint8_t i;
+
+  start();
+  // RXB0 is full, the next frame rolls over into RXB1, the third is lost
+  CHECK(hostMCP.receive(busFrame(SWITCH_ACC, 0x4711, 1)));
+  CHECK(hostMCP.receive(busFrame(SWITCH_ACC, 0x4711, 2)));
+  CHECK(!hostMCP.receive(busFrame(SWITCH_ACC, 0x4711, 3)));
+  CAN.handleInterrupt();
+  CHECK(CAN.stats.hwOverruns == 1);
+  CHECK(CAN.tryRead(frame) && frame.data[0] == 1);
+  CHECK(CAN.tryRead(frame) && frame.data[0] == 2);
+  CHECK(!CAN.tryRead(frame));
+
+  // a full ring keeps its frames and counts the ones it had to drop
+  for (i = 0; i < CAN_RX_RING_SIZE + 2; i++)
+  {
+    hostMCP.receive(busFrame(SWITCH_ACC, 0x4711, i));
+    CAN.handleInterrupt();
+  }
+  CHECK(CAN.stats.rxOverruns == 2);
+  CHECK(CAN.stats.rxHighWater == CAN_RX_RING_SIZE);
+  for (i = 0; i < CAN_RX_RING_SIZE; i++)
+  {
+    CHECK(CAN.tryRead(frame) && frame.data[0] == i);
+  }
+  CHECK(!CAN.tryRead(frame));
+
+  // polled: once RXB0 was read while RXB1 waits, RXB1 holds the older frame
+  CAN.begin(CAN_BPS_250K, MCP2515_MODE_NORMAL, MCP2515_OPT_ROLLOVER);
+  CHECK(hostMCP.receive(busFrame(SWITCH_ACC, 0x4711, 4)));
+  CHECK(hostMCP.receive(busFrame(SWITCH_ACC, 0x4711, 5)));
+  CHECK(CAN.tryRead(frame) && frame.data[0] == 4);
+  CHECK(hostMCP.receive(busFrame(SWITCH_ACC, 0x4711, 6)));
+  CHECK(CAN.tryRead(frame) && frame.data[0] == 5);
+  CHECK(CAN.tryRead(frame) && frame.data[0] == 6);
+  CHECK(!CAN.tryRead(frame));
+}
+
+static void filters(void)
+{
+  CAN_Filter mask, filter;
+  CAN_Frame frame;
+  uint8_t n;
+
+  start();
+  memset(&mask, 0, sizeof(mask));
+  mask.id = 0xFFUL << 17;
+  mask.extended = CAN_EXTENDED_FRAME;
+  filter = mask;
+  filter.id = (uint32_t)SWITCH_ACC << 17;
+  CHECK(CAN.setMask(0, mask) && CAN.setMask(1, mask));
+  for (n = 0; n < 6; n++)
+  {
+    CHECK(CAN.setFilter(n, filter));
+  }
+  CHECK(CAN.enableFilters());
+  CHECK(hostMCP.mode() == MCP2515_MODE_NORMAL);
+
+  CHECK(!hostMCP.receive(busFrame(PING, 0x4711, 1)));
+  CHECK(hostMCP.receive(busFrame(SWITCH_ACC, 0x4711, 2)));
+  CHECK(!hostMCP.receive(busFrame(S88_EVENT, 0x4711, 3)));
+  CAN.handleInterrupt();
+  CHECK(CAN.tryRead(frame) && frame.data[0] == 2);
+  CHECK(!CAN.tryRead(frame));
+  CHECK(CAN.stats.hwOverruns == 0);
+
+  // without them everything comes in again
+  CAN.clearFilters();
+  CHECK(hostMCP.receive(busFrame(PING, 0x4711, 4)));
+  CAN.handleInterrupt();
+  CHECK(CAN.tryRead(frame) && frame.data[0] == 4);
+}
+
+static void fire(void)
+{
+  MCP2515_Buffer raw = busFrame(S88_EVENT, 0x4711, 0x11), other, loaded;
+  uint32_t spi;
+
+  start();
+  raw.dlc = 8;
+  CHECK(CAN.armTx(raw));
+  CHECK(hostMCP.pendingTx() < 0);
+  // armed: RTS and the two fresh bytes only
+  raw.data[6] = 0x12;
+  raw.data[7] = 0x34;
+  spi = hostSpiBytes;
+  CHECK(CAN.fireTx(raw, 0, 2));
+  CHECK(hostSpiBytes - spi <= 5);
+  CHECK(CAN.stats.armHits == 1 && CAN.stats.armMisses == 0);
+  loaded = hostMCP.txFrame(0);
+  CHECK(!memcmp(&loaded, &raw, sizeof(raw)));
+  CHECK(sent(raw));
+
+  // another frame than the armed one is loaded whole
+  CHECK(CAN.armTx(raw));
+  other = busFrame(S88_EVENT, 0x4711, 0x22);
+  CHECK(CAN.fireTx(other, 0, 0));
+  CHECK(CAN.stats.armHits == 1 && CAN.stats.armMisses == 1);
+  CHECK(sent(other));
+
+  // a bulk frame took TXB0 back: the next fire is a miss as well
+  CHECK(CAN.armTx(raw));
+  CHECK(CAN.tryWrite(sendFrame(PRIO_BULK, 0x33)));
+  CHECK(busSend().data[0] == 0x33);
+  CHECK(CAN.fireTx(raw, 0, 2));
+  CHECK(CAN.stats.armHits == 1 && CAN.stats.armMisses == 2);
+  CHECK(sent(raw));
+}
+
+static void hash(void)
+{
+  CAN_Frame frame;
+  uint16_t own;
+
+  start();
+  CAN.hash = own = CAN_HASH(UID_BASE);
+  hashCollisions = 0;
+  // someone else's hash: nothing changes
+  hostMCP.receive(busFrame(PING, own ^ 0x0100, 1));
+  CAN.handleInterrupt();
+  CHECK(getCanFrame(frame));
+  CHECK(CAN.hash == own && hashCollisions == 0);
+  // our own hash from the bus: the frame still comes in, the hash changes
+  hostMCP.receive(busFrame(PING, own, 2));
+  CAN.handleInterrupt();
+  CHECK(getCanFrame(frame) && frame.data[0] == 2);
+  CHECK(CAN.hash != own && hashCollisions == 1);
+  CHECK((CAN.hash & 0x0380) == 0x0300);
+  CHECK(!getCanFrame(frame));
+}
+
+int main(void)
+{
+  txQueue();
+  rollover();
+  filters();
+  fire();
+  hash();
+  if (failures)
+  {
+    fprintf(stderr, "cancheck: %d checks failed\n", failures);
+    return 1;
+  }
+  printf("cancheck: all scenarios passed\n");
+  return 0;
+}
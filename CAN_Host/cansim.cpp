@@ -0,0 +1,993 @@
+// cansim: virtual CAN bus for the firmwares built by "make nodes".
+//
+// Every node is a private copy of nodes/<type>.so, i.e. the unchanged
+// firmware sources with CAN_Lib, the MCP2515 model and the host ports. The
+// bus arbitrates by identifier among the nodes with a transmit request,
+// holds the winner for the exact length of its frame (bit stuffing
+// included) and then hands it to all other nodes. Nodes run as coroutines
+// up to the end of the frame on the bus, or one quantum while it is idle.
+//
+//   cansim [options] Type[=count] ...
+//
+//   -t s        simulated seconds (10)
+//   -b bps      bitrate of the bus (250000)
+//   -l cycles   CPU cycles charged per pass of loop() (400)
+//   -q cycles   time step while the bus is idle (256)
+//   -w ms       warm-up, not counted in the results (1000)
+//   -c config   options of the cs2 node, see cs2/main.cpp; accs= defaults
+//               to all accessories of the NanoApp boards
+//   -s ms       every ms one feedback contact closes for 50 ms, on the
+//               hall2can boards in turn (0 = none)
+//   -r n        each contact closes n times in a row, like the axles of a
+//               train passing it (1)
+//   -S a:b:n    runs again for cs2 load=a, a+n, .. b frames/s, one line each
+//   -f          exit status 1 if a frame went missing after the warm-up:
+//               SWITCH_ACC not answered, contact or S88_Polling without its
+//               S88_EVENT, a dropped or overrun frame in any node
+//   -v          prints every frame
+//   -p          serial port of each usb2can and can2usb on a pseudo terminal,
+//               path on stderr; the simulation then keeps to wall-clock time
+//
+// Example: 20 servo boards, 8 feedback boards, a CS2 pinging every second
+// and switching every 20 ms, a contact every 10 ms:
+//
+//   ./cansim -c "switch=20" -s 10 NanoApp=20 hall2can=8 cs2
+//
+// A hall2can board reads its contacts again 250 ms after a closure and
+// another 250 ms after the release that follows; a contact of the same
+// board closing in between has no S88_EVENT. With 8 boards a contact every
+// 80 ms is slow enough, "make check" runs that with -f, once more with the
+// CS2 sending S88_Polling, which every board answers with 8 frames at once.
+//
+// hall2can arms the S88_EVENT of the contact that changed last. Contacts
+// closing again, slower than that, show whether the events go out
+// pre-armed ("n of m fired pre-armed"): all but the first of each contact
+// should.
+//
+//   ./cansim -t 12 -s 600 -r 4 hall2can cs2
+//
+// usb2can speaks the ASCII protocol of hex2usb at 19200 baud; binlink is
+// usb2can built with "#define binlink", the binary frames u2clink sends.
+// slcan is usb2can built with "#define slcan", a SLCAN (Lawicel) adapter
+// for slcand; with -p a script can drive it like the real one. capture is
+// can2usb built with "#define capture", read with "u2clink -b 2000000 tty
+// capture"; busstats is can2usb with "#define busstats", its summaries
+// come out on the pseudo terminal at 19200 baud.
+//
+// NanoApp, NanoBase and hall2can boards are numbered 1, 2, .. before the
+// run: each one boots alone, gets FOR_APP BOARDNUM_CHANGE and starts on the
+// bus with the EEPROM that left behind.
+//
+// A PC program talks to a gateway through its pseudo terminal as through
+// the USB serial port, e.g. u2clink (see u2clink.cpp) with binlink:
+//
+//   ./cansim -p -t 60 binlink NanoApp &
+//   ./u2clink /dev/pts/N ask 00
+//
+// The CPU time of the firmware is only what the host ports charge (SPI
+// bytes, delays, serial output) plus the fixed cost per loop(); it is a
+// lower bound, -l moves it towards the real one.
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "host_node.h"
+
+#define F_CPU             16000000ULL
+
+#define CMD_SWITCH_ACC    0x0B
+#define CMD_S88_POLLING   0x10
+#define CMD_S88_EVENT     0x11
+#define CMD_FOR_APP       0x52
+#define BOARDNUM_CHANGE   2
+
+#define CONTACT_MS        50     // a contact stays closed this long
+#define ANSWER_MS         250    // SWITCH_ACC without answer after this is lost
+#define POLL_ANSWERS      8      // S88_EVENT per hall2can for S88_Polling, one module
+
+typedef struct
+{
+  const char *type;
+  bool numbered;        // takes FOR_APP BOARDNUM_CHANGE
+  bool gateway;         // serial port to the PC, see -p
+} NodeType;
+
+static const NodeType nodeTypes[] =
+{
+  {"NanoApp", true},
+  {"NanoBase", true},
+  {"hall2can", true},
+  {"usb2can", false, true},
+  {"can2usb", false, true},
+  {"binlink", false, true},
+  {"slcan", false, true},
+  {"capture", false, true},
+  {"busstats", false, true},
+  {"cs2", false},
+};
+
+struct Node
+{
+  const NodeType *type;
+  unsigned board;
+  void *so;
+  NodeStartFn start;
+  NodeRunFn run;
+  NodeClockFn clock;
+  NodePendingTxFn pendingTx;
+  NodeTxDoneFn txDone;
+  NodeReceiveFn receive;
+  NodePcfInputFn pcfInput;
+  NodeStatsFn stats;
+  NodeEepromFn eeprom;
+  NodeSerialReadFn serialRead;
+  NodeSerialWriteFn serialWrite;
+
+  int pty, ptySlave;    // master side and the slave kept open, -p only
+  std::string ptyIn;    // from the PC, not yet taken by the node
+  uint32_t framesOut;
+  bool waiting;         // TX request seen, frame not on the bus yet
+  uint64_t waitFrom, waitMax;
+  uint8_t pins;         // inputs of PCF8574 0 (hall2can)
+  uint64_t releaseAt;
+  uint32_t closures, events;
+  uint32_t pollAnswers;
+  NodeStats atWarmup;   // losses count from the end of the warm-up
+};
+
+// Outstanding SWITCH_ACC of the cs2
+struct Switch
+{
+  uint8_t pos;
+  uint64_t at;
+  bool answered;
+};
+
+struct Result
+{
+  double busLoad;
+  uint32_t frames;
+  uint32_t switches, switchesLost;
+  uint64_t switchLatencyMax, switchLatencySum;
+  uint32_t closures, eventsLost;
+  uint32_t polls, pollAnswers, pollAnswersLost;
+  uint32_t armHits, armMisses;  // fireTx() of the hall2can nodes
+  uint32_t rxOverruns, txDrops, hwOverruns;
+};
+
+static const char *nodeDir;
+static char tmpDir[] = "/tmp/cansimXXXXXX";
+static unsigned loaded;
+
+static uint32_t bitrate = 250000;
+static uint32_t loopCycles = 400;
+static uint64_t quantum = 256;
+static uint64_t warmup = F_CPU;
+static uint64_t contactPeriod;
+static uint32_t contactRepeat = 1;
+static bool verbose;
+static bool ptys;
+static bool failOnLoss;
+
+static std::map<std::string, std::vector<uint8_t> > eepromCache;
+
+static void *symbol(void *so, const char *name)
+{
+  void *sym = dlsym(so, name);
+
+  if (!sym)
+  {
+    fprintf(stderr, "cansim: %s\n", dlerror());
+    exit(1);
+  }
+  return sym;
+}
+
+// Loads a private copy of nodes/<type>.so: dlopen() hands out the same
+// object again for the same file, the globals have to be per node
+static void loadNode(Node &node, const NodeType *type, unsigned board)
+{
+  char src[512], dst[512], buf[65536];
+  FILE *in, *out;
+  size_t n;
+
+  node = Node();
+  node.type = type;
+  node.board = board;
+  node.pins = 0xFF;
+  snprintf(src, sizeof(src), "%s/%s.so", nodeDir, type->type);
+  snprintf(dst, sizeof(dst), "%s/%s-%u.so", tmpDir, type->type, loaded++);
+  in = fopen(src, "rb");
+  out = fopen(dst, "wb");
+  if (!in || !out)
+  {
+    fprintf(stderr, "cansim: cannot copy %s, run make nodes\n", src);
+    exit(1);
+  }
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+  {
+    fwrite(buf, 1, n, out);
+  }
+  fclose(in);
+  fclose(out);
+  node.so = dlopen(dst, RTLD_NOW | RTLD_LOCAL);
+  unlink(dst);
+  if (!node.so)
+  {
+    fprintf(stderr, "cansim: %s\n", dlerror());
+    exit(1);
+  }
+  node.start = (NodeStartFn)symbol(node.so, "nodeStart");
+  node.run = (NodeRunFn)symbol(node.so, "nodeRun");
+  node.clock = (NodeClockFn)symbol(node.so, "nodeClock");
+  node.pendingTx = (NodePendingTxFn)symbol(node.so, "nodePendingTx");
+  node.txDone = (NodeTxDoneFn)symbol(node.so, "nodeTxDone");
+  node.receive = (NodeReceiveFn)symbol(node.so, "nodeReceive");
+  node.pcfInput = (NodePcfInputFn)symbol(node.so, "nodePcfInput");
+  node.stats = (NodeStatsFn)symbol(node.so, "nodeStats");
+  node.eeprom = (NodeEepromFn)symbol(node.so, "nodeEeprom");
+  node.serialRead = (NodeSerialReadFn)symbol(node.so, "nodeSerialRead");
+  node.serialWrite = (NodeSerialWriteFn)symbol(node.so, "nodeSerialWrite");
+}
+
+// Pseudo terminal in raw mode for the serial port of node; the slave stays
+// open so the master keeps working while no PC program has it open
+static void openPty(Node &node)
+{
+  struct termios tio;
+  const char *name;
+
+  node.pty = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (node.pty < 0 || grantpt(node.pty) || unlockpt(node.pty) || !(name = ptsname(node.pty)))
+  {
+    perror("cansim: pty");
+    exit(1);
+  }
+  node.ptySlave = open(name, O_RDWR | O_NOCTTY);
+  if (node.ptySlave < 0 || tcgetattr(node.ptySlave, &tio))
+  {
+    perror(name);
+    exit(1);
+  }
+  cfmakeraw(&tio);
+  tcsetattr(node.ptySlave, TCSANOW, &tio);
+  fprintf(stderr, "%s#%u: %s\n", node.type->type, node.board, name);
+}
+
+// Bytes from the PC to the node as far as its input takes them, and all
+// the node wrote back to the PC
+static void bridgePty(Node &node)
+{
+  char buf[256];
+  ssize_t n;
+  size_t taken;
+
+  if (node.ptyIn.size() < sizeof(buf) && (n = read(node.pty, buf, sizeof(buf))) > 0)
+  {
+    node.ptyIn.append(buf, n);
+  }
+  if (!node.ptyIn.empty())
+  {
+    taken = node.serialWrite(node.ptyIn.data(), node.ptyIn.size());
+    node.ptyIn.erase(0, taken);
+  }
+  while ((n = node.serialRead(buf, sizeof(buf))) > 0)
+  {
+    // nobody reading the slave: the output is lost as on an unplugged USB port
+    if (write(node.pty, buf, n) < 0)
+    {
+      break;
+    }
+  }
+}
+
+// Waits until wall-clock time since start has caught up with cycle now
+static void keepPace(const struct timespec &start, uint64_t now)
+{
+  struct timespec t, wait;
+  int64_t ahead;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  ahead = (int64_t)(now * 1000000000ULL / F_CPU) -
+          ((int64_t)(t.tv_sec - start.tv_sec) * 1000000000LL + (t.tv_nsec - start.tv_nsec));
+  // one sleep per millisecond is plenty for a serial port
+  if (ahead > 1000000)
+  {
+    wait.tv_sec = ahead / 1000000000LL;
+    wait.tv_nsec = ahead % 1000000000LL;
+    nanosleep(&wait, 0);
+  }
+}
+
+// Märklin identifier: prio << 25 | cmd << 17 | resp << 16 | hash
+static uint32_t frameId(const NodeFrame &f)
+{
+  return ((uint32_t)f.sidh << 21) | ((uint32_t)(f.sidl >> 5) << 18) |
+         ((uint32_t)(f.sidl & 0x03) << 16) | ((uint32_t)f.eid8 << 8) | f.eid0;
+}
+
+static NodeFrame makeFrame(uint32_t id, const uint8_t *data, uint8_t dlc)
+{
+  NodeFrame f;
+
+  f.sidh = id >> 21;
+  f.sidl = (((id >> 18) & 0x07) << 5) | 0x08 | ((id >> 16) & 0x03);
+  f.eid8 = id >> 8;
+  f.eid0 = id;
+  f.dlc = dlc;
+  memset(f.data, 0, sizeof(f.data));
+  memcpy(f.data, data, dlc);
+  return f;
+}
+
+// Arbitration order: SID, then SRR/RTR, IDE, EID, RTR; lower wins
+static uint64_t arbitrationKey(const NodeFrame &f)
+{
+  uint64_t sid = ((uint64_t)f.sidh << 3) | (f.sidl >> 5);
+  bool ext = (f.sidl & 0x08) != 0;
+  bool rtr = (f.dlc & 0x40) != 0;
+
+  if (!ext)
+  {
+    return (sid << 21) | ((uint64_t)rtr << 20);
+  }
+  return (sid << 21) | (1ULL << 20) | (1ULL << 19) |
+         ((uint64_t)(frameId(f) & 0x3FFFF) << 1) | rtr;
+}
+
+// Bits on the wire: SOF to CRC with stuff bits, then CRC delimiter, ACK
+// slot and delimiter, EOF and intermission
+static unsigned frameBits(const NodeFrame &f)
+{
+  uint8_t bits[160];
+  unsigned n = 0, i, total, run;
+  uint16_t crc = 0;
+  uint32_t sid = ((uint32_t)f.sidh << 3) | (f.sidl >> 5);
+  bool ext = (f.sidl & 0x08) != 0;
+  bool rtr = (f.dlc & 0x40) != 0;
+  uint8_t dlc = f.dlc & 0x0F;
+  uint8_t len = rtr ? 0 : (dlc > 8 ? 8 : dlc);
+  uint8_t prev;
+
+#define PUSH(value, width) \
+  for (int b = (width) - 1; b >= 0; b--) bits[n++] = ((value) >> b) & 1
+
+  PUSH(0, 1);
+  PUSH(sid, 11);
+  if (ext)
+  {
+    PUSH(3, 2);
+    PUSH(frameId(f) & 0x3FFFF, 18);
+    PUSH(rtr, 1);
+    PUSH(0, 2);
+  }
+  else
+  {
+    PUSH(rtr, 1);
+    PUSH(0, 2);
+  }
+  PUSH(dlc, 4);
+  for (i = 0; i < len; i++)
+  {
+    PUSH(f.data[i], 8);
+  }
+  for (i = 0; i < n; i++)
+  {
+    bool next = bits[i] ^ ((crc >> 14) & 1);
+
+    crc = (crc << 1) & 0x7FFF;
+    if (next)
+    {
+      crc ^= 0x4599;
+    }
+  }
+  PUSH(crc, 15);
+#undef PUSH
+
+  total = n;
+  prev = bits[0];
+  run = 1;
+  for (i = 1; i < n; i++)
+  {
+    if (bits[i] == prev)
+    {
+      run++;
+    }
+    else
+    {
+      prev = bits[i];
+      run = 1;
+    }
+    if (run == 5)
+    {
+      // the stuff bit is the complement and starts the next run
+      total++;
+      prev ^= 1;
+      run = 1;
+    }
+  }
+  return total + 13;
+}
+
+// Lets a node run on its own until cycle until; its frames leave at once
+static void runAlone(Node &node, uint64_t until)
+{
+  NodeFrame frame;
+  uint64_t t = node.clock();
+  int8_t n;
+
+  while (t < until)
+  {
+    t += F_CPU / 1000;
+    node.run(t);
+    n = node.pendingTx(&frame);
+    if (n >= 0)
+    {
+      node.txDone(n);
+    }
+  }
+}
+
+// EEPROM of board number board, as FOR_APP BOARDNUM_CHANGE leaves it
+static const uint8_t *boardEeprom(const NodeType *type, unsigned board)
+{
+  char key[64];
+  uint8_t data[5];
+  NodeFrame frame;
+  Node node;
+
+  snprintf(key, sizeof(key), "%s/%u", type->type, board);
+  std::vector<uint8_t> &image = eepromCache[key];
+  if (image.empty())
+  {
+    loadNode(node, type, board);
+    node.start(bitrate, loopCycles, 0, "");
+    runAlone(node, F_CPU / 2);
+    data[0] = BOARDNUM_CHANGE;
+    data[1] = '0';
+    data[2] = '0';
+    data[3] = '0' + board / 10;
+    data[4] = '0' + board % 10;
+    frame = makeFrame((uint32_t)CMD_FOR_APP << 17, data, sizeof(data));
+    node.receive(&frame);
+    runAlone(node, F_CPU);
+    image.resize(NODE_EEPROM_SIZE);
+    node.eeprom(&image[0]);
+    dlclose(node.so);
+  }
+  return &image[0];
+}
+
+static void printFrame(uint64_t now, const Node &from, const NodeFrame &f)
+{
+  uint8_t i, len = f.dlc & 0x0F;
+
+  printf("%10.3f %8s#%-2u %08x [%u]", now * 1000.0 / F_CPU, from.type->type,
+         from.board, frameId(f), len);
+  for (i = 0; i < len && i < 8; i++)
+  {
+    printf(" %02x", f.data[i]);
+  }
+  printf("\n");
+}
+
+static uint32_t contacts;
+
+// Closes the next contact, on the hall2can boards in turn
+static void closeContact(std::vector<Node> &nodes, uint64_t now)
+{
+  std::vector<Node *> boards;
+  size_t i;
+
+  for (i = 0; i < nodes.size(); i++)
+  {
+    if (!strcmp(nodes[i].type->type, "hall2can"))
+    {
+      boards.push_back(&nodes[i]);
+    }
+  }
+  if (boards.empty())
+  {
+    return;
+  }
+  uint32_t n = contacts / contactRepeat;
+  Node &node = *boards[n % boards.size()];
+  uint8_t bit = 1 << ((n / boards.size()) % 8);
+  contacts++;
+  if ((node.pins & bit) == 0)
+  {
+    // still held from last time
+    return;
+  }
+  node.pins &= ~bit;
+  node.releaseAt = now + CONTACT_MS * (F_CPU / 1000);
+  node.pcfInput(0, node.pins);
+  if (now >= warmup)
+  {
+    node.closures++;
+  }
+}
+
+static void printReport(std::vector<Node> &nodes, const Result &r, uint64_t end)
+{
+  std::map<const NodeType *, std::vector<Node *> > byType;
+  std::map<const NodeType *, std::vector<Node *> >::iterator t;
+  double seconds = (double)(end - warmup) / F_CPU;
+  size_t i;
+
+  for (i = 0; i < nodes.size(); i++)
+  {
+    byType[nodes[i].type].push_back(&nodes[i]);
+  }
+  printf("%.1f s at %u bit/s after %.1f s warm-up: %u frames, bus load %.1f %%\n",
+         seconds, bitrate, (double)warmup / F_CPU, r.frames, r.busLoad);
+  printf("%-9s %4s %8s %6s %6s %6s %6s %6s %5s %8s %6s %7s %9s %9s %7s\n", "type", "n", "frames",
+         "rxOvr", "rxHigh", "drops", "hwOvr", "merr", "hash", "arm us", "isr us", "task us",
+         "wait max", "SPI B/s", "sleep%");
+  for (t = byType.begin(); t != byType.end(); ++t)
+  {
+    uint32_t frames = 0, rxOverruns = 0, rxHighWater = 0, txDrops = 0;
+    uint32_t hwOverruns = 0, msgErrors = 0, armLatency = 0, isrMax = 0, taskMax = 0;
+    uint32_t hashCollisions = 0;
+    uint64_t waitMax = 0, spiBytes = 0, sleep = 0;
+
+    for (i = 0; i < t->second.size(); i++)
+    {
+      Node &node = *t->second[i];
+      NodeStats stats;
+
+      node.stats(&stats);
+      frames += node.framesOut;
+      rxOverruns += stats.rxOverruns - node.atWarmup.rxOverruns;
+      txDrops += stats.txDrops - node.atWarmup.txDrops;
+      hwOverruns += stats.hwOverruns - node.atWarmup.hwOverruns;
+      msgErrors += stats.msgErrors - node.atWarmup.msgErrors;
+      hashCollisions += stats.hashCollisions;
+      spiBytes += stats.spiBytes;
+      sleep += stats.sleepCycles;
+      if (stats.rxHighWater > rxHighWater)
+      {
+        rxHighWater = stats.rxHighWater;
+      }
+      if (stats.armLatencyMax > armLatency)
+      {
+        armLatency = stats.armLatencyMax;
+      }
+      if (stats.isrMax > isrMax)
+      {
+        isrMax = stats.isrMax;
+      }
+      if (stats.taskMax > taskMax)
+      {
+        taskMax = stats.taskMax;
+      }
+      if (node.waitMax > waitMax)
+      {
+        waitMax = node.waitMax;
+      }
+    }
+    printf("%-9s %4u %8u %6u %6u %6u %6u %6u %5u %8u %6u %7u %7.2fms %9.0f %6.1f%%\n",
+           t->first->type, (unsigned)t->second.size(), frames, rxOverruns, rxHighWater, txDrops,
+           hwOverruns, msgErrors, hashCollisions, armLatency, isrMax, taskMax,
+           waitMax * 1000.0 / F_CPU,
+           spiBytes / ((double)end / F_CPU) / t->second.size(),
+           100.0 * sleep / end / t->second.size());
+  }
+  if (r.switches)
+  {
+    printf("SWITCH_ACC: %u sent, %u not answered, latency avg %.2f ms max %.2f ms\n",
+           r.switches, r.switchesLost,
+           r.switches > r.switchesLost ? r.switchLatencySum * 1000.0 / F_CPU / (r.switches - r.switchesLost) : 0.0,
+           r.switchLatencyMax * 1000.0 / F_CPU);
+  }
+  if (r.closures)
+  {
+    printf("S88_EVENT: %u contacts closed, %u without event, %u of %u fired pre-armed\n",
+           r.closures, r.eventsLost, r.armHits, r.armHits + r.armMisses);
+  }
+  if (r.polls)
+  {
+    printf("S88_Polling: %u sent, %u of %u S88_EVENT answers missing\n", r.polls,
+           r.pollAnswersLost, r.pollAnswers);
+  }
+}
+
+// Frames that went missing after the warm-up, see -f
+static uint32_t framesLost(const Result &r)
+{
+  return r.switchesLost + r.eventsLost + r.pollAnswersLost + r.rxOverruns + r.txDrops + r.hwOverruns;
+}
+
+static Result simulate(const std::vector<const NodeType *> &types, const std::string &config,
+                       uint64_t end, bool report)
+{
+  std::vector<Node> nodes(types.size());
+  std::map<unsigned, unsigned> boards;
+  std::map<uint16_t, Switch> switches;
+  std::map<uint16_t, Switch>::iterator sw;
+  Result result;
+  Node *sender = 0;
+  NodeFrame frame, candidate;
+  uint64_t now = 0, busEnd = 0, busy = 0, horizon, key, best;
+  uint64_t bit = F_CPU / bitrate, nextContact = warmup;
+  uint32_t id;
+  uint16_t locid;
+  uint8_t cmd, txb = 0;
+  int8_t n;
+  size_t i;
+  bool counting = false, pollCounted = false;
+  char sink[256];
+  struct timespec start;
+
+  memset(&result, 0, sizeof(result));
+  for (i = 0; i < types.size(); i++)
+  {
+    unsigned board = ++boards[types[i] - nodeTypes];
+    const uint8_t *eeprom = types[i]->numbered ? boardEeprom(types[i], board) : 0;
+
+    loadNode(nodes[i], types[i], board);
+    nodes[i].start(bitrate, loopCycles, eeprom, !strcmp(types[i]->type, "cs2") ? config.c_str() : "");
+    if (ptys && types[i]->gateway)
+    {
+      openPty(nodes[i]);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (now < end)
+  {
+    if (!sender)
+    {
+      best = UINT64_MAX;
+      for (i = 0; i < nodes.size(); i++)
+      {
+        n = nodes[i].pendingTx(&candidate);
+        if (n < 0)
+        {
+          nodes[i].waiting = false;
+          continue;
+        }
+        if (!nodes[i].waiting)
+        {
+          nodes[i].waiting = true;
+          nodes[i].waitFrom = now;
+        }
+        key = arbitrationKey(candidate);
+        if (key < best)
+        {
+          best = key;
+          sender = &nodes[i];
+          frame = candidate;
+          txb = n;
+        }
+      }
+      if (sender)
+      {
+        busEnd = now + frameBits(frame) * bit;
+        if (now >= warmup)
+        {
+          busy += busEnd - now;
+          uint64_t wait = now - sender->waitFrom;
+          if (wait > sender->waitMax)
+          {
+            sender->waitMax = wait;
+          }
+        }
+        sender->waiting = false;
+      }
+    }
+    horizon = sender ? busEnd : now + quantum;
+    if (contactPeriod && nextContact < horizon)
+    {
+      horizon = nextContact > now ? nextContact : now;
+    }
+    if (horizon > end)
+    {
+      horizon = end;
+    }
+    for (i = 0; i < nodes.size(); i++)
+    {
+      if (nodes[i].pty)
+      {
+        bridgePty(nodes[i]);
+      }
+      nodes[i].run(horizon);
+      if (nodes[i].pty)
+      {
+        bridgePty(nodes[i]);
+      }
+      else
+      {
+        while (nodes[i].serialRead(sink, sizeof(sink)) > 0)
+        {
+        }
+      }
+    }
+    now = horizon;
+    if (ptys)
+    {
+      keepPace(start, now);
+    }
+    if (!counting && now >= warmup)
+    {
+      counting = true;
+      for (i = 0; i < nodes.size(); i++)
+      {
+        nodes[i].stats(&nodes[i].atWarmup);
+      }
+    }
+
+    if (sender && now >= busEnd)
+    {
+      sender->txDone(txb);
+      for (i = 0; i < nodes.size(); i++)
+      {
+        if (&nodes[i] != sender)
+        {
+          nodes[i].receive(&frame);
+        }
+      }
+      if (verbose)
+      {
+        printFrame(now, *sender, frame);
+      }
+      id = frameId(frame);
+      cmd = id >> 17;
+      locid = (frame.data[2] << 8) | frame.data[3];
+      if (now >= warmup)
+      {
+        sender->framesOut++;
+        result.frames++;
+        if (cmd == CMD_SWITCH_ACC && !(id & 0x10000) && !strcmp(sender->type->type, "cs2"))
+        {
+          sw = switches.find(locid);
+          if (sw != switches.end() && !sw->second.answered)
+          {
+            result.switchesLost++;
+          }
+          switches[locid].pos = frame.data[4];
+          switches[locid].at = now;
+          switches[locid].answered = false;
+          result.switches++;
+        }
+        else if (cmd == CMD_SWITCH_ACC && (id & 0x10000) && !strcmp(sender->type->type, "NanoApp"))
+        {
+          sw = switches.find(locid);
+          if (sw != switches.end() && !sw->second.answered && sw->second.pos == frame.data[4])
+          {
+            sw->second.answered = true;
+            result.switchLatencySum += now - sw->second.at;
+            if (now - sw->second.at > result.switchLatencyMax)
+            {
+              result.switchLatencyMax = now - sw->second.at;
+            }
+          }
+        }
+        else if (cmd == CMD_S88_POLLING && !(id & 0x10000) && !strcmp(sender->type->type, "cs2"))
+        {
+          // no answers expected for a poll near the end, as for contacts
+          pollCounted = now + F_CPU / 2 < end;
+          result.polls += pollCounted;
+        }
+        else if (cmd == CMD_S88_EVENT && !strcmp(sender->type->type, "hall2can"))
+        {
+          // s88Polling() reports each contact as opened with time 0
+          if (frame.data[4] == 1 && frame.data[5] == 0 && !frame.data[6] && !frame.data[7])
+          {
+            sender->pollAnswers += pollCounted;
+          }
+          else
+          {
+            sender->events++;
+          }
+        }
+      }
+      sender = 0;
+    }
+    for (i = 0; i < nodes.size(); i++)
+    {
+      if (nodes[i].releaseAt && nodes[i].releaseAt <= now)
+      {
+        nodes[i].releaseAt = 0;
+        nodes[i].pins = 0xFF;
+        nodes[i].pcfInput(0, nodes[i].pins);
+      }
+    }
+    // no new contacts near the end, their events would not make it
+    if (contactPeriod && now >= nextContact)
+    {
+      if (now + F_CPU / 2 < end)
+      {
+        closeContact(nodes, now);
+      }
+      nextContact += contactPeriod;
+    }
+  }
+
+  // switch commands too young to be answered do not count
+  for (sw = switches.begin(); sw != switches.end(); ++sw)
+  {
+    if (!sw->second.answered)
+    {
+      if (now - sw->second.at < ANSWER_MS * (F_CPU / 1000))
+      {
+        result.switches--;
+      }
+      else
+      {
+        result.switchesLost++;
+      }
+    }
+  }
+  result.busLoad = end > warmup ? 100.0 * busy / (end - warmup) : 0;
+  for (i = 0; i < nodes.size(); i++)
+  {
+    NodeStats stats;
+
+    nodes[i].stats(&stats);
+    result.rxOverruns += stats.rxOverruns - nodes[i].atWarmup.rxOverruns;
+    result.txDrops += stats.txDrops - nodes[i].atWarmup.txDrops;
+    result.hwOverruns += stats.hwOverruns - nodes[i].atWarmup.hwOverruns;
+    result.closures += nodes[i].closures;
+    if (!strcmp(nodes[i].type->type, "hall2can"))
+    {
+      result.armHits += stats.armHits;
+      result.armMisses += stats.armMisses;
+      result.pollAnswers += result.polls * POLL_ANSWERS;
+      if (nodes[i].pollAnswers < result.polls * POLL_ANSWERS)
+      {
+        result.pollAnswersLost += result.polls * POLL_ANSWERS - nodes[i].pollAnswers;
+      }
+    }
+    if (nodes[i].events < nodes[i].closures)
+    {
+      result.eventsLost += nodes[i].closures - nodes[i].events;
+    }
+  }
+  if (report)
+  {
+    printReport(nodes, result, end);
+  }
+  for (i = 0; i < nodes.size(); i++)
+  {
+    if (nodes[i].pty)
+    {
+      close(nodes[i].ptySlave);
+      close(nodes[i].pty);
+    }
+    dlclose(nodes[i].so);
+  }
+  return result;
+}
+
+static const NodeType *findType(const char *name, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(nodeTypes) / sizeof(nodeTypes[0]); i++)
+  {
+    if (strlen(nodeTypes[i].type) == len && !strncmp(nodeTypes[i].type, name, len))
+    {
+      return &nodeTypes[i];
+    }
+  }
+  return 0;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: cansim [-t s] [-b bps] [-l cycles] [-q cycles] [-w ms] [-c config]\n"
+                  "              [-s ms] [-r n] [-S from:to:step] [-f] [-v] [-p] Type[=count] ...\n"
+                  "types: NanoApp NanoBase hall2can usb2can can2usb binlink slcan capture busstats cs2\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<const NodeType *> types;
+  std::string config, dir;
+  const NodeType *type;
+  const char *eq, *slash;
+  uint64_t end = 10 * F_CPU;
+  unsigned count, apps = 0, from = 0, to = 0, step = 0, load;
+  char accs[32];
+  Result r;
+  int opt, i, status = 0;
+
+  while ((opt = getopt(argc, argv, "t:b:l:q:w:c:s:r:S:fvp")) != -1)
+  {
+    switch (opt)
+    {
+      case 't': end = (uint64_t)(atof(optarg) * F_CPU); break;
+      case 'b': bitrate = strtoul(optarg, 0, 0); break;
+      case 'l': loopCycles = strtoul(optarg, 0, 0); break;
+      case 'q': quantum = strtoull(optarg, 0, 0); break;
+      case 'w': warmup = strtoull(optarg, 0, 0) * (F_CPU / 1000); break;
+      case 'c': config = optarg; break;
+      case 's': contactPeriod = strtoull(optarg, 0, 0) * (F_CPU / 1000); break;
+      case 'r': contactRepeat = strtoul(optarg, 0, 0); break;
+      case 'S':
+        if (sscanf(optarg, "%u:%u:%u", &from, &to, &step) != 3 || !step)
+        {
+          usage();
+        }
+        break;
+      case 'f': failOnLoss = true; break;
+      case 'v': verbose = true; break;
+      case 'p': ptys = true; break;
+      default: usage();
+    }
+  }
+  if (optind == argc || !bitrate || !quantum || !contactRepeat)
+  {
+    usage();
+  }
+  for (i = optind; i < argc; i++)
+  {
+    eq = strchr(argv[i], '=');
+    type = findType(argv[i], eq ? (size_t)(eq - argv[i]) : strlen(argv[i]));
+    count = eq ? strtoul(eq + 1, 0, 0) : 1;
+    if (!type)
+    {
+      usage();
+    }
+    while (count--)
+    {
+      types.push_back(type);
+      apps += type == &nodeTypes[0];
+    }
+  }
+  if (!strstr(config.c_str(), "accs="))
+  {
+    snprintf(accs, sizeof(accs), " accs=%u", apps ? 4 * apps : 4);
+    config += accs;
+  }
+
+  slash = strrchr(argv[0], '/');
+  dir = slash ? std::string(argv[0], slash - argv[0]) : ".";
+  dir += "/nodes";
+  nodeDir = dir.c_str();
+  if (!mkdtemp(tmpDir))
+  {
+    perror("cansim: mkdtemp");
+    return 1;
+  }
+
+  if (!step)
+  {
+    r = simulate(types, config, end, true);
+    status |= failOnLoss && framesLost(r);
+  }
+  else
+  {
+    printf("%8s %6s %8s %6s %8s %8s %6s %8s %6s %6s\n", "load/s", "bus%", "switch", "lost",
+           "lat ms", "contacts", "lost", "rxOvr", "hwOvr", "drops");
+    for (load = from; load <= to; load += step)
+    {
+      char option[32];
+
+      // the first load= counts, see option() in cs2/main.cpp
+      snprintf(option, sizeof(option), "load=%u ", load);
+      r = simulate(types, option + config, end, false);
+      printf("%8u %6.1f %8u %6u %8.2f %8u %6u %8u %6u %6u\n", load, r.busLoad, r.switches,
+             r.switchesLost, r.switchLatencyMax * 1000.0 / F_CPU, r.closures, r.eventsLost,
+             r.rxOverruns, r.hwOverruns, r.txDrops);
+      fflush(stdout);
+      status |= failOnLoss && framesLost(r);
+    }
+  }
+  rmdir(tmpDir);
+  if (status)
+  {
+    fprintf(stderr, "cansim: frames lost\n");
+  }
+  return status;
+}
@@ -0,0 +1,184 @@
+/*
+ * cs2/main.cpp
+ *
+ * Central station for cansim: PINGs the bus, switches the accessories of
+ * the servo boards and adds background traffic. Built like a firmware,
+ * so its frames go through CAN_Lib and an MCP2515 of their own.
+ *
+ * Options (node config, "name=value" separated by blanks):
+ *   ping=MS      PING every MS ms, 0 = none (1000)
+ *   switch=MS    SWITCH_ACC every MS ms, accessories in turn (0)
+ *   accs=N       accessories MM_ACC .. MM_ACC+N-1 (4)
+ *   poll=MS      S88_Polling for one module every MS ms, 0 = none (0)
+ *   load=N       N background frames per second (0)
+ *   loadcmd=C    command of the background frames (Lok_Speed)
+ *   config=1     asks every board that answered PING for all its
+ *                CONFIG_Status channels, one after the other (0)
+ */
+
+#include "Arduino.h"
+#include "CAN.h"
+
+// UID of the simulated central station, "CS2" + 0
+#define CS2_UID 0x43533200UL
+
+static uint32_t pingUs, switchUs, pollUs, loadUs;
+static uint32_t nextPing, nextSwitch, nextPoll, nextLoad;
+static uint16_t accs, acc;
+static uint8_t loadCmd;
+static uint8_t accPos[256 / 8];
+
+// CONFIG_Status walk: boards seen in PING answers, the one asked and its channel
+#define CS2_BOARDS 32
+static bool config;
+static uint8_t boards, board, channel, channels;
+static uint8_t boardUid[CS2_BOARDS][4];
+static bool asked, answered;
+static uint32_t askedAt;
+
+static uint32_t option(const char *name, uint32_t value)
+{
+  const char *p = hostConfig;
+  size_t len = strlen(name);
+
+  while ((p = strstr(p, name)) != 0)
+  {
+    if ((p == hostConfig || p[-1] == ' ' || p[-1] == ',') && p[len] == '=')
+    {
+      return strtoul(p + len + 1, 0, 0);
+    }
+    p += len;
+  }
+  return value;
+}
+
+void setup()
+{
+  uint32_t load;
+
+  pingUs = option("ping", 1000) * 1000UL;
+  switchUs = option("switch", 0) * 1000UL;
+  accs = option("accs", 4);
+  if (accs > 256)
+    accs = 256;
+  pollUs = option("poll", 0) * 1000UL;
+  load = option("load", 0);
+  loadUs = load ? 1000000UL / load : 0;
+  loadCmd = option("loadcmd", Lok_Speed);
+  config = option("config", 0);
+  CAN.beginAuto(MCP2515_MODE_NORMAL, MCP2515_OPT_RXRING | MCP2515_OPT_TXQUEUE | MCP2515_OPT_ROLLOVER);
+  CAN.hash = generateHash(CS2_UID);
+  attachCanInterrupt();
+  nextPing = nextSwitch = nextPoll = nextLoad = micros();
+}
+
+// true once per period and only if the transmit queue of cmd has room,
+// otherwise the frame waits; a station that falls behind does not catch up
+static bool due(uint32_t &next, uint32_t period, uint32_t now, uint8_t cmd)
+{
+  if (!period || (int32_t)(now - next) < 0 || !CAN.txFree(canPriority(cmd)))
+    return false;
+  next += period;
+  if ((int32_t)(now - next) >= 0)
+    next = now + period;
+  return true;
+}
+
+// PING answers add boards; the terminator of a channel lets the next one go
+static void configAnswer()
+{
+  CAN_Frame &f = CAN.incomingMsg;
+  uint8_t i;
+
+  if (!f.resp_bit)
+    return;
+  if (f.cmd == PING && f.length == 8)
+  {
+    for (i = 0; i < boards && memcmp(boardUid[i], f.data, 4); i++)
+      ;
+    if (i == boards && boards < CS2_BOARDS)
+      memcpy(boardUid[boards++], f.data, 4);
+  }
+  else if (f.cmd == CONFIG_Status && asked)
+  {
+    if (f.length == 8 && (uint16_t) f.id == 1 && channel == 0)
+      channels = f.data[1];
+    else if (f.length == 6 && !memcmp(boardUid[board], f.data, 4) && f.data[4] == channel)
+    {
+      asked = false;
+      answered = true;
+    }
+  }
+}
+
+static void configNext(uint32_t now)
+{
+  if (asked)
+  {
+    if (now - askedAt < 500000UL)
+      return;
+    // no terminator: on to the next channel
+    asked = false;
+    answered = true;
+  }
+  if (answered)
+  {
+    answered = false;
+    if (++channel > channels)
+    {
+      board++;
+      channel = channels = 0;
+    }
+  }
+  if (board >= boards || !CAN.txFree(canPriority(CONFIG_Status)))
+    return;
+  CAN.outgoingMsg.cmd = CONFIG_Status;
+  memcpy(CAN.outgoingMsg.data, boardUid[board], 4);
+  CAN.outgoingMsg.data[4] = channel;
+  CAN.can_answer2(5, false);
+  asked = true;
+  askedAt = now;
+}
+
+void loop()
+{
+  uint32_t now = micros();
+
+  // answers are only looked at by cansim, the CONFIG_Status walk excepted
+  while (getCanFrame(CAN.incomingMsg))
+    if (config)
+      configAnswer();
+  if (config)
+    configNext(now);
+  if (due(nextPing, pingUs, now, PING)) {
+    CAN.outgoingMsg.cmd = PING;
+    CAN.can_answer2(0, false);
+  }
+  if (due(nextSwitch, switchUs, now, SWITCH_ACC)) {
+    uint16_t locid = MM_ACC + acc;
+    accPos[acc / 8] ^= _BV(acc % 8);
+    memset(CAN.outgoingMsg.data, 0, 8);
+    CAN.outgoingMsg.cmd = SWITCH_ACC;
+    CAN.outgoingMsg.data[2] = locid >> 8;
+    CAN.outgoingMsg.data[3] = locid;
+    CAN.outgoingMsg.data[4] = (accPos[acc / 8] >> (acc % 8)) & 0x01;
+    CAN.outgoingMsg.data[5] = 1;
+    CAN.can_answer2(6, false);
+    if (++acc >= accs)
+      acc = 0;
+  }
+  if (due(nextPoll, pollUs, now, S88_Polling)) {
+    // UID of the S88 bus and its module count; hall2can answers any UID
+    memset(CAN.outgoingMsg.data, 0, 8);
+    CAN.outgoingMsg.cmd = S88_Polling;
+    CAN.outgoingMsg.data[4] = 1;
+    CAN.can_answer2(5, false);
+  }
+  if (due(nextLoad, loadUs, now, loadCmd)) {
+    memset(CAN.outgoingMsg.data, 0, 8);
+    CAN.outgoingMsg.cmd = loadCmd;
+    CAN.outgoingMsg.data[2] = (uint8_t)(now >> 8);
+    CAN.outgoingMsg.data[3] = (uint8_t)now;
+    CAN.can_answer2(6, false);
+  }
+}
@@ -0,0 +1,514 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "Arduino.h"
+#include "avr/eeprom.h"
+#include "avr/sleep.h"
+#include "MCP2515_Model.h"
+
+static void portBChanged(uint8_t before, uint8_t after);
+static void interruptsChanged(uint8_t before, uint8_t after);
+
+HostReg hostPORTB(portBChanged), hostPORTC, hostPORTD;
+HostReg hostSREG(interruptsChanged), hostEIMSK(interruptsChanged), hostUCSR0B(interruptsChanged);
+HostSpdr hostSPDR;
+HostSpsr hostSPSR;
+
+volatile uint8_t DDRB, DDRC, DDRD, PINB, PINC, PIND;
+volatile uint8_t SPCR, EIFR, EICRA, WDTCSR, SMCR, MCUCR, MCUSR;
+volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1;
+volatile uint8_t TWBR, TWSR;
+volatile uint8_t UCSR0C, UBRR0H, UBRR0L;
+volatile uint16_t TCNT1, ICR1, OCR1A, UBRR0;
+
+uint8_t hostEeprom[E2END + 1];
+uint64_t hostEepromReady;
+
+uint64_t hostCycles;
+uint32_t hostSpiBytes;
+void (*hostTick)(void);
+uint64_t hostHorizon = UINT64_MAX;
+bool hostHoldInterrupts;
+void (*hostSwitch)(void);
+const char *hostConfig = "";
+bool hostAsleep;
+uint64_t hostWakeAt, hostSleepStart;
+uint64_t hostSleepCycles;
+
+// watchdog, Timer1 and UART interrupts of the node program, if it has them
+extern "C" void WDT_vect(void) __attribute__((weak));
+extern "C" void TIMER1_OVF_vect(void) __attribute__((weak));
+extern "C" void USART_RX_vect(void) __attribute__((weak));
+extern "C" void USART_UDRE_vect(void) __attribute__((weak));
+
+// what pendingInt() finds, in the order of the AVR vector table
+#define HOST_INT_WDT    2
+#define HOST_INT_T1OVF  3
+#define HOST_INT_RX     4
+#define HOST_INT_UDRE   5
+#define HOST_INT_NONE   6
+
+static uint8_t pinLevel[HOST_PIN_COUNT];
+static void (*intHandler[2])(void);
+static int intMode[2];
+static bool inDispatch;
+static bool woke;
+static uint64_t timer1At;
+// Timer0 and Timer1 stand still in power-down and power-save
+static bool timersHalted;
+static uint64_t haltedAt, timer0Lost;
+// start of the running watchdog period; the watchdog runs in every mode
+static uint64_t wdtAt;
+
+// SCK divider from SPR1:0 and SPI2X, see SPIClass::setClockDivider()
+static const uint8_t spiDivider[8] = {4, 16, 64, 128, 2, 8, 32, 64};
+// Timer1 prescaler from CS12:0, 0 = stopped or external clock
+static const uint16_t timer1Divider[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+
+void HostReg::set(uint8_t x)
+{
+  uint8_t before = v;
+
+  v = x;
+  if (hook)
+  {
+    hook(before, x);
+  }
+}
+
+HostSpdr &HostSpdr::operator=(uint8_t x)
+{
+  uint8_t div = spiDivider[(SPCR & 0x03) | ((hostSPSR.v & 0x01) << 2)];
+
+  hostSpiBytes++;
+  hostCycles += 8 * div;
+  v = hostMCP.transfer(x);
+  if (hostCycles >= hostHorizon)
+  {
+    hostYield();
+  }
+  return *this;
+}
+
+static void portBChanged(uint8_t before, uint8_t after)
+{
+  uint8_t cs = _BV(HOST_PIN_MCPCS - 8);
+
+  if ((before & cs) && !(after & cs))
+  {
+    hostMCP.select();
+  }
+  else if (!(before & cs) && (after & cs))
+  {
+    hostMCP.deselect();
+  }
+}
+
+static void interruptsChanged(uint8_t, uint8_t)
+{
+  hostDispatch();
+}
+
+// Timer1 in normal mode: TCNT1 catches up with hostCycles, a wrap sets
+// TOV1. Done before interrupts are looked at and after the clock moved, so
+// TCNT1 lags at most the SPI bytes since then.
+static void timer1Sync(void)
+{
+  uint16_t div = timer1Divider[TCCR1B & 0x07];
+  uint64_t ticks;
+
+  if (!div || hostCycles < timer1At || timersHalted)
+  {
+    timer1At = hostCycles;
+    return;
+  }
+  ticks = (hostCycles - timer1At) / div;
+  timer1At += ticks * div;
+  if (TCNT1 + ticks > 0xFFFF)
+  {
+    TIFR1 |= _BV(TOV1);
+  }
+  TCNT1 += ticks;
+}
+
+// Timer0 and Timer1 run again after a power-down
+static void timersResume(void)
+{
+  if (timersHalted)
+  {
+    timersHalted = false;
+    timer0Lost += hostCycles - haltedAt;
+    timer1At = hostCycles;
+  }
+}
+
+// CPU cycles Timer0 counted, i.e. without those slept in power-down
+static uint64_t timer0Cycles(void)
+{
+  return (timersHalted ? haltedAt : hostCycles) - timer0Lost;
+}
+
+// CPU cycles of one watchdog period: 2048 << WDP cycles of the 128 kHz
+// oscillator
+static uint64_t wdtPeriod(void)
+{
+  uint8_t wdp = (WDTCSR & 0x07) | ((WDTCSR >> 2) & 0x08);
+
+  return (F_CPU / 128000UL) * (2048ULL << wdp);
+}
+
+void hostWdtReset(void)
+{
+  wdtAt = hostCycles;
+}
+
+// INT0/INT1 or HOST_INT_* if enabled and pending, HOST_INT_NONE if none
+static uint8_t pendingInt(void)
+{
+  uint8_t n;
+
+  timer1Sync();
+  if (!(hostSREG.v & 0x80))
+  {
+    return HOST_INT_NONE;
+  }
+  for (n = 0; n < 2; n++)
+  {
+    if (!(hostEIMSK.v & _BV(n)) || !intHandler[n])
+    {
+      continue;
+    }
+    if (intMode[n] == LOW ? pinLevel[2 + n] == LOW : (EIFR & _BV(n)) != 0)
+    {
+      return n;
+    }
+  }
+  if (WDT_vect && (WDTCSR & _BV(WDIE)) && hostCycles >= wdtAt + wdtPeriod())
+  {
+    return HOST_INT_WDT;
+  }
+  if (TIMER1_OVF_vect && (TIMSK1 & _BV(TOIE1)) && (TIFR1 & _BV(TOV1)))
+  {
+    return HOST_INT_T1OVF;
+  }
+  if (USART_RX_vect && (hostUCSR0B.v & _BV(RXCIE0)) && (hostUartStatus() & _BV(RXC0)))
+  {
+    return HOST_INT_RX;
+  }
+  if (USART_UDRE_vect && (hostUCSR0B.v & _BV(UDRIE0)) && (hostUartStatus() & _BV(UDRE0)))
+  {
+    return HOST_INT_UDRE;
+  }
+  return HOST_INT_NONE;
+}
+
+bool hostIntPending(void)
+{
+  return pendingInt() != HOST_INT_NONE;
+}
+
+void hostDispatch(void)
+{
+  uint8_t n, guard;
+
+  if (inDispatch || hostHoldInterrupts)
+  {
+    return;
+  }
+  inDispatch = true;
+  for (guard = 0; ; guard++)
+  {
+    n = pendingInt();
+    if (n == HOST_INT_NONE)
+    {
+      break;
+    }
+    if (guard == 255)
+    {
+      // a level interrupt nobody clears would hang the AVR as well
+      fprintf(stderr, "host: interrupt %u stays active, CANINTF %02x CANINTE %02x\n",
+              n, hostMCP.reg[MCP2515_CANINTF], hostMCP.reg[MCP2515_CANINTE]);
+      abort();
+    }
+    // like the AVR: flag cleared and I bit off while the handler runs
+    hostSREG.v &= ~0x80;
+    // awake from here on: a handler that yields must not find its clock moved
+    woke = true;
+    hostAsleep = false;
+    timersResume();
+    if (n == HOST_INT_WDT)
+    {
+      // periods that ran out while interrupts were off raise only one
+      wdtAt += (hostCycles - wdtAt) / wdtPeriod() * wdtPeriod();
+      WDT_vect();
+    }
+    else if (n == HOST_INT_T1OVF)
+    {
+      TIFR1 &= ~_BV(TOV1);
+      TIMER1_OVF_vect();
+    }
+    else if (n == HOST_INT_RX)
+    {
+      // the handler reads UDR0, which clears RXC0
+      USART_RX_vect();
+    }
+    else if (n == HOST_INT_UDRE)
+    {
+      USART_UDRE_vect();
+    }
+    else
+    {
+      EIFR &= ~_BV(n);
+      intHandler[n]();
+    }
+    hostSREG.v |= 0x80;
+  }
+  inDispatch = false;
+}
+
+void hostSetPin(uint8_t pin, uint8_t level)
+{
+  uint8_t before = pinLevel[pin];
+  uint8_t n = pin - 2;
+
+  pinLevel[pin] = level;
+  if (n < 2 && before != level && intHandler[n] &&
+      (intMode[n] == CHANGE || (intMode[n] == FALLING && level == LOW) ||
+       (intMode[n] == RISING && level == HIGH)))
+  {
+    EIFR |= _BV(n);
+  }
+  hostDispatch();
+}
+
+// pins idle high after power-on, the MCP2515 INT line included;
+// the EEPROM comes erased
+static struct HostPowerOn
+{
+  HostPowerOn()
+  {
+    hostReset();
+    memset(hostEeprom, 0xFF, sizeof(hostEeprom));
+  }
+} powerOn;
+
+uint8_t hostGetPin(uint8_t pin)
+{
+  return pinLevel[pin];
+}
+
+void hostAdvance(uint32_t cycles)
+{
+  uint64_t step;
+
+  // a long delay stops at each horizon, so interrupts come in time
+  while (hostCycles + cycles >= hostHorizon)
+  {
+    step = hostHorizon > hostCycles ? hostHorizon - hostCycles : 0;
+    hostCycles += step;
+    cycles -= step;
+    hostYield();
+    hostDispatch();
+  }
+  hostCycles += cycles;
+  timer1Sync();
+  if (hostTick)
+  {
+    hostTick();
+  }
+  hostDispatch();
+}
+
+void hostReset(void)
+{
+  uint8_t pin;
+
+  hostPORTB.v = 0;
+  hostPORTC.v = 0;
+  hostPORTD.v = 0;
+  hostSREG.v = 0;
+  hostEIMSK.v = 0;
+  hostSPSR.v = 0;
+  SPCR = 0;
+  EIFR = 0;
+  TCCR1A = TCCR1B = TIMSK1 = TIFR1 = 0;
+  TCNT1 = 0;
+  timer1At = 0;
+  WDTCSR = 0;
+  wdtAt = 0;
+  timersHalted = false;
+  timer0Lost = 0;
+  DDRB = DDRC = DDRD = 0;
+  hostCycles = 0;
+  hostEepromReady = 0;
+  hostSpiBytes = 0;
+  for (pin = 0; pin < HOST_PIN_COUNT; pin++)
+  {
+    pinLevel[pin] = HIGH;
+  }
+  intHandler[0] = intHandler[1] = 0;
+  hostSerialReset();
+  hostAsleep = false;
+  hostSleepCycles = 0;
+  hostMCP.reset();
+}
+
+void hostYield(void)
+{
+  if (hostSwitch)
+  {
+    hostSwitch();
+  }
+}
+
+void hostSleep(void)
+{
+  uint64_t start = hostSleepStart = hostCycles;
+  uint8_t mode = SMCR & 0x0E;
+
+  if (!hostSwitch)
+  {
+    // on its own a program just runs on
+    return;
+  }
+  if (mode == SLEEP_MODE_IDLE)
+  {
+    // Timer0 keeps running and wakes the CPU with the next millis() tick
+    hostWakeAt = hostCycles + 16384 - timer0Cycles() % 16384;
+  }
+  else if (WDTCSR & _BV(WDIE))
+  {
+    // end of the running watchdog period
+    hostWakeAt = wdtAt + wdtPeriod();
+  }
+  else
+  {
+    hostWakeAt = UINT64_MAX;
+  }
+  if (mode != SLEEP_MODE_IDLE)
+  {
+    timer1Sync();
+    timersHalted = true;
+    haltedAt = hostCycles;
+  }
+  woke = false;
+  hostAsleep = true;
+  while (!woke && hostCycles < hostWakeAt)
+  {
+    hostSwitch();
+  }
+  hostAsleep = false;
+  timersResume();
+  if (!woke)
+  {
+    // woken by the watchdog or Timer0, not by a handler yet
+    hostDispatch();
+  }
+  hostSleepCycles += hostCycles - start;
+}
+
+static volatile uint8_t *portOf(uint8_t pin, HostReg **port)
+{
+  if (pin < 8)
+  {
+    *port = &hostPORTD;
+    return &DDRD;
+  }
+  if (pin < 14)
+  {
+    *port = &hostPORTB;
+    return &DDRB;
+  }
+  *port = &hostPORTC;
+  return &DDRC;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  HostReg *port;
+  volatile uint8_t *ddr = portOf(pin, &port);
+  uint8_t bit = digitalPinToBitMask(pin);
+
+  if (mode == OUTPUT)
+  {
+    *ddr |= bit;
+  }
+  else
+  {
+    *ddr &= ~bit;
+    if (mode == INPUT_PULLUP)
+    {
+      *port |= bit;
+    }
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+  HostReg *port;
+  uint8_t bit = digitalPinToBitMask(pin);
+
+  portOf(pin, &port);
+  if (val == LOW)
+  {
+    *port &= ~bit;
+  }
+  else
+  {
+    *port |= bit;
+  }
+}
+
+int digitalRead(uint8_t pin)
+{
+  HostReg *port;
+  volatile uint8_t *ddr = portOf(pin, &port);
+  uint8_t bit = digitalPinToBitMask(pin);
+
+  if (*ddr & bit)
+  {
+    return (*port & bit) ? HIGH : LOW;
+  }
+  return pinLevel[pin];
+}
+
+uint32_t millis(void)
+{
+  return timer0Cycles() / (F_CPU / 1000UL);
+}
+
+uint32_t micros(void)
+{
+  return timer0Cycles() / (F_CPU / 1000000UL);
+}
+
+void delay(uint32_t ms)
+{
+  while (ms--)
+  {
+    hostAdvance(F_CPU / 1000UL);
+  }
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  hostAdvance(us * (F_CPU / 1000000UL));
+}
+
+void attachInterrupt(uint8_t interruptNum, void (*userFunc)(void), int mode)
+{
+  if (interruptNum < 2)
+  {
+    intHandler[interruptNum] = userFunc;
+    intMode[interruptNum] = mode;
+    EIMSK |= _BV(interruptNum);
+  }
+}
+
+void detachInterrupt(uint8_t interruptNum)
+{
+  if (interruptNum < 2)
+  {
+    EIMSK &= ~_BV(interruptNum);
+    intHandler[interruptNum] = 0;
+  }
+}
@@ -0,0 +1,129 @@
+#pragma once
+// Host stand-ins for the ATmega328P registers and the Arduino core calls
+// CAN_Lib uses, so the library builds and runs unchanged on Linux.
+//
+// Time is kept in emulated CPU cycles. Only SPI shifting and the delay
+// functions advance it; code running on the host costs nothing, so the
+// figures are a lower bound for the real firmware.
+
+#include <stdint.h>
+
+#define HOST_PIN_COUNT  20    // D0..D13, A0..A5
+#define HOST_PIN_MCPINT 2     // MCP2515 INT is wired to D2 = INT0
+#define HOST_PIN_MCPCS  10    // MCP2515 CS is wired to D10 = PB2
+#define HOST_PIN_PCFINT 3     // INT of the PCF8574 expanders goes to D3 = INT1
+#define HOST_PCF_COUNT  8
+
+typedef void (*HostRegHook)(uint8_t before, uint8_t after);
+
+// I/O register whose writes have side effects (ports, SREG, EIMSK)
+class HostReg
+{
+  public:
+    HostReg(HostRegHook h = 0) : v(0), hook(h) {}
+    operator uint8_t() const { return v; }
+    HostReg &operator=(uint8_t x) { set(x); return *this; }
+    HostReg &operator=(const HostReg &r) { set(r.v); return *this; }
+    HostReg &operator&=(uint8_t x) { set(v & x); return *this; }
+    HostReg &operator|=(uint8_t x) { set(v | x); return *this; }
+    HostReg &operator^=(uint8_t x) { set(v ^ x); return *this; }
+    void set(uint8_t x);
+
+    uint8_t v;
+    HostRegHook hook;
+};
+
+// SPDR: a write shifts one byte to the MCP2515 model and back
+class HostSpdr
+{
+  public:
+    HostSpdr() : v(0) {}
+    operator uint8_t() const { return v; }
+    HostSpdr &operator=(uint8_t x);
+
+    uint8_t v;
+};
+
+// SPSR: the transfer is done when SPDR is written, so SPIF always reads set
+class HostSpsr
+{
+  public:
+    HostSpsr() : v(0) {}
+    operator uint8_t() const { return v | 0x80; }
+    HostSpsr &operator=(uint8_t x) { v = x & 0x01; return *this; }
+
+    uint8_t v;
+};
+
+// UDR0: a write goes out through the host serial, a read takes the next
+// byte fed in; the UART model is in host_serial.cpp
+class HostUdr
+{
+  public:
+    operator uint8_t() const;
+    HostUdr &operator=(uint8_t x);
+};
+
+// UCSR0A: RXC0 and UDRE0 follow the UART model, U2X0 is kept. Firmware
+// reads it only in busy waits, so each read lets a few cycles pass.
+class HostUcsr0a
+{
+  public:
+    HostUcsr0a() : v(0) {}
+    operator uint8_t() const;
+    HostUcsr0a &operator=(uint8_t x) { v = x & 0x02; return *this; }
+
+    uint8_t v;
+};
+
+extern HostReg hostPORTB, hostPORTC, hostPORTD, hostSREG, hostEIMSK, hostUCSR0B;
+extern HostSpdr hostSPDR;
+extern HostSpsr hostSPSR;
+extern HostUdr hostUDR0;
+extern HostUcsr0a hostUCSR0A;
+
+// Emulated CPU cycles since start
+extern uint64_t hostCycles;
+// SPI bytes shifted since start
+extern uint32_t hostSpiBytes;
+// Called by hostAdvance() after the clock moved, e.g. to let a bus run
+extern void (*hostTick)(void);
+
+// Lets cycles pass, then runs hostTick and pending interrupts
+void hostAdvance(uint32_t cycles);
+// Drives an input pin; edges and levels reach INT0/INT1 like on the chip
+void hostSetPin(uint8_t pin, uint8_t level);
+uint8_t hostGetPin(uint8_t pin);
+// Runs the handlers of INT0, INT1, the watchdog, Timer1 and the UART that are
+// enabled and pending
+void hostDispatch(void);
+// True if hostDispatch() would run a handler
+bool hostIntPending(void);
+// Puts everything back to power-on state, EEPROM excepted
+void hostReset(void);
+// Empties the UART model, part of hostReset()
+void hostSerialReset(void);
+// UCSR0A without the cost of a read, for the interrupt logic
+uint8_t hostUartStatus(void);
+// Sleeps like sleep_cpu(): returns after the next interrupt ran
+void hostSleep(void);
+// Gives the CPU back to the bus simulator once hostCycles passes hostHorizon
+void hostYield(void);
+// Input pins of PCF8574 n (address 0x38 + n), see host_twi.cpp
+void hostPcfInput(uint8_t n, uint8_t pins);
+
+// Horizon set by the bus simulator; stays at its maximum when a program
+// runs on its own, so nothing ever yields
+extern uint64_t hostHorizon;
+// Set while the simulator changes pins and the MCP2515 from outside the
+// program: handlers wait until the program runs again
+extern bool hostHoldInterrupts;
+// Switches from the node program to the simulator and back, see host_node.cpp
+extern void (*hostSwitch)(void);
+// Option string the simulator hands to the node program
+extern const char *hostConfig;
+// Sleep state for the simulator: asleep since hostSleepStart until
+// hostWakeAt or an interrupt; hostSleepCycles holds the finished sleeps
+extern bool hostAsleep;
+extern uint64_t hostWakeAt, hostSleepStart;
+extern uint64_t hostSleepCycles;
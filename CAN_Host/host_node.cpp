@@ -0,0 +1,157 @@
+// Node side of the bus simulator: runs setup() and loop() of the node
+// program as a coroutine. What happens on the bus reaches the MCP2515 model
+// right away; the interrupts it causes run when the node gets the CPU back.
+
+#include <ucontext.h>
+#include "Arduino.h"
+#include "MCP2515_Model.h"
+#include "host_node.h"
+
+#define NODE_STACK_SIZE   (64 * 1024)
+
+void setup(void);
+void loop(void);
+// only nodes with PCF8574 expanders (host_twi.cpp) have it
+void hostPcfInput(uint8_t n, uint8_t pins) __attribute__((weak));
+
+static ucontext_t simContext, nodeContext;
+static char nodeStack[NODE_STACK_SIZE];
+static uint32_t loopCycles;
+
+// Back in the node: the interrupts the bus raised meanwhile run now
+static void nodeSwitch(void)
+{
+  swapcontext(&nodeContext, &simContext);
+  hostDispatch();
+}
+
+static void nodeMain(void)
+{
+  interrupts();
+  setup();
+  for (;;)
+  {
+    loop();
+    hostAdvance(loopCycles);
+  }
+}
+
+void nodeStart(uint32_t busBitrate, uint32_t cycles, const uint8_t *eeprom, const char *config)
+{
+  hostHoldInterrupts = false;
+  hostReset();
+  if (eeprom)
+  {
+    memcpy(hostEeprom, eeprom, sizeof(hostEeprom));
+  }
+  hostMCP.busBitrate = busBitrate;
+  hostMCP.autoTx = false;
+  hostConfig = strdup(config ? config : "");
+  loopCycles = cycles;
+  getcontext(&nodeContext);
+  nodeContext.uc_stack.ss_sp = nodeStack;
+  nodeContext.uc_stack.ss_size = sizeof(nodeStack);
+  nodeContext.uc_link = 0;
+  makecontext(&nodeContext, nodeMain, 0);
+  hostSwitch = nodeSwitch;
+  hostHoldInterrupts = true;
+}
+
+uint8_t nodeRun(uint64_t until)
+{
+  hostHorizon = until;
+  if (hostAsleep && !hostIntPending())
+  {
+    if (hostWakeAt > until)
+    {
+      if (hostCycles < until)
+      {
+        hostCycles = until;
+      }
+      return NODE_ASLEEP;
+    }
+    if (hostCycles < hostWakeAt)
+    {
+      hostCycles = hostWakeAt;
+    }
+  }
+  else if (hostCycles >= until)
+  {
+    // ahead of the bus, pending interrupts run once it caught up
+    return hostAsleep ? NODE_ASLEEP : NODE_AWAKE;
+  }
+  hostHoldInterrupts = false;
+  swapcontext(&simContext, &nodeContext);
+  hostHoldInterrupts = true;
+  return hostAsleep ? NODE_ASLEEP : NODE_AWAKE;
+}
+
+uint64_t nodeClock(void)
+{
+  return hostCycles;
+}
+
+int8_t nodePendingTx(NodeFrame *frame)
+{
+  int8_t n = hostMCP.pendingTx();
+
+  if (n >= 0)
+  {
+    MCP2515_Buffer raw = hostMCP.txFrame(n);
+    memcpy(frame, &raw, sizeof(*frame));
+  }
+  return n;
+}
+
+// The MCP2515 works along with the bus; only its INT waits for the node
+
+void nodeTxDone(uint8_t n)
+{
+  hostMCP.txDone(n);
+}
+
+void nodeReceive(const NodeFrame *frame)
+{
+  hostMCP.receive(*(const MCP2515_Buffer *)frame);
+}
+
+void nodePcfInput(uint8_t n, uint8_t pins)
+{
+  if (hostPcfInput)
+  {
+    hostPcfInput(n, pins);
+  }
+}
+
+void nodeStats(NodeStats *stats)
+{
+  stats->rxOverruns = CAN.stats.rxOverruns;
+  stats->rxHighWater = CAN.stats.rxHighWater;
+  stats->txDrops = CAN.stats.txDrops;
+  stats->hwOverruns = CAN.stats.hwOverruns;
+  stats->msgErrors = CAN.stats.msgErrors;
+  stats->armLatencyMax = CAN.stats.armLatencyMax;
+  stats->armHits = CAN.stats.armHits;
+  stats->armMisses = CAN.stats.armMisses;
+  stats->isrMax = workStats.isrMax;
+  stats->taskMax = workStats.taskMax;
+  stats->hashCollisions = hashCollisions;
+  stats->spiBytes = hostSpiBytes;
+  // a power-down can well outlast the run
+  stats->sleepCycles = hostSleepCycles + (hostAsleep ? hostCycles - hostSleepStart : 0);
+}
+
+void nodeEeprom(uint8_t *eeprom)
+{
+  memcpy(eeprom, hostEeprom, sizeof(hostEeprom));
+}
+
+size_t nodeSerialWrite(const char *data, size_t size)
+{
+  return Serial.feed(data, size);
+}
+
+size_t nodeSerialRead(char *data, size_t size)
+{
+  return Serial.drain(data, size);
+}
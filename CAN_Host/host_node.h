@@ -0,0 +1,75 @@
+#pragma once
+// Interface between cansim and a node program built as a shared object
+// (make nodes). Every node is its own copy of the object, so firmware,
+// CAN_Lib and host globals are separate per node. The program runs as a
+// coroutine: nodeRun() lets it go until its clock reaches the horizon or it
+// sleeps. Bus input changes the MCP2515 and the pins at once; the
+// interrupts it causes run with the next nodeRun().
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NODE_AWAKE      0
+#define NODE_ASLEEP     1
+
+#define NODE_EEPROM_SIZE 1024
+
+// Frame in the MCP2515 buffer layout: SIDH, SIDL, EID8, EID0, DLC, D0..D7
+typedef struct
+{
+  uint8_t sidh;
+  uint8_t sidl;
+  uint8_t eid8;
+  uint8_t eid0;
+  uint8_t dlc;
+  uint8_t data[8];
+} NodeFrame;
+
+// CAN_MCP2515::stats, workStats and hashCollisions of ownCAN and host counters of one node
+typedef struct
+{
+  uint32_t rxOverruns;
+  uint32_t rxHighWater;
+  uint32_t txDrops;
+  uint32_t hwOverruns;
+  uint32_t msgErrors;
+  uint32_t armLatencyMax;
+  uint32_t armHits;
+  uint32_t armMisses;
+  uint32_t isrMax;
+  uint32_t taskMax;
+  uint32_t hashCollisions;
+  uint32_t spiBytes;
+  uint64_t sleepCycles;
+} NodeStats;
+
+extern "C"
+{
+  // Power-on with the given EEPROM image (0 = erased); setup() runs with
+  // the first nodeRun()
+  void nodeStart(uint32_t busBitrate, uint32_t loopCycles, const uint8_t *eeprom, const char *config);
+  uint8_t nodeRun(uint64_t until);
+  uint64_t nodeClock(void);
+  // TX buffer the MCP2515 would put on the bus now, -1 if none
+  int8_t nodePendingTx(NodeFrame *frame);
+  void nodeTxDone(uint8_t n);
+  void nodeReceive(const NodeFrame *frame);
+  // Input pins of PCF8574 n
+  void nodePcfInput(uint8_t n, uint8_t pins);
+  void nodeStats(NodeStats *stats);
+  void nodeEeprom(uint8_t *eeprom);
+  size_t nodeSerialWrite(const char *data, size_t size);
+  size_t nodeSerialRead(char *data, size_t size);
+}
+
+typedef void (*NodeStartFn)(uint32_t, uint32_t, const uint8_t *, const char *);
+typedef uint8_t (*NodeRunFn)(uint64_t);
+typedef uint64_t (*NodeClockFn)(void);
+typedef int8_t (*NodePendingTxFn)(NodeFrame *);
+typedef void (*NodeTxDoneFn)(uint8_t);
+typedef void (*NodeReceiveFn)(const NodeFrame *);
+typedef void (*NodePcfInputFn)(uint8_t, uint8_t);
+typedef void (*NodeStatsFn)(NodeStats *);
+typedef void (*NodeEepromFn)(uint8_t *);
+typedef size_t (*NodeSerialWriteFn)(const char *, size_t);
+typedef size_t (*NodeSerialReadFn)(char *, size_t);
@@ -0,0 +1,180 @@
+#include "Arduino.h"
+
+HardwareSerial Serial;
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t n = 0;
+
+  while (size--)
+  {
+    if (!write(*buffer++))
+    {
+      break;
+    }
+    n++;
+  }
+  return n;
+}
+
+size_t Print::print(long n, int base)
+{
+  if (n < 0 && base == DEC)
+  {
+    return print('-') + print((unsigned long)-n, base);
+  }
+  return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+  char buf[8 * sizeof(long) + 1];
+  char *p = &buf[sizeof(buf) - 1];
+
+  if (base < 2)
+  {
+    base = DEC;
+  }
+  *p = 0;
+  do
+  {
+    uint8_t digit = n % base;
+    *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    n /= base;
+  } while (n);
+  return write(p);
+}
+
+HardwareSerial::HardwareSerial()
+{
+  inHead = inTail = outHead = outTail = 0;
+  byteCycles = 0;
+}
+
+void HardwareSerial::begin(unsigned long baud)
+{
+  byteCycles = 10 * F_CPU / baud;
+}
+
+int HardwareSerial::available()
+{
+  return (uint16_t)(inHead - inTail);
+}
+
+int HardwareSerial::read()
+{
+  if (inHead == inTail)
+  {
+    return -1;
+  }
+  return in[inTail++ % HOST_SERIAL_SIZE];
+}
+
+int HardwareSerial::peek()
+{
+  if (inHead == inTail)
+  {
+    return -1;
+  }
+  return in[inTail % HOST_SERIAL_SIZE];
+}
+
+void HardwareSerial::put(uint8_t c)
+{
+  if ((uint16_t)(outHead - outTail) == HOST_SERIAL_SIZE)
+  {
+    // nobody reads the other end: keep the latest output
+    outTail++;
+  }
+  out[outHead++ % HOST_SERIAL_SIZE] = c;
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  put(c);
+  hostAdvance(byteCycles);
+  return 1;
+}
+
+size_t HardwareSerial::feed(const char *data, size_t size)
+{
+  size_t n = 0;
+
+  while (n < size && (uint16_t)(inHead - inTail) < HOST_SERIAL_SIZE)
+  {
+    in[inHead++ % HOST_SERIAL_SIZE] = data[n++];
+  }
+  return n;
+}
+
+size_t HardwareSerial::drain(char *data, size_t size)
+{
+  size_t n = 0;
+
+  while (n < size && outHead != outTail)
+  {
+    data[n++] = out[outTail++ % HOST_SERIAL_SIZE];
+  }
+  return n;
+}
+
+// UART0 registers: UDR0 takes one byte while the previous one is shifted
+// out, and a received byte is there one byte time after the one before
+
+HostUdr hostUDR0;
+HostUcsr0a hostUCSR0A;
+
+static uint64_t udrFreeAt, rxReadyAt;
+
+static uint32_t uartByteCycles(void)
+{
+  return 10UL * ((hostUCSR0A.v & _BV(U2X0)) ? 8 : 16) * (UBRR0 + 1);
+}
+
+// one pass of a polling loop: lds, sbrs, rjmp
+#define UART_POLL_CYCLES  5
+
+HostUcsr0a::operator uint8_t() const
+{
+  hostAdvance(UART_POLL_CYCLES);
+  return hostUartStatus();
+}
+
+uint8_t hostUartStatus(void)
+{
+  uint8_t x = hostUCSR0A.v;
+
+  if (hostCycles + uartByteCycles() >= udrFreeAt)
+  {
+    x |= _BV(UDRE0);
+  }
+  if (Serial.available() && hostCycles >= rxReadyAt)
+  {
+    x |= _BV(RXC0);
+  }
+  return x;
+}
+
+HostUdr::operator uint8_t() const
+{
+  int c = Serial.read();
+
+  rxReadyAt = hostCycles + uartByteCycles();
+  return c < 0 ? 0 : c;
+}
+
+HostUdr &HostUdr::operator=(uint8_t x)
+{
+  uint64_t start = udrFreeAt > hostCycles ? udrFreeAt : hostCycles;
+
+  Serial.put(x);
+  udrFreeAt = start + uartByteCycles();
+  return *this;
+}
+
+void hostSerialReset(void)
+{
+  hostUCSR0A.v = 0;
+  hostUCSR0B.v = 0;
+  udrFreeAt = rxReadyAt = 0;
+}
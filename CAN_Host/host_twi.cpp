@@ -0,0 +1,87 @@
+// I2C of the host build, for node programs that use Wire. The bus carries
+// PCF8574 port expanders at 0x38..0x3F; their open-drain INT outputs are
+// wired together to D3 = INT1 like on the hall2can board. A transfer costs
+// nine bit times at TWI_FREQ per byte, address byte included.
+
+#include "Arduino.h"
+#include "utility/twi.h"
+
+#define PCF_BASE        0x38
+#define TWI_BYTE_CYCLES (9 * (F_CPU / TWI_FREQ))
+
+static uint8_t pcfPins[HOST_PCF_COUNT] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+// port state as last read or written; INT stays low while the pins differ
+static uint8_t pcfSeen[HOST_PCF_COUNT] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+static void pcfUpdateInt(void)
+{
+  uint8_t n;
+
+  for (n = 0; n < HOST_PCF_COUNT; n++)
+  {
+    if (pcfPins[n] != pcfSeen[n])
+    {
+      hostSetPin(HOST_PIN_PCFINT, LOW);
+      return;
+    }
+  }
+  hostSetPin(HOST_PIN_PCFINT, HIGH);
+}
+
+void hostPcfInput(uint8_t n, uint8_t pins)
+{
+  pcfPins[n] = pins;
+  pcfUpdateInt();
+}
+
+static int8_t pcfIndex(uint8_t address)
+{
+  return (address >= PCF_BASE && address < PCF_BASE + HOST_PCF_COUNT) ? address - PCF_BASE : -1;
+}
+
+void twi_init(void) {}
+void twi_disable(void) {}
+void twi_setAddress(uint8_t) {}
+void twi_attachSlaveRxEvent(void (*)(uint8_t *, int)) {}
+void twi_attachSlaveTxEvent(void (*)(void)) {}
+void twi_reply(uint8_t) {}
+void twi_stop(void) {}
+void twi_releaseBus(void) {}
+
+uint8_t twi_readFrom(uint8_t address, uint8_t *data, uint8_t length, uint8_t)
+{
+  int8_t n = pcfIndex(address);
+  uint8_t i;
+
+  hostAdvance((1 + length) * TWI_BYTE_CYCLES);
+  if (n < 0)
+  {
+    return 0;
+  }
+  for (i = 0; i < length; i++)
+  {
+    data[i] = pcfPins[n];
+  }
+  pcfSeen[n] = pcfPins[n];
+  pcfUpdateInt();
+  return length;
+}
+
+uint8_t twi_writeTo(uint8_t address, uint8_t *, uint8_t length, uint8_t, uint8_t)
+{
+  int8_t n = pcfIndex(address);
+
+  hostAdvance((1 + length) * TWI_BYTE_CYCLES);
+  if (n < 0)
+  {
+    return 2;  // address NACK
+  }
+  pcfSeen[n] = pcfPins[n];
+  pcfUpdateInt();
+  return 0;
+}
+
+uint8_t twi_transmit(const uint8_t *, uint8_t)
+{
+  return 1;
+}
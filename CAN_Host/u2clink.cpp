@@ -0,0 +1,379 @@
+// u2clink: PC side of the binary serial link of usb2can built with
+// "#define binlink", see LINK_* in ownCAN.h and ownLink.cpp; without it
+// usb2can keeps the ASCII protocol of hex2usb. It is the reference for what
+// hex2usb has to send: one frame is command, data and CRC-16 (XMODEM
+// polynomial, start 0xFFFF, high byte first), COBS encoded and closed by a
+// 0x00.
+//
+//   u2clink [-b baud] tty command ...
+//
+//   hello [n]     sends LINK_HELLO n times (1), prints the round-trip times
+//   ask XY        asks for board XY, e.g. "ask 07"
+//   change XY AB  gives board XY the number AB
+//   boot XY       sends board XY into its bootloader
+//   data HEX      up to 7 bytes for the bootloader, "data" alone ends it
+//   capture [s]   prints every frame can2usb with "#define capture" sees,
+//                 for s seconds or until ^C, as "(sec.usec) ID#DATA"
+//
+// tty is the USB serial port of the gateway or the pseudo terminal cansim
+// -p prints for a simulated one. Exit status 0 if the gateway said yes,
+// 1 for no or no answer, 2 for usage and port errors. capture exits with 1
+// if frames were lost; it needs -b 2000000.
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// LINK_* and the baud rates; without the AVR parts, as for hex2usb
+#define hex2usb
+#include "ownCAN.h"
+
+#define ANSWER_MS       1000  // usb2can waits 500 ms for the board
+#define RETRIES         3     // sends again after LINK_NAK
+
+static int tty;
+static volatile sig_atomic_t stop;
+
+static uint16_t crc16(const uint8_t *p, size_t n)
+{
+  uint16_t crc = 0xFFFF;
+  int i;
+
+  while (n--)
+  {
+    crc ^= (uint16_t)*p++ << 8;
+    for (i = 0; i < 8; i++)
+    {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+static double msSince(const struct timespec &start)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (t.tv_sec - start.tv_sec) * 1000.0 + (t.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+static void sendFrame(uint8_t cmd, const uint8_t *data, uint8_t len)
+{
+  uint8_t buf[1 + LINK_MAX_DATA + 2], out[sizeof(buf) + 2];
+  size_t n = len + 3, start, i, o = 0;
+  uint16_t crc;
+
+  buf[0] = cmd;
+  memcpy(&buf[1], data, len);
+  crc = crc16(buf, len + 1);
+  buf[len + 1] = crc >> 8;
+  buf[len + 2] = crc;
+  for (start = 0; start <= n; start = i + 1)
+  {
+    for (i = start; i < n && buf[i]; i++)
+    {
+    }
+    out[o++] = i - start + 1;
+    memcpy(&out[o], &buf[start], i - start);
+    o += i - start;
+  }
+  out[o++] = LINK_END;
+  if (write(tty, out, o) != (ssize_t)o)
+  {
+    perror("u2clink: write");
+    exit(2);
+  }
+}
+
+// Next good frame from the gateway, its length; 0 after timeout ms
+static size_t receiveFrame(uint8_t *frame, int timeout)
+{
+  uint8_t raw[2 * (1 + LINK_MAX_SEND + 2)], c;
+  size_t n = 0, i, o, k;
+  struct timespec start;
+  struct pollfd p;
+  int left;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  p.fd = tty;
+  p.events = POLLIN;
+  for (;;)
+  {
+    left = timeout - (int)msSince(start);
+    if (left <= 0 || poll(&p, 1, left) <= 0 || read(tty, &c, 1) != 1)
+    {
+      return 0;
+    }
+    if (c != LINK_END)
+    {
+      if (n < sizeof(raw))
+      {
+        raw[n++] = c;
+      }
+      continue;
+    }
+    // COBS back to command, data and CRC
+    for (i = 0, o = 0; i < n && raw[i]; )
+    {
+      k = raw[i++];
+      if (i + k - 1 > n)
+      {
+        break;
+      }
+      memcpy(&frame[o], &raw[i], k - 1);
+      o += k - 1;
+      i += k - 1;
+      if (k < 0xFF && i < n)
+      {
+        frame[o++] = 0;
+      }
+    }
+    if (i == n && o >= 3 && o <= 1 + LINK_MAX_SEND + 2 &&
+        crc16(frame, o - 2) == ((frame[o - 2] << 8) | frame[o - 1]))
+    {
+      return o - 2;
+    }
+    fprintf(stderr, "u2clink: broken frame dropped\n");
+    n = 0;
+  }
+}
+
+// Sends the frame until it is not refused, returns the answer command or 0
+static uint8_t request(uint8_t cmd, const uint8_t *data, uint8_t len)
+{
+  uint8_t frame[1 + LINK_MAX_SEND + 2];
+  int tries;
+
+  for (tries = 0; tries < RETRIES; tries++)
+  {
+    sendFrame(cmd, data, len);
+    if (!receiveFrame(frame, ANSWER_MS))
+    {
+      return 0;
+    }
+    if (frame[0] != LINK_NAK)
+    {
+      return frame[0];
+    }
+  }
+  return LINK_NAK;
+}
+
+static speed_t speed(unsigned long baud)
+{
+  switch (baud)
+  {
+    case 19200: return B19200;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 500000: return B500000;
+    case 1000000: return B1000000;
+    case 2000000: return B2000000;
+  }
+  fprintf(stderr, "u2clink: baud rate %lu not supported\n", baud);
+  exit(2);
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: u2clink [-b baud] tty hello [n] | ask XY | change XY AB | boot XY | data [HEX] | capture [s]\n");
+  exit(2);
+}
+
+static uint32_t le(const uint8_t *p, int bytes)
+{
+  uint32_t v = 0;
+
+  while (bytes--)
+  {
+    v = v << 8 | p[bytes];
+  }
+  return v;
+}
+
+static void onSignal(int)
+{
+  stop = 1;
+}
+
+// Prints the records of can2usb until seconds passed (0: until ^C)
+static int capture(unsigned seconds)
+{
+  uint8_t frame[1 + LINK_MAX_SEND + 2];
+  struct timespec start;
+  unsigned long frames = 0, rxLost = 0, hwLost = 0;
+  uint32_t id, us;
+  size_t n;
+  int i, len;
+
+  signal(SIGINT, onSignal);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (!stop && (!seconds || msSince(start) < seconds * 1000.0))
+  {
+    n = receiveFrame(frame, 100);
+    if (n >= 9 && frame[0] == LINK_LOST)
+    {
+      // same time base as the frames, so the gap shows where it belongs
+      us = le(&frame[1], 4);
+      rxLost += le(&frame[5], 2);
+      hwLost += le(&frame[7], 2);
+      printf("(%lu.%06lu) lost ring %u mcp %u\n", (unsigned long)us / 1000000, (unsigned long)us % 1000000,
+             (unsigned)le(&frame[5], 2), (unsigned)le(&frame[7], 2));
+    }
+    if (n < 10 || frame[0] != LINK_CAPTURE)
+    {
+      continue;
+    }
+    us = le(&frame[1], 4);
+    id = le(&frame[5], 4);
+    len = frame[9] & 0x0F;
+    if (10 + len > (int)n)
+    {
+      continue;
+    }
+    frames++;
+    // candump -t a: ID with 8 digits for extended, 3 for standard frames
+    printf("(%lu.%06lu) %0*X#", (unsigned long)us / 1000000, (unsigned long)us % 1000000,
+           id & 0x80000000 ? 8 : 3, id & 0x1FFFFFFF);
+    if (id & 0x40000000)
+    {
+      printf("R");
+    }
+    for (i = 0; i < len; i++)
+    {
+      printf("%02X", frame[10 + i]);
+    }
+    printf("\n");
+  }
+  fprintf(stderr, "%lu frames, lost %lu in the ring and %lu in the MCP2515\n", frames, rxLost, hwLost);
+  return rxLost || hwLost;
+}
+
+// Board number as usb2can takes it: two characters, e.g. "07"
+static void boardNumber(const char *arg, uint8_t *data)
+{
+  if (strlen(arg) != 2)
+  {
+    usage();
+  }
+  data[0] = arg[0];
+  data[1] = arg[1];
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long baud = linkbaudrate;
+  struct termios tio;
+  struct timespec start;
+  uint8_t data[LINK_MAX_DATA], answer;
+  const char *cmd;
+  double ms, sum = 0, min = 1e9, max = 0;
+  unsigned i, count, len = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'b': baud = strtoul(optarg, 0, 0); break;
+      default: usage();
+    }
+  }
+  if (argc - optind < 2)
+  {
+    usage();
+  }
+  tty = open(argv[optind], O_RDWR | O_NOCTTY);
+  if (tty < 0 || tcgetattr(tty, &tio))
+  {
+    perror(argv[optind]);
+    return 2;
+  }
+  cfmakeraw(&tio);
+  cfsetspeed(&tio, speed(baud));
+  tcsetattr(tty, TCSANOW, &tio);
+  tcflush(tty, TCIOFLUSH);
+
+  cmd = argv[optind + 1];
+  argv += optind + 2;
+  argc -= optind + 2;
+  if (!strcmp(cmd, "hello") && argc <= 1)
+  {
+    count = argc ? strtoul(argv[0], 0, 0) : 1;
+    for (i = 0; i < count; i++)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      if (request(LINK_HELLO, 0, 0) != LINK_READY)
+      {
+        printf("no answer\n");
+        return 1;
+      }
+      ms = msSince(start);
+      sum += ms;
+      min = ms < min ? ms : min;
+      max = ms > max ? ms : max;
+    }
+    printf("%u answers, round trip min %.2f avg %.2f max %.2f ms\n", count, min, sum / count, max);
+    return 0;
+  }
+  if (!strcmp(cmd, "ask") && argc == 1)
+  {
+    boardNumber(argv[0], data);
+    answer = request(LINK_ASK, data, 2);
+    printf("board %s: %s\n", argv[0], answer == LINK_YES ? "answers" : "no answer");
+    return answer != LINK_YES;
+  }
+  if (!strcmp(cmd, "change") && argc == 2)
+  {
+    boardNumber(argv[0], data);
+    boardNumber(argv[1], &data[2]);
+    answer = request(LINK_CHANGE, data, 4);
+    printf("board %s -> %s: %s\n", argv[0], argv[1], answer == LINK_YES ? "changed" : "no answer");
+    return answer != LINK_YES;
+  }
+  if (!strcmp(cmd, "boot") && argc == 1)
+  {
+    // the bootloader announces itself with START_DATA, i.e. LINK_READY
+    boardNumber(argv[0], data);
+    answer = request(LINK_BOOT, data, 2);
+    printf("board %s: %s\n", argv[0], answer == LINK_READY ? "bootloader ready" : "no answer");
+    return answer != LINK_READY;
+  }
+  if (!strcmp(cmd, "data") && argc <= 1)
+  {
+    if (argc)
+    {
+      for (cmd = argv[0]; cmd[0] && cmd[1] && len < 7; cmd += 2)
+      {
+        sscanf(cmd, "%2hhx", &data[len++]);
+      }
+      if (*cmd)
+      {
+        usage();
+      }
+    }
+    if (!len)
+    {
+      // END_DATA, the bootloader does not answer it
+      sendFrame(LINK_DATA, data, 0);
+      return 0;
+    }
+    answer = request(LINK_DATA, data, len);
+    printf("%u bytes: %s\n", len, answer == LINK_MORE ? "more" : "no answer");
+    return answer != LINK_MORE;
+  }
+  if (!strcmp(cmd, "capture") && argc <= 1)
+  {
+    return capture(argc ? strtoul(argv[0], 0, 0) : 0);
+  }
+  usage();
+  return 2;
+}
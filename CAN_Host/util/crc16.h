@@ -0,0 +1,17 @@
+#pragma once
+// The avr-libc CRC used by ownLink, same result as the inline assembler
+
+#include <stdint.h>
+
+// CRC-16 polynomial 0x1021 (XMODEM, CCITT-FALSE with start 0xFFFF)
+static inline uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data)
+{
+  uint8_t i;
+
+  crc ^= (uint16_t)data << 8;
+  for (i = 0; i < 8; i++)
+  {
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
@@ -0,0 +1,18 @@
+#pragma once
+// Busy waits only advance the emulated clock
+
+#include "host_avr.h"
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+static inline void _delay_ms(double ms)
+{
+  hostAdvance((uint32_t)(ms * (F_CPU / 1000UL)));
+}
+
+static inline void _delay_us(double us)
+{
+  hostAdvance((uint32_t)(us * (F_CPU / 1000000UL)));
+}
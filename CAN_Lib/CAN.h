@@ -194,21 +194,24 @@ struct deviceparams
 
 #include "ownCAN.h"
 
+// The interface each controller class implements. Not virtual: nothing calls
+// it through a CANClass pointer, and a vtable would keep read(), write() and
+// everything behind them in every image, the bootloader included.
 class CANClass // Can't inherit from Stream
 {
   public:
     // Initializes CAN communications.
-    virtual void begin(uint32_t bitrate);
+    void begin(uint32_t bitrate);
     // Finishes CAN communications
-    virtual void end();
+    void end();
     // Check if message has been received on any of the buffers
-    virtual uint8_t available();
+    uint8_t available();
     // Receive CAN message and allows use of the message structure for easier message handling
-    virtual CAN_Frame read();
+    CAN_Frame read();
 
-    virtual void flush();
+    void flush();
     // Load and send CAN message.
-    virtual uint8_t write(const CAN_Frame&);
+    uint8_t write(const CAN_Frame&);
 
     //CAN_Frame& operator=(const CAN_Frame&);
 };
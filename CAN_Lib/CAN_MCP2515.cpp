@@ -85,22 +85,123 @@ CAN_MCP2515::CAN_MCP2515(uint8_t CS_Pin)
 
 void CAN_MCP2515::_init()
 {
-  pinMode(CS, OUTPUT);
-  digitalWrite(CS, HIGH);
+  options = 0;
+  rxHead = 0;
+  rxTail = 0;
+  memset((void *)txHead, 0, sizeof(txHead));
+  memset((void *)txTail, 0, sizeof(txTail));
+  txBusy = 0;
+  txArmed = MCP2515_ARM_NONE;
+  rxb1First = 0;
+  asleep = 0;
+  waking = 0;
+  memset(&stats, 0, sizeof(stats));
+  MCP2515_CS_HIGH();
+  pinMode(MCP2515_CS_PIN, OUTPUT);
 }
 
 //Start MCP2515 communications
-void CAN_MCP2515::begin(uint32_t bitrate, uint8_t mode)
+bool CAN_MCP2515::beginCnf(uint32_t cnf, uint8_t mode, uint8_t opts)
 {
+  if (cnf == 0)
+  {
+    // no exact bit timing for this bitrate
+    return false;
+  }
+  // options the build left out of MCP2515_OPTS are ignored, see opt()
+  opts &= MCP2515_OPTS;
+  options = opts;
+  rxHead = rxTail;
+  memcpy((void *)txHead, (const void *)txTail, sizeof(txHead));
+  txBusy = 0;
+  txArmed = MCP2515_ARM_NONE;
+  rxb1First = 0;
+  asleep = 0;
+  waking = 0;
   SPI.begin();//SPI communication begin
   reset();//Set MCP2515 into Config mode by soft reset. Note MCP2515 is in Config mode by default at power up.
   clearRxBuffers();
   clearTxBuffers();
   clearFilters();
+  // TXP of each buffer is its number, see MCP2515_TX_*
+  writeAddress(MCP2515_TXB1CTRL, 1);
+  writeAddress(MCP2515_TXB2CTRL, 2);
+  if (opts & MCP2515_OPT_ROLLOVER)
+  {
+    // a frame meant for a full RXB0 goes to RXB1 instead of being lost
+    modifyAddress(MCP2515_RXB0CTRL, _BV(MCP2515_BUKT), _BV(MCP2515_BUKT));
+  }
   // enable Receive Buffer Interrupt Enable bits
-  enableInterrupts(MCP2515_RX0IF | MCP2515_RX1IF);
-  setBitrate(bitrate); //Set CAN bit rate
+  // and TX buffer empty for the transmit queues
+  // and the error interrupts counted by handleInterrupt()
+  if (opts & MCP2515_OPT_TXQUEUE)
+  {
+    enableInterrupts(_BV(MCP2515_RX0IE) | _BV(MCP2515_RX1IE) | MCP2515_TXnIE
+                     | _BV(MCP2515_ERRIE) | _BV(MCP2515_MERRE));
+  }
+  else if (opts & MCP2515_OPT_RXRING)
+  {
+    enableInterrupts(_BV(MCP2515_RX0IE) | _BV(MCP2515_RX1IE)
+                     | _BV(MCP2515_ERRIE) | _BV(MCP2515_MERRE));
+  }
+  else
+  {
+    enableInterrupts(_BV(MCP2515_RX0IE) | _BV(MCP2515_RX1IE));
+  }
+  setBitrate(cnf); //Set CAN bit rate
+  // no wake-up from sleep() on short glitches
+  modifyAddress(MCP2515_CNF3, _BV(MCP2515_WAKFIL), _BV(MCP2515_WAKFIL));
   setMode(mode);    //Set CAN mode
+  return true;
+}
+
+// In listen-only mode a wrong bitrate shows up as MERRF with the first frame
+// on the bus, the right one as RXnIF. The frame that decided it stays in its
+// RX buffer for the ISR.
+uint32_t CAN_MCP2515::beginAuto(const uint32_t *bitrates, uint8_t count, uint8_t mode, uint8_t opts)
+{
+  uint8_t i, ms, intf;
+
+  for (i = 0; i < count; i++)
+  {
+    if (!beginCnf(mcp2515Cnf(bitrates[i]), MCP2515_MODE_LISTEN, opts))
+    {
+      continue;
+    }
+    for (ms = 0; ms < MCP2515_AUTOBAUD_MS; ms++)
+    {
+      delay(1);
+      intf = readAddress(MCP2515_CANINTF);
+      if (intf & _BV(MCP2515_MERRF))
+      {
+        break;
+      }
+      if (intf & (_BV(MCP2515_RX0IF) | _BV(MCP2515_RX1IF)))
+      {
+        setMode(mode);
+        return bitrates[i];
+      }
+    }
+    if (ms == MCP2515_AUTOBAUD_MS)
+    {
+      // quiet bus, nothing speaks against this bitrate
+      setMode(mode);
+      return bitrates[i];
+    }
+  }
+  // errors on every candidate: stay with the first one
+  if (!beginCnf(mcp2515Cnf(bitrates[0]), mode, opts))
+  {
+    return 0;
+  }
+  return bitrates[0];
+}
+
+uint32_t CAN_MCP2515::beginAuto(uint8_t mode, uint8_t opts)
+{
+  static const uint32_t rates[] = {MCP2515_AUTOBAUD_RATES};
+
+  return beginAuto(rates, sizeof(rates) / sizeof(rates[0]), mode, opts);
 }
 
 void CAN_MCP2515::end()
@@ -111,6 +212,11 @@ void CAN_MCP2515::end()
 // Check to see if message is available
 uint8_t CAN_MCP2515::available()
 {
+  if (opt(MCP2515_OPT_RXRING))
+  {
+    // Returns number of frames waiting in the receive ring
+    return (uint8_t)(rxHead - rxTail);
+  }
   uint8_t msgStatus = readStatus();
   // (msgStatus & 0x01) means message in RX buffer 0
   // (msgStatus & 0x02) means message in RX buffer 1
@@ -123,73 +229,325 @@ uint8_t CAN_MCP2515::available()
 CAN_Frame CAN_MCP2515::read()
 {
   CAN_Frame message;
-  uint8_t buffer, msgStatus;
-  uint8_t RXBnSIDH, RXBnSIDL, RXBnEID8, RXBnEID0, RXBnDLC;
 
-  msgStatus = readStatus();
+  if (!tryRead(message))
+  {
+    // No message?
+    message.valid = false;
+  }
+  return message;
+}
 
-  if (msgStatus & MCP2515_STATUS_CANINTF_RX0IF)
+// Receives the next message straight into the callers frame.
+// Returns false if nothing was waiting; message is untouched then.
+bool CAN_MCP2515::tryRead(CAN_Frame &message)
+{
+  uint8_t rxStatus;
+
+  if (opt(MCP2515_OPT_RXRING))
   {
-    buffer = MCP2515_READ_RX_BUFFER_0_ID;
+    if (rxHead == rxTail)
+    {
+      return false;
+    }
+    decode(&rxRing[rxTail & (CAN_RX_RING_SIZE - 1)], &message);
+#ifdef CAN_RX_STAMPS
+    rxStamp = rxStamps[rxTail & (CAN_RX_RING_SIZE - 1)];
+#endif
+    rxTail++;
+    return true;
   }
-  else if (msgStatus & MCP2515_STATUS_CANINTF_RX1IF)
+
+  // RX STATUS tells in one go whether and where a message is waiting
+  rxStatus = nextRxBuffer(readRXStatus() >> 6);
+  if (!rxStatus)
   {
-    buffer = MCP2515_READ_RX_BUFFER_1_ID;
+    return false;
   }
-  else
+  readFrame(rxStatus, message);
+  return true;
+}
+
+// Reads one RX buffer with a single READ RX BUFFER command.
+// Raising CS at the end clears the matching RXnIF flag.
+void CAN_MCP2515::readBuffer(uint8_t instruction, MCP2515_Buffer *buf)
+{
+  select();
+  SPI.transfer(instruction);
+  burstRead(&buf->sidh, 5); // SIDH, SIDL, EID8, EID0, DLC
+  uint8_t length = (buf->dlc & MCP2515_DLC);
+  if (length > 8)
   {
-    // No message?
-    message.valid = false;
-    return message;
+    length = 8;
   }
+  burstRead(buf->data, length);
+  deselect();
+}
+
+// Same as readBuffer(), but the data bytes go directly into message
+void CAN_MCP2515::readFrame(uint8_t instruction, CAN_Frame &message)
+{
+  MCP2515_Buffer head;
 
-  digitalWrite(CS, LOW);
-  SPI.transfer(buffer);
-  RXBnSIDH = SPI.transfer(0xFF); // SID<10:3>
-  RXBnSIDL = SPI.transfer(0xFF); // SID<2:0>, SRR, IDE, EID<17:16>
-  RXBnEID8 = SPI.transfer(0xFF); // EID<15:8>
-  RXBnEID0 = SPI.transfer(0xFF); // EID<7:0>
-  RXBnDLC  = SPI.transfer(0xFF); // RTR, RB<1:0>, DLC<3:0>
-  message.length = (RXBnDLC & MCP2515_DLC);
-  for (int i = 0; i < message.length; i++)
+  select();
+  SPI.transfer(instruction);
+  burstRead(&head.sidh, 5);
+  decodeHeader(&head, &message);
+  burstRead(message.data, message.length);
+  deselect();
+}
+
+void CAN_MCP2515::decode(const MCP2515_Buffer *buf, CAN_Frame *message)
+{
+  decodeHeader(buf, message);
+  memcpy(message->data, buf->data, message->length);
+}
+
+// Unpacks ID, frame type and length; the data bytes are left alone
+void CAN_MCP2515::decodeHeader(const MCP2515_Buffer *buf, CAN_Frame *message)
+{
+  // built in a local: each |= on the id bit-field would read and write it again
+  uint32_t id;
+
+  message->length = (buf->dlc & MCP2515_DLC);
+  if (message->length > 8)
   {
-    message.data[i] = SPI.transfer(0xFF);
+    message->length = 8;
   }
-  digitalWrite(CS, HIGH);
 
-  message.extended = bitRead(RXBnSIDL, MCP2515_IDE);
+  message->extended = bitRead(buf->sidl, MCP2515_IDE);
   // check to see if this is an Extended ID Msg.
-  if (message.extended == CAN_EXTENDED_FRAME)
+  if (message->extended == CAN_EXTENDED_FRAME)
   {
-    // Serial.println(message.id, HEX);
-    // Serial.print(RXBnSIDH, HEX);
-    // Serial.print(RXBnSIDL, HEX);
-    // Serial.print(RXBnEID8, HEX);
-    // Serial.println(RXBnEID0, HEX);
     // If you don't cast to a larger int _before_ assignment, then
     // sign extension _WILL_ bite you!!!
     // https://en.wikipedia.org/wiki/Sign_extension
-    message.id  = ((uint32_t)RXBnSIDH << 21);            // ID<28:21> = SIDH<7:0>
-    message.id |= ((uint32_t)(RXBnSIDL & MCP2515_SIDL_SID) << 13); // ID<20:18> = SIDL<7:5>
-    message.id |= ((uint32_t)(RXBnSIDL & MCP2515_SIDL_EID) << 16); // ID<17:16> = SIDL<1:0>
-    //Serial.println(message.id, HEX);
-    message.id |= ((uint32_t)RXBnEID8 << 8);             // ID<15:8>  = EID8<7:0>
-    //Serial.println(message.id, HEX);
-    message.id |= ((uint32_t)RXBnEID0 << 0);             // ID<7:0>   = EID0<7:0>
-    //Serial.println(message.id, HEX);
-    message.rtr = bitRead(RXBnDLC, MCP2515_RTR);
-    //Serial.println(message.id, HEX);
+    id  = ((uint32_t)buf->sidh << 21);            // ID<28:21> = SIDH<7:0>
+    id |= ((uint32_t)(buf->sidl & MCP2515_SIDL_SID) << 13); // ID<20:18> = SIDL<7:5>
+    id |= ((uint32_t)(buf->sidl & MCP2515_SIDL_EID) << 16); // ID<17:16> = SIDL<1:0>
+    id |= ((uint32_t)buf->eid8 << 8);             // ID<15:8>  = EID8<7:0>
+    id |= ((uint32_t)buf->eid0 << 0);             // ID<7:0>   = EID0<7:0>
+    message->rtr = bitRead(buf->dlc, MCP2515_RTR);
   }
-  else if (message.extended == CAN_STANDARD_FRAME)
+  else
   {
-    message.id  = (RXBnSIDH << 3);                       // ID<10:3> = SIDH<7:0>
-    message.id |= ((RXBnSIDL & MCP2515_SIDL_SID) >> 5);  // ID<2:0>  = SIDL<7:5>
-    message.rtr = bitRead(RXBnSIDL, MCP2515_SRR);
+    id  = (buf->sidh << 3);                       // ID<10:3> = SIDH<7:0>
+    id |= ((buf->sidl & MCP2515_SIDL_SID) >> 5);  // ID<2:0>  = SIDL<7:5>
+    message->rtr = bitRead(buf->sidl, MCP2515_SRR);
   }
+  message->id = id;
   // everything checks out!
-  message.valid = true;
+  message->valid = true;
+}
 
-  return message;
+// Chooses which RX buffer to read next; bit 0 of full is RXB0, bit 1 RXB1.
+// RXB0 is filled first, so of two full buffers it normally holds the older
+// frame. Once RXB0 is read while RXB1 still waits, the next frame landing in
+// RXB0 is newer than RXB1, which therefore has to go first.
+uint8_t CAN_MCP2515::nextRxBuffer(uint8_t full)
+{
+  if ((full & 0x02) && (!(full & 0x01) || rxb1First))
+  {
+    rxb1First = 0;
+    return MCP2515_READ_RX_BUFFER_1_ID;
+  }
+  if (full & 0x01)
+  {
+    rxb1First = full & 0x02;
+    return MCP2515_READ_RX_BUFFER_0_ID;
+  }
+  return 0;
+}
+
+// Runs in interrupt context whenever the MCP2515 pulls its INT pin low.
+// Only copies the raw RX buffers into the ring and reloads TXB0..TXB2 from
+// the transmit queues; decoding and all protocol work happen later in read(),
+// called from loop(). Without INT0 it may also be called from loop().
+void CAN_MCP2515::handleInterrupt()
+{
+  uint8_t msgStatus, buffer, fill, n, intf;
+
+  if (!opt(MCP2515_OPT_RXRING | MCP2515_OPT_TXQUEUE))
+  {
+    return;
+  }
+  for (;;)
+  {
+    msgStatus = readStatus();
+    if (opt(MCP2515_OPT_TXQUEUE) &&
+        (msgStatus & (MCP2515_STATUS_CANINTF_TX0IF | MCP2515_STATUS_CANINTF_TX1IF | MCP2515_STATUS_CANINTF_TX2IF)))
+    {
+      // TXnIF sit at READ STATUS bits 3, 5, 7 and CANINTF bits 2, 3, 4
+      modifyAddress(MCP2515_CANINTF,
+                    ((msgStatus >> 1) & 0x04) | ((msgStatus >> 2) & 0x08) | ((msgStatus >> 3) & 0x10), 0);
+      for (n = 0; n < MCP2515_TX_CLASSES; n++)
+      {
+        if (!(msgStatus & (MCP2515_STATUS_CANINTF_TX0IF << (2 * n))))
+        {
+          continue;
+        }
+        if (n == MCP2515_TX_BULK && txArmed != MCP2515_ARM_NONE)
+        {
+          // the armed frame is out; LOADED means TX0RTS sent it
+          if (txArmed == MCP2515_ARM_FIRED)
+          {
+            stats.armLatency = (uint16_t)micros() - txFiredAt;
+            if (stats.armLatency > stats.armLatencyMax)
+            {
+              stats.armLatencyMax = stats.armLatency;
+            }
+          }
+          disarmTx();
+        }
+        // TXBn is done: send the next frame of its class
+        if (txHead[n] != txTail[n])
+        {
+          loadTxBuffer(n, txSlot(n, txTail[n]), true);
+          txTail[n]++;
+        }
+        else
+        {
+          txBusy &= ~_BV(n);
+        }
+      }
+    }
+    if (!opt(MCP2515_OPT_RXRING) || !(msgStatus & MCP2515_STATUS_CANINTF_RXnIF))
+    {
+      break;
+    }
+    buffer = nextRxBuffer(msgStatus & MCP2515_STATUS_CANINTF_RXnIF);
+    fill = rxHead - rxTail;
+    if (fill >= CAN_RX_RING_SIZE)
+    {
+      // Ring is full: drop the frame. Addressing the buffer is enough to
+      // clear RXnIF, otherwise the low level interrupt would never end.
+      select();
+      SPI.transfer(buffer);
+      deselect();
+      stats.rxOverruns++;
+      continue;
+    }
+#ifdef CAN_RX_STAMPS
+    rxStamps[rxHead & (CAN_RX_RING_SIZE - 1)] = intStamp;
+#endif
+    readBuffer(buffer, &rxRing[rxHead & (CAN_RX_RING_SIZE - 1)]);
+    rxHead++;
+    if (waking)
+    {
+      stats.wakeLatency = (uint16_t)micros() - wakeAt;
+      waking = 0;
+    }
+    fill++;
+    if (fill > stats.rxHighWater)
+    {
+      stats.rxHighWater = fill;
+    }
+  }
+  // ERRIF/MERRF/WAKIF do not show up in READ STATUS; they would keep INT low
+  intf = readAddress(MCP2515_CANINTF);
+  if (intf & (_BV(MCP2515_ERRIF) | _BV(MCP2515_MERRF)))
+  {
+    handleErrors(intf);
+  }
+  if (intf & _BV(MCP2515_WAKIF))
+  {
+    handleWake();
+  }
+}
+
+// Only sleeps with nothing in flight; the ISR would not see a frame arriving
+// while the MCP2515 is asleep anyway, and pending TX requests would be stuck.
+bool CAN_MCP2515::sleep()
+{
+  // an armed frame just stays in TXB0
+  uint8_t busy = txBusy;
+  if (txArmed == MCP2515_ARM_LOADED)
+  {
+    busy &= ~_BV(MCP2515_TX_BULK);
+  }
+  if (!opt(MCP2515_OPT_RXRING) || busy || rxHead != rxTail)
+  {
+    return false;
+  }
+  if (readStatus() & MCP2515_STATUS_CANINTF_RXnIF)
+  {
+    return false;
+  }
+  wakeMode = getMode();
+  modifyAddress(MCP2515_CANINTF, _BV(MCP2515_WAKIF), 0);
+  setInterrupts(_BV(MCP2515_WAKIE), _BV(MCP2515_WAKIE));
+  asleep = 1;
+  setMode(MCP2515_MODE_SLEEP);
+  return true;
+}
+
+void CAN_MCP2515::wake()
+{
+  uint8_t sreg = SREG;
+  noInterrupts();
+  if (asleep)
+  {
+    leaveSleep();
+  }
+  SREG = sreg;
+}
+
+// The MCP2515 wakes up in listen-only mode. It already receives there, but
+// does not acknowledge, so go back to the mode sleep() left at once. The
+// frame that woke it is not received; it counts as lost like an overrun.
+void CAN_MCP2515::handleWake()
+{
+  modifyAddress(MCP2515_CANINTF, _BV(MCP2515_WAKIF), 0);
+  if (!asleep)
+  {
+    return;
+  }
+  leaveSleep();
+  stats.wakeUps++;
+  stats.hwOverruns++;
+  wakeAt = micros();
+  waking = 1;
+}
+
+void CAN_MCP2515::leaveSleep()
+{
+  asleep = 0;
+  setMode(wakeMode);
+  setInterrupts(_BV(MCP2515_WAKIE), 0);
+}
+
+// Counts the error interrupt given by the CANINTF value intf and clears it
+void CAN_MCP2515::handleErrors(uint8_t intf)
+{
+  sampleErrors();
+  if (intf & _BV(MCP2515_MERRF))
+  {
+    // error frame seen while sending or receiving
+    stats.msgErrors++;
+  }
+  if (intf & _BV(MCP2515_ERRIF))
+  {
+    stats.errorInts++;
+    if (stats.eflg & (_BV(MCP2515_RX0OVR) | _BV(MCP2515_RX1OVR)))
+    {
+      // a frame arrived while both RX buffers were still full
+      stats.hwOverruns++;
+      modifyAddress(MCP2515_EFLG, _BV(MCP2515_RX0OVR) | _BV(MCP2515_RX1OVR), 0);
+    }
+  }
+  modifyAddress(MCP2515_CANINTF, _BV(MCP2515_ERRIF) | _BV(MCP2515_MERRF), 0);
+}
+
+// Copies TEC, REC and EFLG into stats
+void CAN_MCP2515::sampleErrors()
+{
+  select();
+  SPI.transfer(MCP2515_SPI_READ);
+  SPI.transfer(MCP2515_TEC);
+  stats.tec = SPI.transfer(0xFF);
+  stats.rec = SPI.transfer(0xFF); // REC follows TEC
+  deselect();
+  stats.eflg = readAddress(MCP2515_EFLG);
 }
 
 // Receive and display any message (J1939, CANopen, CAN).
@@ -212,74 +570,308 @@ void CAN_MCP2515::flush()
 
 uint8_t CAN_MCP2515::write(const CAN_Frame & message)
 {
-  uint8_t TXBnSIDH, TXBnSIDL, TXBnEID8, TXBnEID0, TXBnDLC, msgStatus, loadBuffer, sendBuffer;
+  if (!tryWrite(message))
+  {
+    // No transmit buffers available; no message sent
+    return 0;
+  }
+  return message.length;
+}
+
+// Sends message or, with MCP2515_OPT_TXQUEUE, queues it behind the frames
+// of the same class still waiting for their TX buffer. Never blocks;
+// returns false and counts the frame in stats.txDrops if there is no room.
+bool CAN_MCP2515::tryWrite(const CAN_Frame & message)
+{
+  MCP2515_Buffer raw;
+
+  encode(message, &raw);
+  return tryWrite(raw, message.priority);
+}
+
+// Same for a frame already packed into the TX buffer layout
+bool CAN_MCP2515::tryWrite(const MCP2515_Buffer & raw, uint8_t priority)
+{
+  uint8_t msgStatus, n, sreg;
+
+  if (opt(MCP2515_OPT_TXQUEUE))
+  {
+    n = txClass(priority);
+    // handleInterrupt() must not see the queue half updated
+    sreg = SREG;
+    noInterrupts();
+    if (!(txBusy & _BV(n)))
+    {
+      txBusy |= _BV(n);
+      loadTxBuffer(n, &raw, true);
+    }
+    else if (n == MCP2515_TX_BULK && txArmed == MCP2515_ARM_LOADED)
+    {
+      // the armed frame was never requested, bulk traffic takes TXB0 back
+      disarmTx();
+      loadTxBuffer(n, &raw, true);
+    }
+    else if ((uint8_t)(txHead[n] - txTail[n]) < txSize(n))
+    {
+      *txSlot(n, txHead[n]) = raw;
+      txHead[n]++;
+    }
+    else
+    {
+      stats.txDrops++;
+      SREG = sreg;
+      return false;
+    }
+    SREG = sreg;
+    return true;
+  }
+
   msgStatus = readStatus();
 
   if (!(msgStatus & MCP2515_STATUS_TXB0CNTRL_TXREQ)) //transmit buffer 0 is open
   {
-    loadBuffer = MCP2515_LOAD_TX_BUFFER_0_ID;
-    sendBuffer = MCP2515_RTS_TXB0;
+    n = 0;
   }
   else if (!(msgStatus & MCP2515_STATUS_TXB1CNTRL_TXREQ)) //transmit buffer 1 is open
   {
-    loadBuffer = MCP2515_LOAD_TX_BUFFER_1_ID;
-    sendBuffer = MCP2515_RTS_TXB1;
+    n = 1;
   }
   else if (!(msgStatus & MCP2515_STATUS_TXB2CNTRL_TXREQ)) //transmit buffer 2 is open
   {
-    loadBuffer = MCP2515_LOAD_TX_BUFFER_2_ID;
-    sendBuffer = MCP2515_RTS_TXB2;
+    n = 2;
   }
   else
   {
-    // No transmit buffers available; no message sent
-    return 0;
+    stats.txDrops++;
+    return false;
+  }
+  loadTxBuffer(n, &raw, true);
+  return true;
+}
+
+// TXB0 is the bulk buffer; an armed frame borrows it while the bulk queue is
+// empty. TXP 3 lets it leave ahead of frames pending in TXB1/TXB2.
+bool CAN_MCP2515::armTx(const MCP2515_Buffer &raw)
+{
+  return armLoad(raw, 0) != MCP2515_ARM_NONE;
+}
+
+// MCP2515_ARM_NONE if TXB0 is busy, MCP2515_ARM_FIRED if raw had to be
+// loaded, MCP2515_ARM_LOADED if TXB0 already held it. The last fresh data
+// bytes are left out of the comparison.
+uint8_t CAN_MCP2515::armLoad(const MCP2515_Buffer &raw, uint8_t fresh)
+{
+  uint8_t sreg, length;
+
+  if (!opt(MCP2515_OPT_TXQUEUE))
+  {
+    return MCP2515_ARM_NONE;
+  }
+  length = 5 + (raw.dlc & MCP2515_DLC);
+  sreg = SREG;
+  noInterrupts();
+  if (txArmed == MCP2515_ARM_LOADED)
+  {
+    if (fresh <= length - 5 && memcmp(&txArmedBuf, &raw, length - fresh) == 0)
+    {
+      SREG = sreg;
+      return MCP2515_ARM_LOADED;
+    }
   }
+  else if (txBusy & _BV(MCP2515_TX_BULK))
+  {
+    SREG = sreg;
+    return MCP2515_ARM_NONE;
+  }
+  else
+  {
+    txBusy |= _BV(MCP2515_TX_BULK);
+    txArmed = MCP2515_ARM_LOADED;
+    writeAddress(MCP2515_TXB0CTRL, 3);
+  }
+  txArmedBuf = raw;
+  loadTxBuffer(MCP2515_TX_BULK, &raw, false);
+  SREG = sreg;
+  return MCP2515_ARM_FIRED;
+}
+
+bool CAN_MCP2515::fireTx(const MCP2515_Buffer &raw, uint16_t since, uint8_t fresh)
+{
+  uint8_t sreg, loaded, length;
+
+  sreg = SREG;
+  noInterrupts();
+  loaded = armLoad(raw, fresh);
+  if (loaded == MCP2515_ARM_NONE)
+  {
+    SREG = sreg;
+    return false;
+  }
+  if (loaded == MCP2515_ARM_LOADED)
+  {
+    stats.armHits++;
+    if (fresh)
+    {
+      // only the bytes that changed since armTx(), e.g. a time stamp
+      length = raw.dlc & MCP2515_DLC;
+      memcpy(txArmedBuf.data + length - fresh, raw.data + length - fresh, fresh);
+      select();
+      SPI.transfer(MCP2515_SPI_WRITE);
+      SPI.transfer(MCP2515_TXB0D0 + length - fresh);
+      burstWrite(raw.data + length - fresh, fresh);
+      deselect();
+    }
+  }
+  else
+  {
+    stats.armMisses++;
+  }
+  txFiredAt = since;
+  txArmed = MCP2515_ARM_FIRED;
+  select();
+  SPI.transfer(0x80 | _BV(MCP2515_TX_BULK)); // MCP2515_RTS_TXB0
+  deselect();
+  SREG = sreg;
+  return true;
+}
+
+void CAN_MCP2515::disarmTx()
+{
+  txArmed = MCP2515_ARM_NONE;
+  writeAddress(MCP2515_TXB0CTRL, 0);
+}
 
-  TXBnDLC = (message.length & MCP2515_DLC);
+// Number of frames of this priority tryWrite() can still take without dropping
+uint8_t CAN_MCP2515::txFree(uint8_t priority)
+{
+  if (opt(MCP2515_OPT_TXQUEUE))
+  {
+    uint8_t n = txClass(priority);
+    return txSize(n) - (uint8_t)(txHead[n] - txTail[n]);
+  }
+  uint8_t msgStatus = readStatus();
+  return !(msgStatus & MCP2515_STATUS_TXB0CNTRL_TXREQ)
+       + !(msgStatus & MCP2515_STATUS_TXB1CNTRL_TXREQ)
+       + !(msgStatus & MCP2515_STATUS_TXB2CNTRL_TXREQ);
+}
+
+uint8_t CAN_MCP2515::txClass(uint8_t priority)
+{
+  if (priority >= 8)
+  {
+    return MCP2515_TX_BULK;
+  }
+  if (priority == 1 || priority == 2)
+  {
+    return MCP2515_TX_URGENT;
+  }
+  return MCP2515_TX_NORMAL;
+}
+
+uint8_t CAN_MCP2515::txSize(uint8_t n)
+{
+  return (n == MCP2515_TX_BULK) ? CAN_TX_QUEUE_SIZE : CAN_TX_PRIO_QUEUE_SIZE;
+}
+
+// txQueue holds the bulk queue followed by the normal and the urgent one
+MCP2515_Buffer *CAN_MCP2515::txSlot(uint8_t n, uint8_t index)
+{
+  if (n == MCP2515_TX_BULK)
+  {
+    return &txQueue[index & (CAN_TX_QUEUE_SIZE - 1)];
+  }
+  return &txQueue[CAN_TX_QUEUE_SIZE + (n - 1) * CAN_TX_PRIO_QUEUE_SIZE
+                  + (index & (CAN_TX_PRIO_QUEUE_SIZE - 1))];
+}
+
+// Packs ID, DLC and data of message into the TX buffer layout
+void CAN_MCP2515::encode(const CAN_Frame & message, MCP2515_Buffer *buf)
+{
+  uint32_t id = message.id; // the bit-field read once
+  uint8_t length = message.length;
+  if (length > 8)
+  {
+    length = 8;
+  }
+  buf->dlc = length;
   if (message.extended == CAN_EXTENDED_FRAME)
   {
     //generate id bytes before SPI write
-    TXBnSIDH  = (message.id >> 21);                      // SIDH<7:0> = ID<28:21>
-    TXBnSIDL  = ((message.id >> 13) & MCP2515_SIDL_SID); // SIDL<7:5> = ID<20:18>
-    TXBnSIDL |= ((message.id >> 16) & MCP2515_SIDL_EID); // SIDL<1:0> = ID<17:16>
-    bitSet(TXBnSIDL, MCP2515_IDE);
-    TXBnEID8  = (message.id >> 8);                       // EID8<7:0> = ID<15:8>
-    TXBnEID0  = (message.id >> 0);                       // EID0<7:0> = ID<7:0>
+    buf->sidh  = (id >> 21);                      // SIDH<7:0> = ID<28:21>
+    buf->sidl  = ((id >> 13) & MCP2515_SIDL_SID); // SIDL<7:5> = ID<20:18>
+    buf->sidl |= ((id >> 16) & MCP2515_SIDL_EID); // SIDL<1:0> = ID<17:16>
+    bitSet(buf->sidl, MCP2515_IDE);
+    buf->eid8  = (id >> 8);                       // EID8<7:0> = ID<15:8>
+    buf->eid0  = (id >> 0);                       // EID0<7:0> = ID<7:0>
     if (message.rtr)
     {
-      bitSet(TXBnDLC, MCP2515_RTR);
+      bitSet(buf->dlc, MCP2515_RTR);
     }
   }
   else if (message.extended == CAN_STANDARD_FRAME)
   {
-    TXBnSIDH = (message.id >> 3);                        // SIDH<7:0> = ID<10:3>
-    TXBnSIDL = ((message.id << 5) & MCP2515_SIDL_SID);   // SIDL<7:5> = ID<2:0>
-    TXBnEID8 = 0x00; // zero out extended ID registers
-    TXBnEID0 = 0x00; // zero out extended ID registers
+    buf->sidh = (id >> 3);                        // SIDH<7:0> = ID<10:3>
+    buf->sidl = ((id << 5) & MCP2515_SIDL_SID);   // SIDL<7:5> = ID<2:0>
+    buf->eid8 = 0x00; // zero out extended ID registers
+    buf->eid0 = 0x00; // zero out extended ID registers
     if (message.rtr)
     {
-      bitSet(TXBnSIDL, MCP2515_SRR);
+      bitSet(buf->sidl, MCP2515_SRR);
     }
   }
 
-  digitalWrite(CS, LOW);
-  SPI.transfer(loadBuffer);
-  SPI.transfer(TXBnSIDH); //ID high bits
-  SPI.transfer(TXBnSIDL); //ID low bits
-  SPI.transfer(TXBnEID8); //extended ID high bits
-  SPI.transfer(TXBnEID0); //extended ID low bits
-  SPI.transfer(TXBnDLC); //data length code
-  for (int i = 0; i < message.length; i++)   //load data buffer
+  memcpy(buf->data, message.data, length);
+}
+
+// Loads TXBn and, if send is set, requests its transmission. LOAD TX BUFFER
+// and RTS run in one SPI transaction; CS only goes high for the two cycles
+// the MCP2515 needs to end the first instruction.
+void CAN_MCP2515::loadTxBuffer(uint8_t n, const MCP2515_Buffer *buf, bool send)
+{
+  uint8_t length = (buf->dlc & MCP2515_DLC);
+  if (length > 8)
+  {
+    length = 8;
+  }
+  select();
+  SPI.transfer(MCP2515_LOAD_TX_BUFFER_0_ID + 2 * n);
+  burstWrite(&buf->sidh, 5 + length); // ID, DLC and data
+  if (send)
   {
-    SPI.transfer(message.data[i]);
+    MCP2515_CS_HIGH();
+    MCP2515_CS_LOW();
+    SPI.transfer(0x80 | _BV(n)); // MCP2515_RTS_TXBn
   }
-  digitalWrite(CS, HIGH);
-  digitalWrite(CS, LOW);
-  SPI.transfer(sendBuffer);
-  digitalWrite(CS, HIGH);
+  deselect();
+}
 
-  return message.length;
+// Streams count bytes to the MCP2515. The next byte is fetched while the
+// current one is shifted out, so the bus runs without gaps.
+void CAN_MCP2515::burstWrite(const uint8_t *buf, uint8_t count)
+{
+  if (count == 0)
+  {
+    return;
+  }
+  SPDR = *buf++;
+  while (--count > 0)
+  {
+    uint8_t out = *buf++;
+    while (!(SPSR & _BV(SPIF))) ;
+    SPDR = out;
+  }
+  while (!(SPSR & _BV(SPIF))) ;
+}
+
+// Clocks count bytes out of the MCP2515 into buf
+void CAN_MCP2515::burstRead(uint8_t *buf, uint8_t count)
+{
+  while (count-- > 0)
+  {
+    SPDR = 0xFF;
+    while (!(SPSR & _BV(SPIF))) ;
+    *buf++ = SPDR;
+  }
 }
 
 // Function to load and send any message. (J1939, CANopen, CAN). It assumes user knows what the ID is supposed to be
@@ -294,63 +886,84 @@ uint8_t CAN_MCP2515::write(uint32_t ID, uint8_t frameType, uint8_t length, uint8
 }
 
 // MCP2515 SPI INTERFACE COMMANDS
+// Every command is framed by select()/deselect(). The transaction masks the
+// INT pin interrupt (see SPI.usingInterrupt()), so a command started in loop()
+// cannot be split by handleInterrupt().
+void CAN_MCP2515::select()
+{
+  SPI.beginTransaction(SPISettings(MCP2515_SPI_CLOCK, MSBFIRST, SPI_MODE0));
+  MCP2515_CS_LOW();
+}
+
+void CAN_MCP2515::deselect()
+{
+  MCP2515_CS_HIGH();
+  SPI.endTransaction();
+}
+
 // Reset command
 void CAN_MCP2515::reset()
 {
-  digitalWrite(CS, LOW);
+  uint8_t i;
+
+  select();
   SPI.transfer(MCP2515_SPI_RESET);
-  digitalWrite(CS, HIGH);
+  deselect();
+  // the MCP2515 is usable once it reports config mode, no fixed delay needed
+  for (i = 0; i < 100 && getMode() != MCP2515_MODE_CONFIG; i++)
+  {
+  }
 }
 
 //Reads a single MCP2515 register
 uint8_t CAN_MCP2515::readAddress(uint8_t address)
 {
-  digitalWrite(CS, LOW);
+  select();
   SPI.transfer(MCP2515_SPI_READ);
   SPI.transfer(address);
   uint8_t retVal = SPI.transfer(0xFF);
-  digitalWrite(CS, HIGH);
+  deselect();
   return retVal;
 }
 
 // Writes a single MCP2515 register
 void CAN_MCP2515::writeAddress(uint8_t address, uint8_t value)
 {
-  digitalWrite(CS, LOW);
+  select();
   SPI.transfer(MCP2515_SPI_WRITE);
   SPI.transfer(address);
   SPI.transfer(value);
-  digitalWrite(CS, HIGH);
+  deselect();
 }
 
 // Modifies a single MCP2515 register
 void CAN_MCP2515::modifyAddress(uint8_t address, uint8_t mask, uint8_t value)
 {
-  digitalWrite(CS, LOW);
+  select();
   SPI.transfer(MCP2515_SPI_BIT_MODIFY);
   SPI.transfer(address);
   SPI.transfer(mask);
   SPI.transfer(value);
-  digitalWrite(CS, HIGH);
+  deselect();
 }
 
 //Function that reads several status bits for transmit and receive functions.
 uint8_t CAN_MCP2515::readStatus()
 {
-  digitalWrite(CS, LOW);
+  select();
   SPI.transfer(MCP2515_SPI_READ_STATUS);
   uint8_t retVal = SPI.transfer(0xFF);
-  digitalWrite(CS, HIGH);
+  deselect();
   return retVal;
 }
 
 //Function that reads receive functions and filter hits
 uint8_t CAN_MCP2515::readRXStatus()
 {
-  digitalWrite(CS, LOW);
+  select();
   SPI.transfer(MCP2515_SPI_RX_STATUS);
   uint8_t retVal = SPI.transfer(0xFF);
-  digitalWrite(CS, HIGH);
+  deselect();
   return retVal;
   /*
   Values are as follows
@@ -390,6 +1003,25 @@ void CAN_MCP2515::setMode(uint8_t mode)
   modifyAddress(MCP2515_CANCTRL, MCP2515_REQOPn, mode); //Writes config values to registers
 }
 
+// Requests mode and waits until the MCP2515 has taken it. Pending
+// transmissions have to leave first, so this can take a few frame times;
+// after MCP2515_MODE_MS it gives up and returns false.
+bool CAN_MCP2515::switchMode(uint8_t mode)
+{
+  uint16_t i;
+
+  setMode(mode);
+  for (i = 0; getMode() != mode; i++)
+  {
+    if (i >= MCP2515_MODE_MS * 100)
+    {
+      return false;
+    }
+    delayMicroseconds(10);
+  }
+  return true;
+}
+
 // Function to read mode back
 uint8_t CAN_MCP2515::getMode()
 {
@@ -399,57 +1031,12 @@ uint8_t CAN_MCP2515::getMode()
 //Sets MCP2515 controller bitrate.
 // Configuration speeds are determined by Crystal Oscillator.
 // See MCP2515 datasheet Pg39 for more info.
-void CAN_MCP2515::setBitrate(uint32_t bitrate)
+void CAN_MCP2515::setBitrate(uint32_t cnf)
 {
-  uint8_t CNF1, CNF2, CNF3;
-/*  if (bitrate == 10000)
-  {
-    CNF1 = 0x31; // Set BRP5, BRP4, and BRP0
-    CNF2 = 0xB8; // Set BTLMODE and PHSEG1<2:0>
-    CNF3 = 0x05; // Set PHSEG22 and PHSEG20
-  }
-  else if (bitrate == 20000)
-  {
-    CNF1 = 0x18;
-    CNF2 = 0xB8; // Set BTLMODE and PHSEG1<2:0>
-    CNF3 = 0x05; // Set PHSEG22 and PHSEG20
-  }
-  else if (bitrate == 50000)
-  {
-    CNF1 = 0x09;
-    CNF2 = 0xB8; // Set BTLMODE and PHSEG1<2:0>
-    CNF3 = 0x05; // Set PHSEG22 and PHSEG20
-  }
-  else if (bitrate == 100000)
-  {
-    CNF1 = 0x04;
-    CNF2 = 0xB8; // Set BTLMODE and PHSEG1<2:0>
-    CNF3 = 0x05; // Set PHSEG22 and PHSEG20
-  }
-  else if (bitrate == 125000)
-  {
-    CNF1 = 0x03;
-    CNF2 = 0xB8; // Set BTLMODE and PHSEG1<2:0>
-    CNF3 = 0x05; // Set PHSEG22 and PHSEG20
-  }
-  else*/ if (bitrate == 250000)
-  {
-    CNF1 = 0x01;
-    CNF2 = 0xB8;
-    CNF3 = 0x05;
-  }
-/*  else if (bitrate == 500000)
-  {
-    CNF1 = 0x00;
-    CNF2 = 0xB8;
-    CNF3 = 0x05;
-  }
-  else if (bitrate == 1000000)
-  {
-    CNF1 = 0x00;
-    CNF2 = 0xD0;
-    CNF3 = 0x82;
-  }*/
+  uint8_t CNF1 = cnf >> 16;
+  uint8_t CNF2 = cnf >> 8;
+  uint8_t CNF3 = cnf;
+
   writeAddress(MCP2515_CNF1, CNF1);//Write config address 1
   writeAddress(MCP2515_CNF2, CNF2);//Write config address 2
   writeAddress(MCP2515_CNF3, CNF3);//Write config address 3
@@ -603,94 +1190,151 @@ void CAN_MCP2515::clearFilters()
   modifyAddress(MCP2515_RXB1CTRL, MCP2515_RXMn, MCP2515_RXMn);
 }
 
-//Set Masks for filters
-void CAN_MCP2515::setMask(uint8_t mask, uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3)
+//Turns RX filters/masks on. Only frames matching RXF0..RXF5 are received.
+bool CAN_MCP2515::enableFilters()
 {
-  setMode(MCP2515_MODE_CONFIG);
-  digitalWrite(CS, LOW);
-  SPI.transfer(mask);
-  SPI.transfer(b0);
-  SPI.transfer(b1);
-  SPI.transfer(b2);
-  SPI.transfer(b3);
-  digitalWrite(CS, HIGH);
-  setMode(MCP2515_MODE_NORMAL);
+  uint8_t mode = getMode();
+  if (!switchMode(MCP2515_MODE_CONFIG))
+  {
+    // withdraw the request, the controller stays in mode
+    setMode(mode);
+    return false;
+  }
+  modifyAddress(MCP2515_RXB0CTRL, MCP2515_RXMn, 0);
+  modifyAddress(MCP2515_RXB1CTRL, MCP2515_RXMn, 0);
+  return switchMode(mode);
 }
 
-// Set Receive Filters. Will think of a more user friendly way to set these in the future but for right now it works....
-void CAN_MCP2515::setFilter(uint8_t filter, uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3)
+//Set Masks for filters. Mask 0 belongs to RXF0/RXF1 (RXB0), mask 1 to RXF2..RXF5 (RXB1).
+bool CAN_MCP2515::setMask(uint8_t n, const CAN_Filter &mask)
 {
-  setMode(MCP2515_MODE_CONFIG);
-  digitalWrite(CS, LOW);
-  SPI.transfer(filter);
-  SPI.transfer(b0);
-  SPI.transfer(b1);
-  SPI.transfer(b2);
-  SPI.transfer(b3);
-  digitalWrite(CS, HIGH);
-  setMode(MCP2515_MODE_NORMAL);
+  uint8_t mode = getMode();
+  // masks only take writes in config mode
+  if (!switchMode(MCP2515_MODE_CONFIG))
+  {
+    setMode(mode);
+    return false;
+  }
+  writeId(n ? MCP2515_RXM1SIDH : MCP2515_RXM0SIDH, mask.id, mask.extended, false);
+  return switchMode(mode);
+}
+
+// Set Receive Filter n (0..5)
+bool CAN_MCP2515::setFilter(uint8_t n, const CAN_Filter &filter)
+{
+  uint8_t mode = getMode();
+  // filters only take writes in config mode
+  if (!switchMode(MCP2515_MODE_CONFIG))
+  {
+    setMode(mode);
+    return false;
+  }
+  // RXF0..RXF2 start at 00h, RXF3..RXF5 at 10h
+  writeId(((n < 3) ? 0 : 4) + 4 * n, filter.id, filter.extended, filter.extended);
+  return switchMode(mode);
+}
+
+// Writes an identifier into the SIDH/SIDL/EID8/EID0 registers at address.
+// exide sets the EXIDE bit, which filters use to match extended frames only.
+void CAN_MCP2515::writeId(uint8_t address, uint32_t id, uint8_t extended, uint8_t exide)
+{
+  uint8_t sidh, sidl, eid8, eid0;
+
+  if (extended)
+  {
+    sidh  = (id >> 21);                      // SIDH<7:0> = ID<28:21>
+    sidl  = ((id >> 13) & MCP2515_SIDL_SID); // SIDL<7:5> = ID<20:18>
+    sidl |= ((id >> 16) & MCP2515_SIDL_EID); // SIDL<1:0> = ID<17:16>
+    eid8  = (id >> 8);                       // EID8<7:0> = ID<15:8>
+    eid0  = (id >> 0);                       // EID0<7:0> = ID<7:0>
+  }
+  else
+  {
+    sidh = (id >> 3);                        // SIDH<7:0> = ID<10:3>
+    sidl = ((id << 5) & MCP2515_SIDL_SID);   // SIDL<7:5> = ID<2:0>
+    eid8 = 0x00;
+    eid0 = 0x00;
+  }
+  if (exide)
+  {
+    bitSet(sidl, MCP2515_EXIDE);
+  }
+  select();
+  SPI.transfer(MCP2515_SPI_WRITE);
+  SPI.transfer(address);
+  SPI.transfer(sidh);
+  SPI.transfer(sidl);
+  SPI.transfer(eid8);
+  SPI.transfer(eid0);
+  deselect();
 }
 
 //At power up, MCP2515 buffers are not truly empty. There is random data in the registers
 //This loads buffers with zeros to prevent incorrect data to be sent.
 void CAN_MCP2515::clearRxBuffers()
 {
-  digitalWrite(CS, LOW);
+  select();
   SPI.transfer(MCP2515_SPI_WRITE);
   SPI.transfer(MCP2515_RXB0SIDH);
   for (uint8_t i = 0; i < 13; i++)
   {
     SPI.transfer(0x00);
   }
-  digitalWrite(CS, HIGH);
-  digitalWrite(CS, LOW);
+  deselect();
+  select();
   SPI.transfer (MCP2515_SPI_WRITE);
   SPI.transfer (MCP2515_RXB1SIDH);
   for (uint8_t i = 0; i < 13; i++)
   {
     SPI.transfer(0x00);
   }
-  digitalWrite(CS, HIGH);
+  deselect();
 }
 
 // This loads buffers with zeros to prevent incorrect data to be sent.
 // Note: If RTS is sent to a buffer that has all zeros it will still send a message with all zeros.
 void CAN_MCP2515::clearTxBuffers()
 {
-  digitalWrite(CS, LOW);
+  select();
   SPI.transfer (MCP2515_SPI_WRITE);
   SPI.transfer (MCP2515_TXB0SIDH);
   for (uint8_t i = 0; i < 13; i++)
   {
     SPI.transfer(0x00);
   }
-  digitalWrite(CS, HIGH);
-  digitalWrite(CS, LOW);
+  deselect();
+  select();
   SPI.transfer (MCP2515_SPI_WRITE);
   SPI.transfer (MCP2515_TXB1SIDH);
   for (uint8_t i = 0; i < 13; i++)
   {
     SPI.transfer(0x00);
   }
-  digitalWrite(CS, HIGH);
-  digitalWrite(CS, LOW);
+  deselect();
+  select();
   SPI.transfer (MCP2515_SPI_WRITE);
   SPI.transfer (MCP2515_TXB2SIDH);
   for (uint8_t i = 0; i < 13; i++)
   {
     SPI.transfer(0x00);
   }
-  digitalWrite(CS, HIGH);
+  deselect();
 }
 
 //Enable hardware Request to send pins. It allows messages to be send by driving RTS pins low.
 //These are not to be confused with RTS commands. These are the actual MCP2515 hardware pins
-void CAN_MCP2515::enableRTSPins()
+//Only TX0RTS is used: TXB0 holds the armed frame, TXB1/TXB2 are always loaded with RTS.
+bool CAN_MCP2515::enableRTSPins()
 {
+  uint8_t mode = getMode();
   // According to section 10.1, TXRTSCTRL is only modifiable in Configuration Mode
-  setMode(MCP2515_MODE_CONFIG);
-  writeAddress(MCP2515_TXRTSCTRL, MCP2515_BnRTSM); // enable TXnRTS pins
-  setMode(MCP2515_MODE_NORMAL);
+  if (!switchMode(MCP2515_MODE_CONFIG))
+  {
+    setMode(mode);
+    return false;
+  }
+  writeAddress(MCP2515_TXRTSCTRL, _BV(MCP2515_B0RTSM)); // enable TX0RTS pin
+  return switchMode(mode);
 }
 
 // Enable interrupts. The CANINTF register contains the corresponding interrupt flag bit for
@@ -714,11 +1358,11 @@ void CAN_MCP2515::setInterrupts(uint8_t mask, uint8_t writeVal)
 
 void CAN_MCP2515::enableInterrupts(uint8_t writeVal)
 {
-  digitalWrite(CS, LOW);
+  select();
   SPI.transfer(MCP2515_SPI_WRITE);
   SPI.transfer(MCP2515_CANINTE);
   SPI.transfer(writeVal);
-  digitalWrite(CS, HIGH);
+  deselect();
 }
 
 //////////////// new own functions
@@ -741,12 +1385,14 @@ CAN_MCP2515plus::CAN_MCP2515plus()
   //Use a default of pin 10 for SPI chip select
   CS = 10;
   _init();
+  acceptSoft = false;
 }
 
 CAN_MCP2515plus::CAN_MCP2515plus(uint8_t CS_Pin)
 {
   CS = CS_Pin;
   _init();
+  acceptSoft = false;
 }
 void CAN_MCP2515plus::can_answer2(uint8_t lng, bool resp){
   outgoingMsg.hash = hash;
@@ -758,6 +1404,97 @@ void CAN_MCP2515plus::can_answer2(uint8_t lng, bool resp){
 void CAN_MCP2515plus::can_answer(uint8_t lng){
   can_answer2(lng, true);
 }
+
+bool CAN_MCP2515plus::arm_answer(uint8_t lng){
+  outgoingMsg.hash = hash;
+  outgoingMsg.resp_bit = true;
+  outgoingMsg.length = lng;
+  return armCanFrame(outgoingMsg);
+}
+
+bool CAN_MCP2515plus::fire_answer(uint8_t lng, uint16_t since, uint8_t fresh){
+  outgoingMsg.hash = hash;
+  outgoingMsg.resp_bit = true;
+  outgoingMsg.length = lng;
+  return fireCanFrame(outgoingMsg, since, fresh);
+}
+
+// Programs the acceptance filters so that only the given Märklin commands
+// with the given response bit reach this node. RXB0 takes the first two
+// commands exactly, RXB1 the next four. With more commands RXB1 only
+// compares the bits all remaining commands have in common, and accepts()
+// sorts out the rest in software. cmds must stay valid (static list).
+// RXB0 ignores the response bit, so answers to the first two commands
+// (PING with the firmwares' lists) come in as well; ownCAN looks at their
+// hash for collisions before accepts() drops them.
+void CAN_MCP2515plus::acceptCommands(const uint8_t *cmds, uint8_t count, bool resp_bit)
+{
+  CAN_Filter mask, filter;
+  uint8_t common = 0xFF;
+
+  acceptList = cmds;
+  acceptCount = count;
+  acceptResp = resp_bit;
+  acceptSoft = (count > 6);
+  if (count == 0)
+  {
+    return;
+  }
+  for (uint8_t i = 2; i < count; i++)
+  {
+    common &= ~(cmds[i] ^ cmds[2]);
+  }
+  // ID<24:17> = command, ID<16> = response; priority and hash are ignored
+  mask.extended = CAN_EXTENDED_FRAME;
+  filter.extended = CAN_EXTENDED_FRAME;
+  mask.id = 0x01FE0000UL;
+  bool ok = setMask(0, mask);
+  mask.id = 0x01FF0000UL;
+  if (acceptSoft)
+  {
+    mask.id = ((uint32_t)common << 17) | 0x00010000UL;
+  }
+  ok = ok && setMask(1, mask);
+  for (uint8_t n = 0; ok && n < 6; n++)
+  {
+    // unused filters repeat the last command
+    uint8_t cmd = cmds[(n < count) ? n : count - 1];
+    if (acceptSoft && n >= 2)
+    {
+      cmd = cmds[2];
+    }
+    filter.id = ((uint32_t)cmd << 17) | ((uint32_t)resp_bit << 16);
+    ok = setFilter(n, filter);
+  }
+  if (!ok || !enableFilters())
+  {
+    // the MCP2515 kept sending and never reached config mode:
+    // receive everything and let accepts() sort it out
+    clearFilters();
+    acceptSoft = true;
+  }
+}
+
+// Software part of acceptCommands(); true for frames this node wants
+bool CAN_MCP2515plus::accepts(const CAN_Frame &frame)
+{
+  if (acceptCount && frame.resp_bit != acceptResp)
+  {
+    return false;
+  }
+  if (!acceptSoft)
+  {
+    return true;
+  }
+  for (uint8_t i = 0; i < acceptCount; i++)
+  {
+    if (acceptList[i] == frame.cmd)
+    {
+      return true;
+    }
+  }
+  return false;
+}
 
 void CAN_MCP2515plus::configTerminator(int channel, int framecount) {
   outgoingMsg.cmd = CONFIG_Status;
@@ -778,8 +1515,7 @@ void CAN_MCP2515plus::configDataFrame(uint8_t config_data[8], int framecount) {
     outgoingMsg.data[i] = config_data[i];
   }
   sendCanFrame(outgoingMsg);
-  delay(1);
 }
 
-CAN_MCP2515 CANBase(10); // Create CAN channel using pin 10 for SPI chip select
-CAN_MCP2515plus CAN(10); // Create CAN channel using pin 10 for SPI chip select
+// The only driver instance; the Märklin layer sits on top of the MCP2515 driver
+CAN_MCP2515plus CAN(MCP2515_CS_PIN);
@@ -64,6 +64,28 @@ DATE      VER   WHO   WHAT
 
 #include "SPI.h"
 #include "ownCAN.h"
+#include "CAN_Defs.h"
+
+// BOARD SETUP, fixed at compile time. Override in the project's CAN_Defs.h
+#ifndef MCP2515_CS_PIN
+#define MCP2515_CS_PIN    10          // SPI chip select, D10 = PB2
+#endif
+#ifndef MCP2515_OSC
+#define MCP2515_OSC       16000000UL  // crystal of the MCP2515 module
+#endif
+#ifndef MCP2515_BITRATE
+#define MCP2515_BITRATE   250000UL    // Märklin CAN bus
+#endif
+#ifndef MCP2515_SPI_CLOCK
+#define MCP2515_SPI_CLOCK 8000000UL   // F_CPU/2; the MCP2515 takes up to 10 MHz
+#endif
+
+// Port and bit of MCP2515_CS_PIN on the ATmega328P. Both are constants, so
+// MCP2515_CS_LOW()/MCP2515_CS_HIGH() compile to a single cbi/sbi.
+#define MCP2515_CS_PORT   (MCP2515_CS_PIN < 8 ? PORTD : (MCP2515_CS_PIN < 14 ? PORTB : PORTC))
+#define MCP2515_CS_BIT    (MCP2515_CS_PIN < 8 ? MCP2515_CS_PIN : (MCP2515_CS_PIN < 14 ? MCP2515_CS_PIN - 8 : MCP2515_CS_PIN - 14))
+#define MCP2515_CS_LOW()  (MCP2515_CS_PORT &= ~_BV(MCP2515_CS_BIT))
+#define MCP2515_CS_HIGH() (MCP2515_CS_PORT |= _BV(MCP2515_CS_BIT))
 
 //SPI Interface functions
 #define MCP2515_SPI_RESET              0xC0
@@ -107,6 +129,12 @@ DATE      VER   WHO   WHAT
 #define MCP2515_STATUS_CANINTF_RX0IF   0x01 // message in RX buffer 0
 #define MCP2515_STATUS_CANINTF_RXnIF   0x03 // mask for message in RX buffer bits
 
+// FIGURE 12-9: RX STATUS INSTRUCTION
+#define MCP2515_RX_STATUS_RXB1         0x80 // message in RX buffer 1
+#define MCP2515_RX_STATUS_RXB0         0x40 // message in RX buffer 0
+#define MCP2515_RX_STATUS_EXTENDED     0x10 // extended frame (of RXB0 if both are full)
+#define MCP2515_RX_STATUS_REMOTE       0x08 // remote frame (of RXB0 if both are full)
+
 // MCP2515 CAN CONTROLLER REGISTERS. SEE MCP2515 DATASHEET SECTION 11.0 FOR FURTHER EXPLANATION
 // http://www.microchip.com/wwwproducts/Devices.aspx?dDocName=en010406
 #define MCP2515_RXF0      0x00
@@ -423,14 +451,115 @@ DATE      VER   WHO   WHAT
 #define MCP2515_MODE_LISTEN		0x60
 #define MCP2515_MODE_CONFIG		0x80
 
+// begin() OPTIONS
+#define MCP2515_OPT_RXRING    0x01 // handleInterrupt() drains RXB0/RXB1 into the receive ring
+#define MCP2515_OPT_TXQUEUE   0x02 // write() queues frames, handleInterrupt() refills TXB0..TXB2
+#define MCP2515_OPT_ROLLOVER  0x04 // RXB0 rolls over into RXB1 when full (BUKT), read order kept
+// Options a build can pass to begin(); the code of the others is left out.
+// The bootloader sets it to 0 in its CAN_Defs.h and only polls.
+#ifndef MCP2515_OPTS
+#define MCP2515_OPTS          (MCP2515_OPT_RXRING | MCP2515_OPT_TXQUEUE | MCP2515_OPT_ROLLOVER)
+#endif
+
+// Candidates beginAuto() probes by default, the usual bitrate first
+#ifndef MCP2515_AUTOBAUD_RATES
+#define MCP2515_AUTOBAUD_RATES MCP2515_BITRATE, CAN_BPS_125K, CAN_BPS_500K, CAN_BPS_1000K
+#endif
+// ms beginAuto() listens on each candidate
+#ifndef MCP2515_AUTOBAUD_MS
+#define MCP2515_AUTOBAUD_MS   25
+#endif
+// ms switchMode() waits for the new mode; the MCP2515 only changes it once
+// its pending transmissions are done
+#ifndef MCP2515_MODE_MS
+#define MCP2515_MODE_MS       10
+#endif
+
+// Number of frames the receive ring can hold; must be a power of two
+#ifndef CAN_RX_RING_SIZE
+#define CAN_RX_RING_SIZE      8
+#endif
+// Transmit classes, picked from CAN_Frame::priority. Each class has its own
+// queue and TX buffer; the buffer number is also its TXP, so a pending
+// urgent frame always leaves the controller before normal and bulk ones.
+#define MCP2515_TX_BULK       0 // priority 8..15 -> TXB0
+#define MCP2515_TX_NORMAL     1 // priority 0, 3..7 -> TXB1
+#define MCP2515_TX_URGENT     2 // priority 1..2 -> TXB2
+#define MCP2515_TX_CLASSES    3
+
+// State of TXB0 while it holds a frame armed ahead of an event, see armTx()
+#define MCP2515_ARM_NONE      0
+#define MCP2515_ARM_LOADED    1 // frame in TXB0, waiting for fireTx() or the TX0RTS pin
+#define MCP2515_ARM_FIRED     2 // RTS given, TX0IF not yet seen
+
+// Number of frames the bulk transmit queue can hold; must be a power of two
+#ifndef CAN_TX_QUEUE_SIZE
+#define CAN_TX_QUEUE_SIZE     8
+#endif
+// Same for the normal and the urgent queue
+#ifndef CAN_TX_PRIO_QUEUE_SIZE
+#define CAN_TX_PRIO_QUEUE_SIZE 4
+#endif
+
+// Raw image of a RX/TX buffer in the order READ RX BUFFER and LOAD TX BUFFER stream it
+typedef struct __attribute__((__packed__))
+{
+  uint8_t sidh;     // SID<10:3>
+  uint8_t sidl;     // SID<2:0>, SRR, IDE, EID<17:16>
+  uint8_t eid8;     // EID<15:8>
+  uint8_t eid0;     // EID<7:0>
+  uint8_t dlc;      // RTR, RB<1:0>, DLC<3:0>
+  uint8_t data[8];
+} MCP2515_Buffer;
+
+// Counters kept by the driver
+typedef struct
+{
+  uint16_t rxOverruns;  // frames dropped because the receive ring was full
+  uint8_t rxHighWater;  // most frames ever waiting in the receive ring
+  uint16_t txDrops;     // frames tryWrite() could neither send nor queue
+  uint16_t hwOverruns;  // RX0OVR/RX1OVR or WAKIF: frames lost inside the MCP2515
+  uint16_t errorInts;   // ERRIF interrupts (EFLG changed)
+  uint16_t msgErrors;   // MERRF interrupts (error frames)
+  uint16_t armLatency;  // us from the event given to fireTx() until TX0IF, last armed frame
+  uint16_t armLatencyMax;
+  uint16_t armHits;     // fireTx() found its frame armed and only sent RTS
+  uint16_t armMisses;   // fireTx() had to load the whole frame
+  uint16_t wakeUps;     // WAKIF: bus activity woke the sleeping MCP2515
+  uint16_t wakeLatency; // us from the last WAKIF until the first frame after it
+  uint8_t tec;          // TEC, REC and EFLG as last sampled
+  uint8_t rec;
+  uint8_t eflg;
+} MCP2515_Stats;
+
+// CNF1<<16 | CNF2<<8 | CNF3 for bitrate at MCP2515_OSC. Uses 16 TQ per bit
+// (PropSeg 1, PS1 8, PS2 6, SJW 1) like the former 250k table entry and
+// falls back to 8 TQ (1, 3, 3) where 16 TQ do not divide the clock.
+// 0 if neither gives the bitrate exactly with a BRP of 1..64, e.g. 800k
+// and 5k at 16 MHz. Folds to a constant when bitrate is one.
+static inline uint32_t mcp2515Cnf(uint32_t bitrate)
+{
+  uint32_t brp = MCP2515_OSC / (32UL * bitrate);
+  if (brp >= 1 && brp <= 64 && brp * 32UL * bitrate == MCP2515_OSC)
+  {
+    return ((brp - 1) << 16) | 0xB805;
+  }
+  brp = MCP2515_OSC / (16UL * bitrate);
+  if (brp >= 1 && brp <= 64 && brp * 16UL * bitrate == MCP2515_OSC)
+  {
+    return ((brp - 1) << 16) | 0x9002;
+  }
+  return 0;
+}
+
 
 // MCP class
 class CAN_MCP2515 : public CANClass
 {
   public:
-    // Check, where we are
-    void TEST(uint8_t c);
-    //
+    // Check, where we are
+    void TEST(uint8_t c);
+    //
     CAN_MCP2515();
     // SPI CS is selectable through sketch. Allows multiple CAN channels.
     CAN_MCP2515(uint8_t CS_Pin);
@@ -440,26 +569,143 @@ class CAN_MCP2515 : public CANClass
     {
       begin(bitrate, MCP2515_MODE_NORMAL);
     };
-    // Initializes CAN communications. Note it also starts SPI communications
-    void begin (uint32_t bitrate, uint8_t mode);
+    // Initializes CAN communications. Note it also starts SPI communications;
+    // false if the bitrate cannot be set, see mcp2515Cnf()
+    inline bool begin (uint32_t bitrate, uint8_t mode)
+    {
+      return begin(bitrate, mode, 0);
+    };
+    // Initializes CAN communications with MCP2515_OPT_* options
+    inline bool begin (uint32_t bitrate, uint8_t mode, uint8_t opts)
+    {
+      return beginCnf(mcp2515Cnf(bitrate), mode, opts);
+    };
+    // Same, with the bit timing given as mcp2515Cnf(); refuses 0 and leaves
+    // the MCP2515 alone then
+    bool beginCnf(uint32_t cnf, uint8_t mode, uint8_t opts);
+    // Listens on each bitrate in turn and starts in mode with the first one
+    // that receives a frame without error, or stays quiet; returns it, or 0
+    // if not even the first one can be set
+    uint32_t beginAuto(const uint32_t *bitrates, uint8_t count, uint8_t mode, uint8_t opts);
+    // Same for MCP2515_AUTOBAUD_RATES
+    uint32_t beginAuto(uint8_t mode, uint8_t opts);
     // Finishes CAN communications
     void end();
     // Check if message has been received on any of the buffers
     uint8_t available();
     // Receive CAN message and allows use of the message structure for easier message handling
     CAN_Frame read();
+    // Receive CAN message into message without copying; false if none is waiting
+    bool tryRead(CAN_Frame &message);
+    // Define CAN_RX_STAMPS in CAN_Defs.h to keep the receive time of each
+    // ring entry (4 bytes per frame in rxStamps)
+#ifdef CAN_RX_STAMPS
+    // stamp handleInterrupt() gives the frames it takes out of the MCP2515;
+    // canISR() latches canTime() of the INT edge here, callers that poll
+    // handleInterrupt() set it themselves
+    volatile uint32_t intStamp;
+    // intStamp of the frame tryRead() returned last (MCP2515_OPT_RXRING only)
+    uint32_t rxStamp;
+#endif
     // Receive any message (J1939, CANopen, CAN)
     void read(uint32_t *ID, uint8_t *length_out, uint8_t *data_out);
 
     void flush();
 
     uint8_t write(const CAN_Frame&);
+    // Send or queue message without blocking; false if it had to be dropped
+    bool tryWrite(const CAN_Frame &message);
+    // Same for a frame already packed into the TX buffer layout
+    bool tryWrite(const MCP2515_Buffer &raw, uint8_t priority);
+    // Number of frames with this priority that can be written right now
+    uint8_t txFree(uint8_t priority);
+    // Pre-loads TXB0 with the frame expected next without sending it
+    // (MCP2515_OPT_TXQUEUE only); false while TXB0 is busy. A bulk frame
+    // written meanwhile takes TXB0 back, so the frame has to be armed again.
+    bool armTx(const MCP2515_Buffer &raw);
+    // Sends raw through TXB0 right away: only RTS if it is the armed frame,
+    // else LOAD and RTS. The last fresh data bytes may differ from the armed
+    // frame; they are written alone before the RTS. since is the low word of
+    // micros() at the event; the time until TX0IF ends up in stats.armLatency.
+    // Call from loop().
+    bool fireTx(const MCP2515_Buffer &raw, uint16_t since, uint8_t fresh = 0);
+    // Lets a falling edge on TX0RTS send the armed frame without any SPI command;
+    // false if the MCP2515 did not enter config mode or return from it.
+    // No firmware calls it: the usual MCP2515 modules do not break TX0RTS out,
+    // and on hall2can the INT1 edge only says that some PCF8574 input changed.
+    // Which contact it was, and so which frame, is known after the I2C read,
+    // and its time in data[6..7] is written after that; fireTx() does both.
+    bool enableRTSPins();
     // Load and send message. No RTS needed.
     uint8_t write(uint32_t ID, uint8_t frameType, uint8_t length, uint8_t *data);
 
-    uint8_t CS; //SPI CS is selectable through sketch
+    // Set mask 0 (RXF0/RXF1) or mask 1 (RXF2..RXF5); the current mode is kept.
+    // false if the MCP2515 did not enter config mode or return from it
+    bool setMask(uint8_t n, const CAN_Filter &mask);
+    // Set receive filter n (0..5); the current mode is kept, false as for setMask()
+    bool setFilter(uint8_t n, const CAN_Filter &filter);
+    // Receive only frames matching the filters; false as for setMask()
+    bool enableFilters();
+    // Turns filters/masks off again, every frame is received
+    void clearFilters();
+
+    // Body of the INT pin interrupt: drains RXB0/RXB1 into the receive ring (MCP2515_OPT_RXRING)
+    // and refills TXB0..TXB2 from the transmit queues (MCP2515_OPT_TXQUEUE)
+    void handleInterrupt();
+    // Reads TEC, REC and EFLG into stats
+    void sampleErrors();
+    // Puts the MCP2515 to sleep until bus activity sets WAKIF (MCP2515_OPT_RXRING only);
+    // false while frames wait to be read or sent. The frame that wakes it is not received.
+    bool sleep();
+    // Ends sleep() from the MCU side, e.g. when another interrupt woke the node first
+    void wake();
+
+    uint8_t CS; //only kept for the constructors; the driver drives MCP2515_CS_PIN
+    MCP2515_Stats stats;
     void _init();
   private:
+    uint8_t options; // MCP2515_OPT_* given to begin()
+    // options & mask; constant 0 for options not in MCP2515_OPTS
+    inline uint8_t opt(uint8_t mask) { return options & (mask & MCP2515_OPTS); }
+    // receive ring; handleInterrupt() is the only producer, read() the only consumer
+    MCP2515_Buffer rxRing[CAN_RX_RING_SIZE];
+#ifdef CAN_RX_STAMPS
+    uint32_t rxStamps[CAN_RX_RING_SIZE]; // intStamp of each rxRing entry
+#endif
+    volatile uint8_t rxHead, rxTail;
+    // transmit queues, bulk first; tryWrite() is the only producer, handleInterrupt() the only consumer
+    MCP2515_Buffer txQueue[CAN_TX_QUEUE_SIZE + 2 * CAN_TX_PRIO_QUEUE_SIZE];
+    volatile uint8_t txHead[MCP2515_TX_CLASSES], txTail[MCP2515_TX_CLASSES];
+    volatile uint8_t txBusy; // bit n: TXBn holds a frame not yet sent
+    volatile uint8_t txArmed; // MCP2515_ARM_* state of TXB0
+    uint16_t txFiredAt; // since given to fireTx()
+    MCP2515_Buffer txArmedBuf; // copy of the armed frame
+    volatile uint8_t asleep; // sleep() was called, not woken yet
+    uint8_t wakeMode; // mode to return to after waking
+    volatile uint8_t waking; // WAKIF seen, no frame since
+    uint16_t wakeAt; // micros() at WAKIF
+    uint8_t rxb1First; // RXB1 holds an older frame than whatever arrives in RXB0 next
+
+    uint8_t txClass(uint8_t priority); // MCP2515_TX_* for a CAN_Frame::priority
+    uint8_t txSize(uint8_t n); // capacity of queue n
+    MCP2515_Buffer *txSlot(uint8_t n, uint8_t index); // entry index of queue n
+
+    void select();   // starts a SPI command: CS low, INT pin masked if registered with SPI.usingInterrupt()
+    void deselect(); // ends a SPI command
+    void readBuffer(uint8_t instruction, MCP2515_Buffer *buf); // READ RX BUFFER into buf, clears RXnIF
+    void readFrame(uint8_t instruction, CAN_Frame &message); // READ RX BUFFER straight into message
+    uint8_t nextRxBuffer(uint8_t full); // READ RX BUFFER instruction for the older frame, 0 if none
+    void decode(const MCP2515_Buffer *buf, CAN_Frame *message); // unpacks ID, DLC and data into message
+    void decodeHeader(const MCP2515_Buffer *buf, CAN_Frame *message); // unpacks ID and DLC only
+    void encode(const CAN_Frame &message, MCP2515_Buffer *buf); // packs message for LOAD TX BUFFER
+    void loadTxBuffer(uint8_t n, const MCP2515_Buffer *buf, bool send); // LOAD TX BUFFER n, RTS if send
+    uint8_t armLoad(const MCP2515_Buffer &raw, uint8_t fresh); // armTx() minus the last fresh data bytes
+    void disarmTx(); // TXB0 back to bulk traffic
+    void handleErrors(uint8_t intf); // counts and clears ERRIF/MERRF
+    void handleWake(); // WAKIF: back from listen-only to wakeMode
+    void leaveSleep(); // wakeMode again, WAKIE off
+    void burstWrite(const uint8_t *buf, uint8_t count); // SPI out, no per byte call
+    void burstRead(uint8_t *buf, uint8_t count); // SPI in, no per byte call
 
     void reset(); //CAN software reset. Also puts MCP2515 into config mode
     uint8_t getMode(); // reads CAN mode
@@ -467,12 +713,12 @@ class CAN_MCP2515 : public CANClass
 
     void clearRxBuffers(); // clears all receive buffers
     void clearTxBuffers(); // clears all receive buffers
-    void clearFilters();   // clears all filters and masks
 
     // Make setting bitrate and mode only part of the constructor
-    void setBitrate(uint32_t bitrate);//sets up CAN bit rate
+    void setBitrate(uint32_t cnf);//sets up CAN bit rate from mcp2515Cnf()
 //    void setBitrate16MHz(uint32_t bitrate);
     void setMode(uint8_t mode);//puts CAN controller in one of five modes
+    bool switchMode(uint8_t mode); // setMode() and wait until CANSTAT shows it; false on timeout
 
     void writeAddress(uint8_t address, uint8_t value);// writes MCP2515 register addresses
     uint8_t readAddress(uint8_t address); //reads MCP2515 registers
@@ -483,11 +729,9 @@ class CAN_MCP2515 : public CANClass
 
     // OTHER USEFUL FUNCTIONS
 
-    void enableRTSPins (); // Enable hardware request to send (RTS) pins if they are available. It allows messages to be send by driving MCP2515 RTS pins low.
     void setInterrupts(uint8_t mask, uint8_t writeVal); //Enable/disable interrupts
     void enableInterrupts(uint8_t writeVal); //Enable interrupts
-    void setMask(uint8_t mask, uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3); // Set Masks for filters
-    void setFilter(uint8_t filter, uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3); //Set Receive filters
+    void writeId(uint8_t address, uint32_t id, uint8_t extended, uint8_t exide); // writes a filter/mask identifier
 
 };
 
@@ -500,23 +744,37 @@ class CAN_MCP2515plus : public CAN_MCP2515
     //
     deviceparams params;
     // Data in and out
-    CAN_Frame outgoingMsg, incomingMsg;
-    // prepares and sends a message
+    CAN_Frame outgoingMsg, incomingMsg;
+    // prepares and sends a message
     void can_answer(uint8_t lng);
     //
     void can_answer2(uint8_t lng, bool resp);
+    // like can_answer(), but only pre-loads the message into TXB0
+    bool arm_answer(uint8_t lng);
+    // like can_answer(), sent through TXB0 at once; since = micros() of the event,
+    // the last fresh data bytes may differ from what arm_answer() loaded
+    bool fire_answer(uint8_t lng, uint16_t since, uint8_t fresh = 0);
     // Use pin 10 for SPI CS. Allows multiple CAN channels.
     //
     void configTerminator(int channel, int framecount);
     //
-    void configDataFrame(uint8_t config_data[8], int framecount);
+    void configDataFrame(uint8_t config_data[8], int framecount);
+    // Receive only these commands with this response bit; cmds must be static
+    void acceptCommands(const uint8_t *cmds, uint8_t count, bool resp_bit);
+    // Software check for acceptCommands() lists the filters cannot hold
+    bool accepts(const CAN_Frame &frame);
     //
     CAN_MCP2515plus();
     // SPI CS is selectable through sketch. Allows multiple CAN channels.
     CAN_MCP2515plus(uint8_t CS_Pin);
+  private:
+    // list given to acceptCommands()
+    const uint8_t *acceptList;
+    uint8_t acceptCount;
+    bool acceptResp;
+    bool acceptSoft; // filters let through more than acceptList
 };
 
-extern CAN_MCP2515 CANBase;
 extern CAN_MCP2515plus CAN;
 
 #endif // _CAN_MCP2515_H_
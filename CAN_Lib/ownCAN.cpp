@@ -8,6 +8,20 @@
 
 #include "ownCAN.h"
 
+#ifndef hex2usb
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#endif
+
+#ifdef CAN_SLEEP
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#endif
+
+#ifdef CAN_STAMP_TIMER1
+#include <avr/interrupt.h>
+#endif
+
 char highbyte2char(int num){
   num /= 10;
   return char ('0' + num);
@@ -32,7 +46,7 @@ uint8_t hex2dec(uint8_t h){
 }
 
 uint32_t generateUID(uint32_t uid, deviceparams *p){
-  uid += (p->HiByteAddress-'0')+3*(p->LoByteAddress-'0');
+  uid = CAN_UID(uid, p->HiByteAddress, p->LoByteAddress);
   p->uid_device[0] = (uint8_t) (uid >> 24);
   p->uid_device[1] = (uint8_t) (uid >> 16);
   p->uid_device[2] = (uint8_t) (uid >> 8);
@@ -40,43 +54,789 @@ uint32_t generateUID(uint32_t uid, deviceparams *p){
   return uid;
 }
 
-uint16_t generateHash(uint32_t uid){
-  uint16_t highbyte = uid >> 16;
-  uint16_t lowbyte = uid;
-  uint16_t hash = highbyte ^ lowbyte;
-  bitWrite(hash, 7, 0);
-  bitWrite(hash, 8, 1);
-  bitWrite(hash, 9, 1);
-  return hash;
+uint8_t canPriority(uint8_t cmd){
+  switch (cmd){
+    case SYS_CMD:
+      return PRIO_STOP_GO;
+    case S88_Polling:
+    case S88_EVENT:
+    case SX1_Event:
+      return PRIO_FEEDBACK;
+    case SWITCH_ACC:
+    case CONFIG_ACC:
+      return PRIO_COMMAND;
+    case CONFIG_Status:
+    case Config_Data_Stream:
+    case FOR_BTLDR:
+    case BTLDR_ANSWER:
+      return PRIO_BULK;
+  }
+  return PRIO_NORMAL;
+}
+
+// SIDH/SIDL of the last headers built, per (cmd, resp_bit)
+struct canHeader {
+  uint16_t key;     // cmd << 1 | resp_bit, 0xFFFF = empty
+  uint8_t sidh;
+  uint8_t sidl;
+  uint8_t prio;
+};
+#define CAN_HEADERS 4
+static canHeader headers[CAN_HEADERS] = {{0xFFFF}, {0xFFFF}, {0xFFFF}, {0xFFFF}};
+
+// packs frame into raw and returns its priority
+static uint8_t packCanFrame(const CAN_Frame &frame, MCP2515_Buffer &raw){
+  uint16_t key = ((uint16_t)frame.cmd << 1) | frame.resp_bit;
+  canHeader *h = &headers[frame.cmd & (CAN_HEADERS - 1)];
+  if (h->key != key){
+    // ID<28:25> Prio, ID<24:17> Kommando, ID<16> Response, packed byte by byte
+    h->key = key;
+    h->prio = canPriority(frame.cmd);
+    h->sidh = (h->prio << 4) | (frame.cmd >> 4);
+    h->sidl = ((frame.cmd << 4) & MCP2515_SIDL_SID) | _BV(MCP2515_EXIDE)
+            | ((frame.cmd & 0x01) << 1) | frame.resp_bit;
+  }
+  raw.sidh = h->sidh;
+  raw.sidl = h->sidl;
+  // ID<15:0> Hash
+  raw.eid8 = frame.hash >> 8;
+  raw.eid0 = frame.hash;
+  raw.dlc = (frame.length > 8) ? 8 : frame.length;
+  memcpy(raw.data, frame.data, raw.dlc);
+  return h->prio;
+}
+
+void sendCanFrame(const CAN_Frame &frame){
+  MCP2515_Buffer raw;
+  uint8_t prio = packCanFrame(frame, raw);
+  CAN.tryWrite(raw, prio);
 }
 
-void sendCanFrame(CAN_Frame frame){
-  frame.extended = 1;
-  frame.id = frame.cmd;
-  frame.id = (frame.id << 17) | frame.hash;
-  bitWrite(frame.id, 16, frame.resp_bit);
-  CANBase.write(frame);
+bool armCanFrame(const CAN_Frame &frame){
+  MCP2515_Buffer raw;
+  packCanFrame(frame, raw);
+  return CAN.armTx(raw);
+}
+
+bool fireCanFrame(const CAN_Frame &frame, uint16_t since, uint8_t fresh){
+  MCP2515_Buffer raw;
+  uint8_t prio = packCanFrame(frame, raw);
+  if (CAN.fireTx(raw, since, fresh))
+    return true;
+  CAN.tryWrite(raw, prio);
+  return false;
+}
+
+// waits until the transmit queue of cmd takes another frame, but at most wait_time ms
+bool waitCanTx(uint8_t cmd){
+  uint8_t prio = canPriority(cmd);
+  for (uint8_t i = 0; i < wait_time; i++){
+    if (CAN.txFree(prio))
+      return true;
+    _delay_ms(1);
+  }
+  return false;
 }
 
 CAN_Frame getCanFrame(){
-  CAN_Frame frame = CANBase.read();
-  frame.cmd = frame.id >> 17;
-  frame.resp_bit = bitRead(frame.id, 16);
+  CAN_Frame frame;
+  if (!getCanFrame(frame))
+    frame.valid = false;
   return frame;
 }
 
-void goIntoBootloader() {
-  CAN.outgoingMsg.data[0] = GO_BTLDR;
+uint8_t hashCollisions = 0;
+
+// Den eigenen Hash sendet nur, wer ihn ebenfalls benutzt: wie bei der CS2
+// waehlt das Board einen neuen. Die Zeit seit dem Start geht mit ein, damit
+// auch Boards mit gleicher UID auseinanderkommen.
+static void newHash(){
+  uint32_t uid = ((uint32_t) CAN.params.uid_device[0] << 24) | ((uint32_t) CAN.params.uid_device[1] << 16) |
+                 ((uint16_t) CAN.params.uid_device[2] << 8) | CAN.params.uid_device[3];
+  uint16_t hash = generateHash(uid ^ micros());
+  if (hash == CAN.hash)
+    hash ^= 0x8000;
+  CAN.hash = hash;
+  if (hashCollisions < 0xFF)
+    hashCollisions++;
+}
+
+bool getCanFrame(CAN_Frame &frame){
+  // frames the acceptance filters could not sort out are skipped here
+  do {
+    if (!CAN.tryRead(frame))
+      return false;
+    frame.priority = frame.id >> 25;
+    frame.cmd = frame.id >> 17;
+    frame.resp_bit = bitRead(frame.id, 16);
+    if ((uint16_t) frame.id == CAN.hash)
+      newHash();
+  } while (!CAN.accepts(frame));
+  return true;
+}
+
+#ifdef CAN_STAMP_TIMER1
+/*
+ Zeitbasis fuer die Stempel: Timer1 zaehlt frei mit F_CPU/8, also in
+ 0,5-us-Schritten, und laeuft alle 32,8 ms ueber; die Ueberlaeufe zaehlt
+ TIMER1_OVF_vect in stampHigh. Die INT-Leitung des MCP2515 liegt an INT0,
+ nicht an ICP1, deshalb liest canISR() TCNT1 als Erstes: der Stempel liegt
+ um die feste Eintrittszeit des Interrupts hinter der Flanke.
+*/
+static volatile uint32_t stampHigh;
+
+ISR(TIMER1_OVF_vect){
+  stampHigh++;
+}
+
+uint32_t canTime(){
+  uint8_t sreg = SREG;
+  noInterrupts();
+  uint16_t low = TCNT1;
+  uint32_t high = stampHigh;
+  // Ueberlauf, dessen Interrupt noch aussteht
+  if ((TIFR1 & _BV(TOV1)) && (low < 0x8000))
+    high++;
+  SREG = sreg;
+  return (high << 15) | (low >> 1);
+}
+
+static void beginCanTime(){
+  TCCR1A = 0;
+  TCNT1 = 0;
+  TCCR1B = _BV(CS11);
+  TIMSK1 = _BV(TOIE1);
+}
+#elif defined(CAN_SLEEP_CLOCK)
+/*
+ Im Power-down steht Timer0 und mit ihm micros(). Der Watchdog laeuft darum
+ ab dem ersten Power-down frei durch und zaehlt 16-ms-Abschnitte. Jeder
+ Abschnitt, in dem geschlafen wurde, traegt in sleptMicros nach, was von
+ seinen 16 ms nicht wach in micros() verging; ein frueheres Wecken durch
+ INT0 oder INT1 verliert so nichts. Bis zum Ende des angebrochenen
+ Abschnitts geht canTime() um die darin verschlafene Zeit nach, also
+ hoechstens 16 ms und ohne sich aufzusummieren; dazu kommt die Abweichung
+ des 128-kHz-Oszillators des Watchdogs auf die verschlafene Zeit. Der
+ Knoten wacht dafuer 62-mal je Sekunde kurz auf.
+*/
+static uint32_t sleptMicros;
+// micros() beim letzten Watchdog-Interrupt
+static uint32_t wdtMicros;
+// im laufenden Abschnitt war der Knoten im Power-down
+static volatile bool wdtSlept;
+
+uint32_t canTime(){
+  uint8_t sreg = SREG;
+  noInterrupts();
+  uint32_t t = micros() + sleptMicros;
+  SREG = sreg;
+  return t;
+}
+
+// aus dem Watchdog-Interrupt, period us seit dem letzten
+static void countSleep(uint32_t period){
+  uint32_t now = micros();
+  uint32_t awake = now - wdtMicros;
+  if (wdtSlept && (awake < period))
+    sleptMicros += period - awake;
+  wdtSlept = false;
+  wdtMicros = now;
+}
+#else
+uint32_t canTime(){
+  return micros();
+}
+#endif
+
+// INT0 only drains the MCP2515 into the receive ring of CAN
+void canISR(){
+#ifdef CAN_RX_STAMPS
+  // zuerst, so haengt der Stempel nicht an der SPI-Arbeit
+  CAN.intStamp = canTime();
+#endif
+  uint16_t start = micros();
+  CAN.handleInterrupt();
+  uint16_t took = (uint16_t) micros() - start;
+  if (took > workStats.isrMax)
+    workStats.isrMax = took;
+}
+
+void attachCanInterrupt(){
+#ifdef CAN_STAMP_TIMER1
+  beginCanTime();
+#endif
+  pinMode(PIN_INT0, INPUT_PULLUP);
+  // SPI commands from loop() mask INT0, so canISR cannot cut into them
+  SPI.usingInterrupt(digitalPinToInterrupt(PIN_INT0));
+  attachInterrupt(digitalPinToInterrupt(PIN_INT0), canISR, LOW);
+}
+
+/*
+ FOR_DIAG     DLC 1: alle Knoten antworten, DLC 3: nur die Boardnummer
+              data[1], data[2]; data[0] = Seite DIAG_*
+ DIAG_ANSWER  data[0] Seite, data[1..2] Boardnummer, ab data[3] die
+              Zaehler der Seite, 16-Bit-Werte high byte zuerst
+*/
+void diagAnswer(){
+  uint8_t page = CAN.incomingMsg.data[0];
+  if ((CAN.incomingMsg.length >= 3) &&
+      ((CAN.incomingMsg.data[1] != CAN.params.HiByteAddress) ||
+       (CAN.incomingMsg.data[2] != CAN.params.LoByteAddress)))
+    return;
+  CAN.sampleErrors();
+  CAN.outgoingMsg.cmd = DIAG_ANSWER;
+  CAN.outgoingMsg.data[0] = page;
   CAN.outgoingMsg.data[1] = CAN.params.HiByteAddress;
   CAN.outgoingMsg.data[2] = CAN.params.LoByteAddress;
-  CAN.can_answer(3);
-  _delay_ms(2*wait_time);  // Delay added just so we can have time to open up
-  detachInterrupt(digitalPinToInterrupt(PIN_INT0));
-  _delay_ms(3*wait_time);  // Delay added just so we can have time to open up
-  // jumping into the Bootloader
+  switch (page){
+    case DIAG_BUS:
+      CAN.outgoingMsg.data[3] = CAN.stats.tec;
+      CAN.outgoingMsg.data[4] = CAN.stats.rec;
+      CAN.outgoingMsg.data[5] = CAN.stats.eflg;
+      CAN.outgoingMsg.data[6] = CAN.stats.errorInts >> 8;
+      CAN.outgoingMsg.data[7] = CAN.stats.errorInts;
+      CAN.can_answer(8);
+      break;
+    case DIAG_RX:
+      CAN.outgoingMsg.data[3] = CAN.stats.rxOverruns >> 8;
+      CAN.outgoingMsg.data[4] = CAN.stats.rxOverruns;
+      CAN.outgoingMsg.data[5] = CAN.stats.hwOverruns >> 8;
+      CAN.outgoingMsg.data[6] = CAN.stats.hwOverruns;
+      CAN.outgoingMsg.data[7] = CAN.stats.rxHighWater;
+      CAN.can_answer(8);
+      break;
+    case DIAG_TX:
+      CAN.outgoingMsg.data[3] = CAN.stats.txDrops >> 8;
+      CAN.outgoingMsg.data[4] = CAN.stats.txDrops;
+      CAN.outgoingMsg.data[5] = CAN.stats.msgErrors >> 8;
+      CAN.outgoingMsg.data[6] = CAN.stats.msgErrors;
+      CAN.can_answer(7);
+      break;
+    case DIAG_ARM:
+      CAN.outgoingMsg.data[3] = CAN.stats.armLatency >> 8;
+      CAN.outgoingMsg.data[4] = CAN.stats.armLatency;
+      CAN.outgoingMsg.data[5] = CAN.stats.armLatencyMax >> 8;
+      CAN.outgoingMsg.data[6] = CAN.stats.armLatencyMax;
+      CAN.can_answer(7);
+      break;
+    case DIAG_SLEEP:
+      CAN.outgoingMsg.data[3] = CAN.stats.wakeUps >> 8;
+      CAN.outgoingMsg.data[4] = CAN.stats.wakeUps;
+      CAN.outgoingMsg.data[5] = CAN.stats.wakeLatency >> 8;
+      CAN.outgoingMsg.data[6] = CAN.stats.wakeLatency;
+      CAN.can_answer(7);
+      break;
+    case DIAG_WORK:
+      CAN.outgoingMsg.data[3] = workStats.isrMax >> 8;
+      CAN.outgoingMsg.data[4] = workStats.isrMax;
+      CAN.outgoingMsg.data[5] = workStats.taskMax >> 8;
+      CAN.outgoingMsg.data[6] = workStats.taskMax;
+      CAN.outgoingMsg.data[7] = workStats.stalls;
+      CAN.can_answer(8);
+      break;
+    case DIAG_HASH:
+      CAN.outgoingMsg.data[3] = CAN.hash >> 8;
+      CAN.outgoingMsg.data[4] = CAN.hash;
+      CAN.outgoingMsg.data[5] = hashCollisions;
+      CAN.can_answer(6);
+      break;
+  }
+}
+
+/*
+ Befehlstabellen: jede Firmware beschreibt sich mit einem canNode im Flash,
+ darin die Tabelle ihrer Befehle (cmd, resp_bit, Handler). PING, CONFIG_Status,
+ SYS_CMD und FOR_APP laufen fuer alle Boards ueber die Handler hier, die
+ Boardeigenheiten (Version, Geraetetyp, Kanaele) stehen im canNode.
+*/
+// canNode des Frames, der gerade abgearbeitet wird
+static const canNode *currentNode;
+
+static void taskTook(uint16_t start, uint8_t cmd){
+  uint16_t took = (uint16_t) micros() - start;
+  if (took > workStats.taskMax) {
+    workStats.taskMax = took;
+    workStats.taskMaxCmd = cmd;
+  }
+}
+
+bool dispatchCanFrame(const canNode *node){
+  const canCommand *cmds = (const canCommand *) pgm_read_ptr(&node->commands);
+  uint8_t count = pgm_read_byte(&node->commandCount);
+  for (uint8_t i = 0; i < count; i++){
+    if ((pgm_read_byte(&cmds[i].cmd) == CAN.incomingMsg.cmd) &&
+        ((bool) pgm_read_byte(&cmds[i].resp) == CAN.incomingMsg.resp_bit)){
+      uint16_t start = micros();
+      currentNode = node;
+      ((canHandler) pgm_read_ptr(&cmds[i].handler))();
+      taskTook(start, CAN.incomingMsg.cmd);
+      return true;
+    }
+  }
+  return false;
+}
+
+// uid_device und data[0..3] stehen beide high byte zuerst
+bool uidMatches(){
+  uint32_t uid, own;
+  memcpy(&uid, CAN.incomingMsg.data, sizeof(uid));
+  memcpy(&own, CAN.params.uid_device, sizeof(own));
+  return uid == own;
+}
+
+bool boardMatches(){
+  return (CAN.incomingMsg.data[1] == CAN.params.HiByteAddress) &&
+         (CAN.incomingMsg.data[2] == CAN.params.LoByteAddress);
+}
+
+void pingAnswer(){
+  CAN.outgoingMsg.cmd = PING;
+  memcpy(CAN.outgoingMsg.data, CAN.params.uid_device, uid_num);
+  CAN.outgoingMsg.data[4] = pgm_read_byte(&currentNode->versHigh);
+  CAN.outgoingMsg.data[5] = pgm_read_byte(&currentNode->versLow);
+  uint16_t devType = pgm_read_word(&currentNode->devType);
+  CAN.outgoingMsg.data[6] = devType >> 8;
+  CAN.outgoingMsg.data[7] = devType;
+  CAN.can_answer(8);
+}
+
+/*
+ CONFIG_Status: ein Kanal geht als Kopf-Frame, Text-Frames und Abschluss
+ hinaus. Der Text (Kanal 0: Artikelnummer aus der UID, "CANguru " und der
+ Geraetename; sonst Name, min, max und Einheit bzw. Name und Auswahltexte)
+ steht nirgends am Stueck: fuer jeden Frame laeuft configText() von vorn
+ und nur die 8 Bytes des Frames werden behalten. runCanWork() schickt so
+ viele Frames, wie die Sendeschlange aufnimmt, und kehrt dann zurueck.
+*/
+const char configAddressText[] PROGMEM = "Moduladresse";
+const char configAddressUnit[] PROGMEM = "Adr";
+const char configRestartText[] PROGMEM = "Neustart\0Nein\0Warm\0Kalt";
+
+static const canNode *configNode;
+static uint8_t configChannel;
+static uint8_t configFrame;     // naechster Frame, 0 = Kopf
+static uint8_t configFrames;    // Kopf und Text, 0 = nichts zu senden
+static uint8_t configLength;    // Bytes, die configText() erzeugt hat
+static int16_t configPos;       // Stelle im Frame, negativ vor dessen Anfang
+static uint8_t *configData;     // 0: nur zaehlen
+
+static void configEmit(uint8_t b){
+  if (configData && (configPos >= 0) && (configPos < 8))
+    configData[configPos] = b;
+  configPos++;
+  configLength++;
+}
+
+// count strings from flash, each with its \0
+static void configStrings(const char *p, uint8_t count){
+  while (count--) {
+    uint8_t c;
+    do {
+      c = pgm_read_byte(p++);
+      configEmit(c);
+    } while (c);
+  }
+}
+
+static void configNumber(uint8_t n){
+  if (n >= 100)
+    configEmit('0' + n / 100);
+  if (n >= 10)
+    configEmit('0' + n / 10 % 10);
+  configEmit('0' + n % 10);
+  configEmit(0);
+}
+
+static void configChannelOf(canConfigChannel *ch){
+  memcpy_P(ch, &((const canConfigChannel *) pgm_read_ptr(&configNode->config))[configChannel - 1],
+           sizeof(*ch));
+}
+
+static void configText(){
+  canConfigChannel ch;
+  configLength = 0;
+  if (configChannel == 0) {
+    for (uint8_t i = 0; i < uid_num; i++) {
+      configEmit(highbyte2char(hex2dec(CAN.params.uid_device[i])));
+      configEmit(lowbyte2char(hex2dec(CAN.params.uid_device[i])));
+    }
+    const char *p = PSTR("CANguru ");
+    while (pgm_read_byte(p))
+      configEmit(pgm_read_byte(p++));
+    configStrings((const char *) pgm_read_ptr(&configNode->deviceName), 1);
+    return;
+  }
+  configChannelOf(&ch);
+  if (ch.type == CONFIG_LIST)
+    configStrings(ch.text, ch.min + 1);
+  else {
+    configStrings(ch.text, 1);
+    configNumber(ch.min);
+    configNumber(ch.max);
+    configStrings(ch.unit, 1);
+  }
+}
+
+static void configHeader(uint8_t *data){
+  canConfigChannel ch;
+  memset(data, 0, 8);
+  if (configChannel == 0) {
+    data[1] = pgm_read_byte(&configNode->configCount);
+    data[7] = CAN.params.moduladr;
+    return;
+  }
+  configChannelOf(&ch);
+  data[0] = configChannel;
+  data[1] = ch.type;
+  if (ch.type == CONFIG_LIST) {
+    data[2] = ch.min;
+    data[3] = ch.value ? *ch.value : 0;
+  }
+  else {
+    data[3] = ch.min;
+    data[5] = ch.max;
+    data[7] = ch.value ? *ch.value : 0;
+  }
+}
+
+void configRequest(){
+  if (!uidMatches() ||
+      (CAN.incomingMsg.data[4] > pgm_read_byte(&currentNode->configCount)))
+    return;
+  configNode = currentNode;
+  configChannel = CAN.incomingMsg.data[4];
+  configFrame = 0;
+  configData = 0;
+  configText();
+  configFrames = 1 + (configLength + 7) / 8;
+}
+
+static void sendConfigFrames(){
+  uint8_t data[8];
+  while (configFrames && CAN.txFree(canPriority(CONFIG_Status))) {
+    if (configFrame == configFrames) {
+      CAN.configTerminator(configChannel, configFrames);
+      configFrames = 0;
+      return;
+    }
+    if (configFrame == 0)
+      configHeader(data);
+    else {
+      memset(data, 0, sizeof(data));
+      configData = data;
+      configPos = -8 * (configFrame - 1);
+      configText();
+    }
+    CAN.configDataFrame(data, configFrame);
+    configFrame++;
+  }
+}
+
+static void restartNode(){
+  flushEeprom();
+  // jumping to restart
+  goto*0x0000;
+}
+
+static void sysAnswer(){
+  CAN.outgoingMsg = CAN.incomingMsg;
+  CAN.outgoingMsg.data[6] = 0x01;
+  CAN.can_answer(7);
+}
+
+void sysCommand(){
+  canNode node;
+  if (!uidMatches() || (CAN.incomingMsg.data[4] != SYS_STAT))
+    return;
+  memcpy_P(&node, currentNode, sizeof(node));
+  uint8_t channel = CAN.incomingMsg.data[5];
+  if (node.addressChannel && (channel == node.addressChannel)) {
+    CAN.params.moduladr = CAN.incomingMsg.data[6]*16+CAN.incomingMsg.data[7];
+    // speichert die neue Adresse
+    CAN.params.LoByteAddress = (uint8_t)CAN.incomingMsg.data[7]+'0';
+    CAN.params.HiByteAddress = (uint8_t)CAN.incomingMsg.data[6]+'0';
+    deferEepromByte(adr_HiByte, CAN.params.HiByteAddress);
+    deferEepromByte(adr_LoByte, CAN.params.LoByteAddress);
+  }
+  else if (node.restartChannel && (channel == node.restartChannel)) {
+    // 1: Restart, Werte bleiben erhalten; 2: Werte werden zurueckgesetzt
+    if ((CAN.incomingMsg.data[7] == 1) || (CAN.incomingMsg.data[7] == 2)) {
+      sysAnswer();
+      if (CAN.incomingMsg.data[7] == 2)
+        // setup_done auf "FALSE" setzen
+        deferEepromByte(adr_setup_done, 0xFF);
+      // Zeit fuer die Antwort, dann Neustart
+      deferCanWork(restartNode, 3*wait_time);
+      return;
+    }
+  }
+  else if (node.setChannel)
+    node.setChannel(channel, CAN.incomingMsg.data[6]*16+CAN.incomingMsg.data[7]);
+  sysAnswer();
+}
+
+static void boardnumAnswer(const uint8_t *name){
+  CAN.outgoingMsg.cmd = APP_ANSWER;
+  CAN.outgoingMsg.data[0] = BOARDNUM_ANSWER;
+  CAN.outgoingMsg.data[1] = CAN.params.HiByteAddress;
+  CAN.outgoingMsg.data[2] = CAN.params.LoByteAddress;
+  what_is_your_name(name, 3, &CAN.outgoingMsg);
+  CAN.can_answer(6);
+}
+
+uint8_t runAppCommand(){
+  canNode node;
+  if (!boardMatches())
+    return APP_NONE;
+  memcpy_P(&node, currentNode, sizeof(node));
+  switch (CAN.incomingMsg.data[0])
+  {
+    case GO_BTLDR:
+      // setup_done auf "FALSE" setzen
+      deferEepromByte(adr_setup_done, 0xFF);
+      CAN.outgoingMsg.cmd = APP_ANSWER;
+      goIntoBootloader();
+      break;
+    case BOARDNUM_REQUEST:
+      boardnumAnswer(node.name);
+      break;
+    case BOARDNUM_CHANGE:
+      // Reihenfolge wichtig, damit mit der alten Boardnum geantwortet wird
+      boardnumAnswer(node.name);
+      CAN.params.HiByteAddress = CAN.incomingMsg.data[3];
+      CAN.params.LoByteAddress = CAN.incomingMsg.data[4];
+      deferEepromByte(adr_HiByte, CAN.params.HiByteAddress);
+      deferEepromByte(adr_LoByte, CAN.params.LoByteAddress);
+      CAN.hash = generateHash(generateUID(node.uidBase, &CAN.params) + node.hashOffset);
+      CAN.params.moduladr = ( uint8_t ) ((CAN.params.HiByteAddress - '0')*10 + CAN.params.LoByteAddress - '0');
+      break;
+    default:
+      return APP_NONE;
+  }
+  return CAN.incomingMsg.data[0];
+}
+
+void appCommand(){
+  runAppCommand();
+}
+
+/*
+ Aufgeschobene Arbeit: Handler kehren sofort zurueck, statt mit _delay_ms()
+ oder eeprom_update_byte() zu warten. Was spaeter geschehen soll, steht in
+ einem von CAN_WORK_SLOTS Plaetzen mit seiner Faelligkeit in ms; EEPROM-Bytes
+ warten in einer Schlange und gehen einzeln hinaus, sobald das EEPROM den
+ letzten Schreibvorgang (3,3 ms) beendet hat. runCanWork() aus loop() erledigt
+ beides, INT0 fuellt weiterhin nur den Empfangsring.
+*/
+canWorkStats workStats;
+
+typedef struct
+{
+  canHandler fn;
+  uint16_t due;               // millis(), low 16 bits
+} canWork;
+
+typedef struct
+{
+  uint16_t adr;
+  uint8_t value;
+} eepromByte;
+
+static canWork work[CAN_WORK_SLOTS];
+static eepromByte eepromQueue[CAN_EEPROM_QUEUE_SIZE];
+static uint8_t eepromCount;
+
+static void stalled(){
+  if (workStats.stalls < 0xFF)
+    workStats.stalls++;
+}
+
+void deferCanWork(canHandler fn, uint16_t ms){
+  for (uint8_t i = 0; i < CAN_WORK_SLOTS; i++){
+    if (!work[i].fn) {
+      work[i].due = (uint16_t) millis() + ms;
+      work[i].fn = fn;
+      return;
+    }
+  }
+  stalled();
+  delay(ms);
+  fn();
+}
+
+void deferEepromByte(uint16_t adr, uint8_t value){
+  for (uint8_t i = 0; i < eepromCount; i++){
+    if (eepromQueue[i].adr == adr) {
+      eepromQueue[i].value = value;
+      return;
+    }
+  }
+  if (eepromCount == CAN_EEPROM_QUEUE_SIZE) {
+    stalled();
+    eeprom_update_byte(( uint8_t *) (uintptr_t) adr, value);
+    return;
+  }
+  eepromQueue[eepromCount].adr = adr;
+  eepromQueue[eepromCount].value = value;
+  eepromCount++;
+  if (eepromCount > workStats.eepromHighWater)
+    workStats.eepromHighWater = eepromCount;
+}
+
+// writes the oldest waiting byte; the EEPROM must be ready
+static void writeEepromByte(){
+  eeprom_update_byte(( uint8_t *) (uintptr_t) eepromQueue[0].adr, eepromQueue[0].value);
+  eepromCount--;
+  memmove(eepromQueue, eepromQueue + 1, eepromCount * sizeof(eepromByte));
+}
+
+void flushEeprom(){
+  while (eepromCount) {
+    eeprom_busy_wait();
+    writeEepromByte();
+  }
+}
+
+void runCanWork(){
+  uint16_t now = millis();
+  for (uint8_t i = 0; i < CAN_WORK_SLOTS; i++){
+    canHandler fn = work[i].fn;
+    if (fn && ((int16_t) (now - work[i].due) >= 0)) {
+      // der Platz ist frei, bevor fn laeuft: fn darf neue Arbeit aufschieben
+      work[i].fn = 0;
+      uint16_t start = micros();
+      fn();
+      taskTook(start, 0xFF);
+    }
+  }
+  if (eepromCount && eeprom_is_ready())
+    writeEepromByte();
+  sendConfigFrames();
+}
+
+bool canWorkPending(){
+  if (eepromCount || configFrames)
+    return true;
+  for (uint8_t i = 0; i < CAN_WORK_SLOTS; i++){
+    if (work[i].fn)
+      return true;
+  }
+  return false;
+}
+
+#ifdef CAN_SLEEP
+/*
+ Der ATmega328 schlaeft, bis ein Interrupt kommt: INT0 bei jedem Frame,
+ der die Filter passiert, oder z.B. INT1. Der MCP2515 bleibt wach, so geht
+ kein Frame verloren.
+ Mit CAN_SLEEP_MCP zaehlt der Watchdog im Power-down die Ruhe auf dem Bus
+ in 8-s-Schritten; nach CAN_QUIET_PERIODS davon schlaeft auch der MCP2515
+ und wacht erst durch Busaktivitaet (WAKIF) wieder auf. Der Frame, der ihn
+ weckt, geht dabei verloren, alle folgenden nicht.
+ Mit CAN_SLEEP_CLOCK weckt der frei laufende Watchdog alle 16 ms, damit
+ canTime() weiterlaeuft (siehe dort); der MCP2515 bleibt dann auch mit
+ CAN_SLEEP_MCP wach.
+*/
+#ifdef CAN_SLEEP_CLOCK
+#define CAN_WDT_PERIOD    0 // 2K Takte des 128-kHz-Oszillators
+#define CAN_WDT_PERIOD_US 16000UL
+#elif defined(CAN_SLEEP_MCP)
+#define CAN_WDT_PERIOD    (_BV(WDP3) | _BV(WDP0)) // 1024K Takte, 8 s
+#define CAN_QUIET_PERIODS 8
+static uint8_t quietPeriods = 0;
+#endif
+#ifdef CAN_WDT_PERIOD
+static volatile bool wdtWoke;
+
+ISR(WDT_vect){
+  wdtWoke = true;
+#if defined(CAN_SLEEP_CLOCK) && !defined(CAN_STAMP_TIMER1)
+  countSleep(CAN_WDT_PERIOD_US);
+#endif
+}
+#endif
+
+void sleepCanNode(uint8_t mode){
+  // aufgeschobene Arbeit braucht millis(), also Timer0
+  if (canWorkPending())
+    mode = SLEEP_MODE_IDLE;
+#ifdef CAN_STAMP_TIMER1
+  // im Power-down stuende Timer1 und mit ihm canTime()
+  mode = SLEEP_MODE_IDLE;
+#endif
+#ifdef CAN_QUIET_PERIODS
+  bool deep = (mode == SLEEP_MODE_PWR_DOWN) && (quietPeriods >= CAN_QUIET_PERIODS);
+#else
+  const bool deep = false;
+#endif
+  if (CAN.available() || (deep && !CAN.sleep())){
+    interrupts();
+    return;
+  }
+#if defined(CAN_SLEEP_CLOCK) && !defined(CAN_STAMP_TIMER1)
+  if (mode == SLEEP_MODE_PWR_DOWN){
+    wdtSlept = true;
+    // laeuft er schon, nicht neu starten: der angebrochene Abschnitt zaehlt
+    if (!(WDTCSR & _BV(WDIE))){
+      wdtMicros = micros();
+      wdt_reset();
+      WDTCSR = _BV(WDCE) | _BV(WDE);
+      WDTCSR = _BV(WDIE) | CAN_WDT_PERIOD;
+    }
+  }
+#elif defined(CAN_WDT_PERIOD)
+  if ((mode == SLEEP_MODE_PWR_DOWN) && !deep){
+    // Watchdog nur als Interrupt, kein Reset
+    wdtWoke = false;
+    wdt_reset();
+    WDTCSR = _BV(WDCE) | _BV(WDE);
+    WDTCSR = _BV(WDIE) | CAN_WDT_PERIOD;
+  }
+#endif
+  set_sleep_mode(mode);
+  sleep_enable();
+  interrupts();
+  sleep_cpu();
+  sleep_disable();
+#ifdef CAN_QUIET_PERIODS
+  if (deep){
+    CAN.wake();
+    quietPeriods = 0;
+    return;
+  }
+#endif
+#ifdef CAN_QUIET_PERIODS
+  if (mode == SLEEP_MODE_PWR_DOWN){
+    wdt_disable();
+    if (CAN.available())
+      quietPeriods = 0;
+    else if (wdtWoke && (quietPeriods < CAN_QUIET_PERIODS))
+      quietPeriods++;
+  }
+#endif
+}
+#endif // CAN_SLEEP
+
+static void jumpToBootloader() {
+  flushEeprom();
+  // jumping into the Bootloader
   //need word address
   //so, byte address/2
   goto*0x7000/2;
+}
+
+static void leaveForBootloader() {
+  detachInterrupt(digitalPinToInterrupt(PIN_INT0));
+  deferCanWork(jumpToBootloader, 3*wait_time);
+}
+
+void goIntoBootloader() {
+  CAN.outgoingMsg.data[0] = GO_BTLDR;
+  CAN.outgoingMsg.data[1] = CAN.params.HiByteAddress;
+  CAN.outgoingMsg.data[2] = CAN.params.LoByteAddress;
+  CAN.can_answer(3);
+  // Zeit fuer die Antwort, dann ohne INT0 noch Zeit zum Umschalten
+  deferCanWork(leaveForBootloader, 2*wait_time);
 }
 
 #endif
@@ -7,6 +7,7 @@
 
 #ifndef hex2usb
 #include "CAN.h"
+#include <avr/pgmspace.h>
 #endif // !hex2usb
 
 // allgemein
@@ -89,6 +90,8 @@
 #define BTLDR_ANSWER    0x51	//Bootloader antwortet
 #define FOR_APP         0x52	//Dekoderapp abfragen
 #define APP_ANSWER      0x53	//Dekoderapp antwortet
+#define FOR_DIAG        0x54	//Busdiagnose abfragen
+#define DIAG_ANSWER     0x55	//Busdiagnose antwortet
 
 #define BOARDNUM_REQUEST  0
 #define BOARDNUM_ANSWER   1
@@ -99,6 +102,25 @@
 #define END_DATA          6
 #define TEST_DATA         0x99
 
+// Seiten fuer FOR_DIAG (data[0])
+#define DIAG_BUS          0   //TEC, REC, EFLG, Fehlerinterrupts
+#define DIAG_RX           1   //Ring-Ueberlauf, MCP2515-Ueberlauf (mit Weckframes), Ringfuellstand
+#define DIAG_TX           2   //verworfene Sendeframes, Fehlerframes
+#define DIAG_ARM          3   //Ereignis bis Bus vorgeladener Frames in us, letzte und maximale
+#define DIAG_SLEEP        4   //Aufwachen durch den Bus, Aufwachen bis erster Frame in us
+#define DIAG_WORK         5   //laengstes INT0, laengster Handler in loop() in us, Staus
+#define DIAG_HASH         6   //aktueller Hash, Hash-Kollisionen
+
+/*
+ * Prioritaet (ID-Bits 28..25), kleinere Werte gewinnen die Arbitrierung
+*/
+#define PRIO_STOP_GO      1   //Stopp / Go / Kurzschluss-Meldung
+#define PRIO_FEEDBACK     2   //Rueckmeldungen
+#define PRIO_LOCO_STOP    3   //Lok anhalten
+#define PRIO_COMMAND      4   //Lok / Zubehoerbefehle
+#define PRIO_NORMAL       6   //alles andere
+#define PRIO_BULK         8   //Konfigurations- und Bootloaderdaten
+
 //CBR_19200
 #define limiter			'#'
 #define findPort		'!'
@@ -107,11 +129,38 @@
 #define transferbtldr	"%"
 #define newbrdnr		"="
 
+// usb2can <-> PC in Binaerframes: Befehl, Daten, CRC-16 (CCITT, Start 0xFFFF,
+// high byte zuerst), COBS-codiert, jeder Frame mit LINK_END abgeschlossen
+#define linkbaudrate	500000
+#define LINK_END          0x00
+#define LINK_MAX_DATA     8     //Daten nach dem Befehl
+#define LINK_HELLO        '!'   //Verbindung pruefen, Antwort LINK_READY
+#define LINK_ASK          '?'   //XY: gibt es Board XY? Antwort LINK_YES/LINK_NO
+#define LINK_CHANGE       '='   //XYAB: Board XY bekommt die Nummer AB; LINK_YES/LINK_NO
+#define LINK_BOOT         '%'   //XY: Board XY geht in den Bootloader
+#define LINK_DATA         'd'   //bis 7 Bytes fuer den Bootloader, keine = Ende
+#define LINK_READY        '$'   //usb2can bzw. Bootloader bereit
+#define LINK_MORE         '/'   //Bootloader will die naechsten Daten
+#define LINK_YES          '1'
+#define LINK_NO           '0'
+#define LINK_NAK          'x'   //Frame verworfen (CRC, Laenge), bitte wiederholen
+// can2usb mit "#define capture": jeder Frame vom Bus als Binaerframe, little endian
+#define capturebaudrate	2000000   //hoechster Takt von CH340 und AVR (U2X, UBRR0 0)
+#define LINK_MAX_SEND     17    //Daten nach dem Befehl zum PC, LINK_CAPTURE
+#define LINK_CAPTURE      'c'   //us (4), ID (4, Bit 31 extended, Bit 30 RTR), DLC, Daten
+#define LINK_LOST         'l'   //us (4), Frames verloren im Ring (2) und im MCP2515 (2)
+
 #define TRM_BOARD_NUM     99
 
 #define UID_BASE  0x50091900ULL    //CAN-UID
 #define UID_RM    0x80220B01ULL    //CAN-UID für Rückmelder
 
+// UID of board number hi, lo (ASCII digits) and its Märklin hash: the UID
+// halves XORed, bit 7 cleared, bits 8 and 9 set; constant arguments fold
+// at compile time
+#define CAN_UID(base, hi, lo)  ((uint32_t)(base) + ((hi) - '0') + 3 * ((lo) - '0'))
+#define CAN_HASH(uid)  ((uint16_t)(((((uint32_t)(uid) >> 16) ^ (uint32_t)(uid)) & 0xFF7F) | 0x0300))
+
 // converts highbyte of integer to char
 char highbyte2char(int num);
 // converts lowbyte of integer to char
@@ -123,6 +172,11 @@ char lowbyte2char(int num);
 const uint8_t PIN_INT0 = 2;
 const uint8_t PIN_INT1 = 3;
 
+// EEPROM-Adressen, die alle Boards gleich belegen
+const uint8_t adr_setup_done = 0x00;
+const uint8_t adr_HiByte = 0x01;
+const uint8_t adr_LoByte = 0x02;
+
 #define name_count  3
 const uint8_t I_am_a_usb2can [name_count] = {'u', '2', 'c'}; 
 const uint8_t I_am_a_can2usb [name_count] = {'c', '2', 'u'}; 
@@ -137,12 +191,148 @@ const uint8_t maxadr = 20;
 // generates the specific UID
 uint32_t generateUID(uint32_t uid, deviceparams *p);
 // generates the hashcode
-uint16_t generateHash(uint32_t uid);
+inline uint16_t generateHash(uint32_t uid){ return CAN_HASH(uid); }
 // sends a canframe
-void sendCanFrame(CAN_Frame frame);
+void sendCanFrame(const CAN_Frame &frame);
+// pre-loads frame into TXB0 for the next fireCanFrame(); false while TXB0 is busy
+bool armCanFrame(const CAN_Frame &frame);
+// sends frame at once through TXB0, since = micros() of the event; only the
+// last fresh data bytes are written if the rest matches the armed frame.
+// Queues it like sendCanFrame() if TXB0 is busy and returns false then
+bool fireCanFrame(const CAN_Frame &frame, uint16_t since, uint8_t fresh = 0);
+// priority (PRIO_*) for a command
+uint8_t canPriority(uint8_t cmd);
+// waits (at most wait_time ms) for room in the transmit queue of cmd
+bool waitCanTx(uint8_t cmd);
 //receives a canframe
 CAN_Frame getCanFrame();
-//
+// receives a canframe directly into frame; false if none is waiting.
+// A frame of another board with CAN.hash makes the node take a new hash.
+bool getCanFrame(CAN_Frame &frame);
+// hash collisions seen since start, at most 255
+extern uint8_t hashCollisions;
+// lets INT0 fill the receive ring; needs CAN.begin(..., MCP2515_OPT_RXRING).
+// Also starts Timer1 for canTime() with CAN_STAMP_TIMER1 in CAN_Defs.h
+void attachCanInterrupt();
+// us since start, wraps like micros(); with CAN_STAMP_TIMER1 from Timer1,
+// exact to 1 us and also inside interrupts (not together with Servo). With
+// CAN_SLEEP_CLOCK it adds the time slept in power-down, counted by a free
+// running 16 ms watchdog; lags by at most one such period
+uint32_t canTime();
+// answers FOR_DIAG in CAN.incomingMsg with the bus health counters
+void diagAnswer();
+
+// handler for a received frame, works on CAN.incomingMsg
+typedef void (*canHandler)();
+
+// entry of a command table in PROGMEM
+typedef struct
+{
+  uint8_t cmd;
+  bool resp;                  // resp_bit the frame must carry
+  canHandler handler;
+} canCommand;
+
+// CONFIG_Status: a configuration channel of the board, in PROGMEM
+#define CONFIG_LIST   1       // one of several texts
+#define CONFIG_VALUE  2       // number from min to max
+typedef struct
+{
+  uint8_t type;               // CONFIG_LIST, CONFIG_VALUE
+  uint8_t min;                // CONFIG_LIST: number of choices
+  uint8_t max;
+  uint8_t *value;             // current value in RAM, 0 = always 0
+  const char *text;           // PROGMEM: name; CONFIG_LIST: then the choices, each ended by \0
+  const char *unit;           // PROGMEM, CONFIG_VALUE only
+} canConfigChannel;
+
+// channels all boards with a module address or restart have
+extern const char configAddressText[] PROGMEM;
+extern const char configAddressUnit[] PROGMEM;
+extern const char configRestartText[] PROGMEM;
+#define CONFIG_ADDRESS  {CONFIG_VALUE, 0, maxadr, &CAN.params.moduladr, configAddressText, configAddressUnit}
+#define CONFIG_RESTART  {CONFIG_LIST, 3, 0, 0, configRestartText, 0}
+
+// what the shared handlers need to know about a board; one per firmware, in PROGMEM
+typedef struct
+{
+  const canCommand *commands; // command table, PROGMEM
+  uint8_t commandCount;
+  uint8_t versHigh;           // PING: version
+  uint8_t versLow;
+  uint16_t devType;           // PING: DEVTYPE_*
+  const uint8_t *name;        // BOARDNUM_ANSWER: I_am_a_*
+  uint32_t uidBase;           // UID after BOARDNUM_CHANGE
+  uint8_t hashOffset;         // added to the UID for the hash
+  uint8_t addressChannel;     // SYS_STAT channel of the module address, 0 = none
+  uint8_t restartChannel;     // SYS_STAT channel for restarts, 0 = none
+  void (*setChannel)(uint8_t channel, uint8_t value);  // other SYS_STAT channels
+  const char *deviceName;     // CONFIG_Status channel 0: "CANguru " and this, PROGMEM
+  const canConfigChannel *config;  // channels 1.., PROGMEM
+  uint8_t configCount;
+} canNode;
+
+#define CAN_COMMAND_COUNT(table) (sizeof(table) / sizeof(canCommand))
+#define CAN_CONFIG_COUNT(table)  (sizeof(table) / sizeof(canConfigChannel))
+
+// runs the handler of node for CAN.incomingMsg; false if it has none
+bool dispatchCanFrame(const canNode *node);
+// true if data[0..3] of CAN.incomingMsg is the UID of this board
+bool uidMatches();
+// true if data[1..2] of CAN.incomingMsg is the board number of this board
+bool boardMatches();
+// handlers for the command tables
+// PING: answers with UID, version and device type
+void pingAnswer();
+// CONFIG_Status: starts the frames of the channel, runCanWork() sends them
+void configRequest();
+// SYS_CMD/SYS_STAT: module address, restart, otherwise setChannel of the board
+void sysCommand();
+// FOR_APP: BOARDNUM_REQUEST, BOARDNUM_CHANGE, GO_BTLDR
+void appCommand();
+// as appCommand(); returns the subcommand carried out, APP_NONE if none
+uint8_t runAppCommand();
+#define APP_NONE  0xFF
+
+// slots for deferCanWork() and bytes deferEepromByte() can hold; CAN_Defs.h may change them
+#ifndef CAN_WORK_SLOTS
+#define CAN_WORK_SLOTS        4
+#endif
+#ifndef CAN_EEPROM_QUEUE_SIZE
+#define CAN_EEPROM_QUEUE_SIZE 16
+#endif
+
+// run times of INT0 and of the work done from loop()
+typedef struct
+{
+  uint16_t isrMax;            // us, longest canISR()
+  uint16_t taskMax;           // us, longest handler or deferred work
+  uint8_t taskMaxCmd;         // cmd whose handler took taskMax, 0xFF for deferred work
+  uint8_t eepromHighWater;    // most bytes ever waiting for the EEPROM
+  uint8_t stalls;             // full queues: the work ran at once and blocked
+} canWorkStats;
+extern canWorkStats workStats;
+
+// runs fn from runCanWork() once ms have passed; blocks and runs it at once if no slot is free
+void deferCanWork(canHandler fn, uint16_t ms);
+// writes value to EEPROM address adr from runCanWork(); a later value for the same address wins
+void deferEepromByte(uint16_t adr, uint8_t value);
+// call from loop(): runs deferred work that is due, starts the next EEPROM write
+// and sends CONFIG_Status frames while the transmit queue has room
+void runCanWork();
+// true while deferred work, EEPROM writes or CONFIG_Status frames wait
+bool canWorkPending();
+// writes all waiting EEPROM bytes, e.g. before a restart
+void flushEeprom();
+// sleeps in mode (SLEEP_MODE_*) until the next interrupt, needs CAN_SLEEP in CAN_Defs.h;
+// call with interrupts disabled when loop() has nothing to do, returns with them enabled;
+// only idles while deferred work waits, Timer0 has to keep counting for it,
+// and always with CAN_STAMP_TIMER1 for Timer1; CAN_SLEEP_CLOCK keeps canTime()
+// going through power-down with a 16 ms watchdog, which wakes the node 62 times a second. Only the MCU sleeps unless
+// CAN_SLEEP_MCP lets the MCP2515 sleep after a quiet minute; the frame that
+// wakes it is lost
+void sleepCanNode(uint8_t mode);
+// answers GO_BTLDR and jumps into the bootloader from runCanWork() after 5*wait_time
 void goIntoBootloader();
 #endif // !hex2usb
 
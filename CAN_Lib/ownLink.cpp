@@ -0,0 +1,108 @@
+#include "stdafx.h"
+#include "CAN_Defs.h"
+
+#include <util/crc16.h>
+
+#include "ownLink.h"
+#include "ownUART.h"
+
+/*
+ COBS: jede Gruppe beginnt mit einem Code c, es folgen c-1 Bytes ohne 0x00
+ und, ausser bei c = 0xFF und nach der letzten Gruppe, eine 0x00, die nicht
+ uebertragen wird. So kommt 0x00 nur als LINK_END vor und ein verlorenes
+ Byte kostet hoechstens den einen Frame.
+*/
+volatile linkCounters linkStats;
+uint8_t linkFrame[1 + LINK_MAX_DATA];
+
+static volatile uint8_t frameLength;      // Laenge in linkFrame, 0 = frei
+static uint8_t rxBuf[1 + LINK_MAX_DATA + 2];
+static uint8_t rxLength;
+static uint8_t rxLeft;                    // Bytes der Gruppe, die noch kommen
+static bool rxZero;                       // nach der Gruppe fehlt eine 0x00
+static bool rxBad;
+
+static uint16_t linkCrc(const uint8_t *p, uint8_t n){
+  uint16_t crc = 0xFFFF;
+  while (n--)
+    crc = _crc_xmodem_update(crc, *p++);
+  return crc;
+}
+
+static void rxPut(uint8_t c){
+  if (rxLength < sizeof(rxBuf))
+    rxBuf[rxLength++] = c;
+  else
+    rxBad = true;
+}
+
+// laeuft im RX-Interrupt
+static void linkReceive(uint8_t c){
+  if (c == LINK_END) {
+    if (!rxBad && !rxLeft && (rxLength > 2) &&
+        (linkCrc(rxBuf, rxLength - 2) == (uint16_t)((rxBuf[rxLength - 2] << 8) | rxBuf[rxLength - 1]))) {
+      if (frameLength)
+        linkStats.overruns++;
+      else {
+        memcpy(linkFrame, rxBuf, rxLength - 2);
+        frameLength = rxLength - 2;
+        linkStats.frames++;
+      }
+    }
+    else if (rxLength || rxLeft || rxBad)
+      linkStats.errors++;
+    rxLength = rxLeft = 0;
+    rxZero = rxBad = false;
+    return;
+  }
+  if (rxLeft) {
+    rxPut(c);
+    rxLeft--;
+    return;
+  }
+  // Code der naechsten Gruppe
+  if (rxZero)
+    rxPut(0);
+  rxLeft = c - 1;
+  rxZero = (c != 0xFF);
+}
+
+void linkBegin(uint32_t baud){
+  frameLength = 0;
+  uartBegin(baud, linkReceive);
+}
+
+uint8_t linkAvailable(){
+  return frameLength;
+}
+
+void linkRelease(){
+  frameLength = 0;
+}
+
+bool linkSend(uint8_t cmd, const uint8_t *data, uint8_t len){
+  uint8_t buf[1 + LINK_MAX_SEND + 2];
+  uint8_t n, start, i, j;
+  uint16_t crc;
+
+  if (len > LINK_MAX_SEND)
+    return false;
+  buf[0] = cmd;
+  memcpy(&buf[1], data, len);
+  crc = linkCrc(buf, len + 1);
+  buf[len + 1] = crc >> 8;
+  buf[len + 2] = crc;
+  n = len + 3;
+  // unter 254 Bytes kostet COBS genau ein Byte mehr, dazu LINK_END
+  if (uartTxFree() < LINK_FRAME_BYTES(len))
+    return false;
+  for (start = 0; start <= n; start = i + 1) {
+    for (i = start; (i < n) && buf[i]; i++)
+      ;
+    uartWrite(i - start + 1);
+    for (j = start; j < i; j++)
+      uartWrite(buf[j]);
+  }
+  uartWrite(LINK_END);
+  return true;
+}
@@ -0,0 +1,35 @@
+/*
+ Binaerframes zwischen usb2can und PC, siehe LINK_* in ownCAN.h. Der
+ RX-Interrupt des UART setzt die Frames Byte fuer Byte zusammen und prueft
+ die CRC; loop() findet in linkFrame nur noch fertige, gueltige Frames.
+*/
+
+#ifndef OWN_LINK_h
+#define OWN_LINK_h
+
+#include "ownCAN.h"
+
+typedef struct
+{
+  uint16_t frames;            // frames received with a good CRC
+  uint16_t errors;            // frames dropped: CRC, too long, broken COBS
+  uint16_t overruns;          // good frames dropped while linkFrame was taken
+} linkCounters;
+extern volatile linkCounters linkStats;
+
+// frame received last: command, then up to LINK_MAX_DATA data bytes
+extern uint8_t linkFrame[1 + LINK_MAX_DATA];
+
+// takes over UART0 (ownUART) at baud, see linkbaudrate
+void linkBegin(uint32_t baud);
+// length of the frame in linkFrame (command and data), 0 while none waits
+uint8_t linkAvailable();
+// frees linkFrame for the next frame
+void linkRelease();
+// sends cmd with len (up to LINK_MAX_SEND) data bytes; false, and nothing
+// sent, while the UART ring lacks room
+bool linkSend(uint8_t cmd, const uint8_t *data, uint8_t len);
+// UART bytes of a frame with len data bytes: command, CRC, COBS code, LINK_END
+#define LINK_FRAME_BYTES(len) ((len) + 5)
+
+#endif
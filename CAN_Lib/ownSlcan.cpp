@@ -0,0 +1,262 @@
+#include "stdafx.h"
+#include "CAN_Defs.h"
+
+#include "ownSlcan.h"
+#include "ownUART.h"
+
+/*
+ Der RX-Interrupt legt die Zeichen vom PC nur in einen Ring; slcanRun()
+ setzt daraus die Zeilen zusammen. Empfangene Frames holt slcanRun() erst
+ aus dem Treiber, wenn die laengste Zeile in den Sendering passt, so wartet
+ uartWrite() nie und die Frames stauen sich im Empfangsring des Treibers.
+*/
+
+static const uint32_t slcanRates[] PROGMEM = {
+  CAN_BPS_10K, CAN_BPS_20K, CAN_BPS_50K, CAN_BPS_100K, CAN_BPS_125K,
+  CAN_BPS_250K, CAN_BPS_500K, 0, CAN_BPS_1000K     // S7: 800k geht mit 16 MHz nicht
+};
+
+#define SLCAN_OPTS (MCP2515_OPT_RXRING | MCP2515_OPT_TXQUEUE | MCP2515_OPT_ROLLOVER)
+
+static volatile uint8_t rxRing[SLCAN_RX_SIZE];
+static volatile uint8_t rxHead;
+static uint8_t rxTail;
+static uint8_t line[SLCAN_LINE_SIZE];
+static uint8_t lineLength;
+static bool lineBad;                  // zu lang, wird bis CR verworfen
+static const canNode *slcanNode;
+static uint32_t bitrate = CAN_BPS_250K;
+static uint8_t mode = MCP2515_MODE_CONFIG;   // CONFIG = Kanal zu
+static bool timestamps;
+static uint8_t flags;                 // SLCAN_F_*, bis zum naechsten "F"
+static uint16_t seenOverruns, seenHwOverruns, seenMsgErrors;
+
+// laeuft im RX-Interrupt
+static void slcanReceive(uint8_t c){
+  if ((uint8_t)(rxHead - rxTail) < SLCAN_RX_SIZE) {
+    rxRing[rxHead & (SLCAN_RX_SIZE - 1)] = c;
+    rxHead++;
+  }
+}
+
+// digits Hex-Ziffern ab line[pos]; false bei einem anderen Zeichen
+static bool getHex(uint8_t pos, uint8_t digits, uint32_t *value){
+  uint8_t c;
+  *value = 0;
+  if (pos + digits > lineLength)
+    return false;
+  while (digits--) {
+    c = line[pos++];
+    if (c >= '0' && c <= '9') c -= '0';
+    else if (c >= 'A' && c <= 'F') c -= 'A' - 10;
+    else if (c >= 'a' && c <= 'f') c -= 'a' - 10;
+    else return false;
+    *value = (*value << 4) | c;
+  }
+  return true;
+}
+
+static void openChannel(uint8_t newMode){
+  mode = newMode;
+  CAN.begin(bitrate, mode, SLCAN_OPTS);
+  seenOverruns = CAN.stats.rxOverruns;
+  seenHwOverruns = CAN.stats.hwOverruns;
+  seenMsgErrors = CAN.stats.msgErrors;
+}
+
+static void closeChannel(){
+  mode = MCP2515_MODE_CONFIG;
+  CAN.begin(bitrate, mode, SLCAN_OPTS);
+}
+
+// t/T/r/R: Frame aus der Zeile auf den Bus
+static bool transmit(){
+  CAN_Frame frame;
+  uint32_t value;
+  uint8_t pos, i;
+  bool extended = (line[0] == 'T') || (line[0] == 'R');
+
+  if (mode != MCP2515_MODE_NORMAL)
+    return false;
+  memset(&frame, 0, sizeof(frame));
+  pos = extended ? 9 : 4;
+  if (!getHex(1, pos - 1, &value) || (value > (extended ? 0x1FFFFFFFUL : 0x7FFUL)))
+    return false;
+  frame.id = value;
+  frame.extended = extended;
+  frame.rtr = (line[0] == 'r') || (line[0] == 'R');
+  if (!getHex(pos++, 1, &value) || (value > 8))
+    return false;
+  frame.length = value;
+  if (!frame.rtr) {
+    for (i = 0; i < frame.length; i++, pos += 2) {
+      if (!getHex(pos, 2, &value))
+        return false;
+      frame.data[i] = value;
+    }
+  }
+  if (pos != lineLength)
+    return false;
+  // Bulk-Schlange: die Frames verlassen den Adapter in ihrer Reihenfolge
+  frame.priority = 8;
+  if (!CAN.tryWrite(frame)) {
+    flags |= SLCAN_F_TX_FULL;
+    return false;
+  }
+  uartWrite(extended ? 'Z' : 'z');
+  return true;
+}
+
+static void statusFlags(){
+  CAN.sampleErrors();
+  if (CAN.stats.eflg & _BV(MCP2515_EWARN))
+    flags |= SLCAN_F_EWARN;
+  if (CAN.stats.eflg & (_BV(MCP2515_RXEP) | _BV(MCP2515_TXEP)))
+    flags |= SLCAN_F_PASSIVE;
+  uartWrite('F');
+  uartHex(flags, 2);
+  flags = 0;
+}
+
+// eine Zeile vom PC, ohne CR
+static void command(){
+  uint32_t value;
+  bool ok = true;
+
+  if (!lineLength) {
+    // slcand schickt zu Beginn leere Zeilen
+    uartWrite(SLCAN_OK);
+    return;
+  }
+  switch (line[0])
+  {
+    case 'S':
+    // Bitrate S0..S8, nur bei geschlossenem Kanal
+      ok = (mode == MCP2515_MODE_CONFIG) && (lineLength == 2) && getHex(1, 1, &value) &&
+           (value < sizeof(slcanRates) / sizeof(slcanRates[0])) &&
+           (pgm_read_dword(&slcanRates[value]) != 0);
+      if (ok)
+        bitrate = pgm_read_dword(&slcanRates[value]);
+      break;
+    case 'O':
+    case 'L':
+    // oeffnen, L nur mithoeren
+      ok = (mode == MCP2515_MODE_CONFIG);
+      if (ok)
+        openChannel(line[0] == 'O' ? MCP2515_MODE_NORMAL : MCP2515_MODE_LISTEN);
+      break;
+    case 'C':
+      ok = (mode != MCP2515_MODE_CONFIG);
+      if (ok)
+        closeChannel();
+      break;
+    case 't':
+    case 'T':
+    case 'r':
+    case 'R':
+      ok = transmit();
+      break;
+    case 'F':
+      statusFlags();
+      break;
+    case 'V':
+      uartWrite('V');
+      uartHex(pgm_read_byte(&slcanNode->versHigh), 2);
+      uartHex(pgm_read_byte(&slcanNode->versLow), 2);
+      break;
+    case 'N':
+      uartWrite('N');
+      uartHex(CAN.hash, 4);
+      break;
+    case 'Z':
+      ok = (lineLength == 2) && getHex(1, 1, &value) && (value < 2);
+      if (ok)
+        timestamps = value;
+      break;
+    default:
+    // s (BTR), M/m (Filter des SJA1000) u.a. gibt es hier nicht
+      ok = false;
+  }
+  uartWrite(ok ? SLCAN_OK : SLCAN_ERROR);
+}
+
+// ein empfangener Frame als Zeile an den PC; stamp ist canTime() beim Empfang
+static void forward(const CAN_Frame &frame, uint32_t stamp){
+  uint8_t i;
+
+  if (frame.extended) {
+    uartWrite(frame.rtr ? 'R' : 'T');
+    uartHex(frame.id, 8);
+  }
+  else {
+    uartWrite(frame.rtr ? 'r' : 't');
+    uartHex(frame.id, 3);
+  }
+  uartHex(frame.length, 1);
+  if (!frame.rtr)
+    for (i = 0; i < frame.length; i++)
+      uartHex(frame.data[i], 2);
+  if (timestamps)
+    uartHex((stamp / 1000) % 60000, 4);
+  uartWrite(SLCAN_OK);
+}
+
+void slcanBegin(const canNode *node){
+  slcanNode = node;
+  rxHead = rxTail = 0;
+  lineLength = 0;
+  lineBad = false;
+  closeChannel();
+  uartBegin(SLCAN_BAUD, slcanReceive);
+}
+
+void slcanRun(){
+  CAN_Frame frame;
+  uint8_t c;
+
+  // ohne INT0: Empfangsring und Sendeschlange hier bedienen; der Stempel
+  // gilt fuer die Frames, die handleInterrupt() jetzt aus dem MCP2515 holt
+#ifdef CAN_RX_STAMPS
+  CAN.intStamp = canTime();
+#endif
+  CAN.handleInterrupt();
+  while (rxTail != rxHead) {
+    c = rxRing[rxTail & (SLCAN_RX_SIZE - 1)];
+    rxTail++;
+    if (c == '\r') {
+      if (lineBad)
+        uartWrite(SLCAN_ERROR);
+      else
+        command();
+      lineLength = 0;
+      lineBad = false;
+    }
+    else if (c == '\n') {
+      // manche Programme schicken CR LF
+    }
+    else if (lineLength < sizeof(line))
+      line[lineLength++] = c;
+    else
+      lineBad = true;
+  }
+  if (mode == MCP2515_MODE_CONFIG)
+    return;
+  while ((uartTxFree() >= SLCAN_LINE_SIZE) && CAN.tryRead(frame))
+#ifdef CAN_RX_STAMPS
+    forward(frame, CAN.rxStamp);
+#else
+    forward(frame, canTime());
+#endif
+  if (CAN.stats.rxOverruns != seenOverruns) {
+    seenOverruns = CAN.stats.rxOverruns;
+    flags |= SLCAN_F_RX_FULL;
+  }
+  if (CAN.stats.hwOverruns != seenHwOverruns) {
+    seenHwOverruns = CAN.stats.hwOverruns;
+    flags |= SLCAN_F_OVERRUN;
+  }
+  if (CAN.stats.msgErrors != seenMsgErrors) {
+    seenMsgErrors = CAN.stats.msgErrors;
+    flags |= SLCAN_F_BUS_ERROR;
+  }
+}
@@ -0,0 +1,45 @@
+/*
+ SLCAN (Lawicel) fuer die Gateways: mit "#define slcan" in CAN_Defs.h wird
+ usb2can bzw. can2usb zum seriellen CAN-Adapter fuer slcand und can-utils
+ unter Linux, z.B.
+
+   slcand -o -s5 -S 1000000 /dev/ttyUSB0 can0
+
+ Der Adapter ist dann durchsichtig: er reicht alle Frames weiter und nimmt
+ selbst nicht mehr am Maerklin-Protokoll teil.
+*/
+
+#ifndef OWN_SLCAN_h
+#define OWN_SLCAN_h
+
+#include "ownCAN.h"
+
+// UART-Takt; 1 MBaud geht bei 16 MHz genau auf und traegt einen voll
+// ausgelasteten 250-kbit/s-Bus (~30 Zeichen pro Frame)
+#ifndef SLCAN_BAUD
+#define SLCAN_BAUD        1000000
+#endif
+// Empfangsring fuer die Befehle vom PC, Zweierpotenz
+#ifndef SLCAN_RX_SIZE
+#define SLCAN_RX_SIZE     64
+#endif
+// laengste Zeile: T, 8 ID, DLC, 16 Daten, 4 Zeitstempel, CR
+#define SLCAN_LINE_SIZE   31
+
+#define SLCAN_OK          '\r'
+#define SLCAN_ERROR       0x07  // BELL
+
+// Statusflags fuer "F"
+#define SLCAN_F_RX_FULL   0x01  // Empfangsring voll, Frames verloren
+#define SLCAN_F_TX_FULL   0x02  // Sendeschlange voll, Frame verworfen
+#define SLCAN_F_EWARN     0x04  // Fehlerzaehler ueber 96
+#define SLCAN_F_OVERRUN   0x08  // Frames im MCP2515 verloren
+#define SLCAN_F_PASSIVE   0x20  // Error passive
+#define SLCAN_F_BUS_ERROR 0x80  // Fehlerframes auf dem Bus
+
+// takes over UART0 (ownUART) at SLCAN_BAUD; the CAN channel stays closed until "O" or "L"
+void slcanBegin(const canNode *node);
+// call from loop(): runs the commands from the PC and passes received frames on
+void slcanRun();
+
+#endif
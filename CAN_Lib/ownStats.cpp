@@ -0,0 +1,243 @@
+#include "stdafx.h"
+#include "CAN_Defs.h"
+
+#include "ownStats.h"
+#include "ownUART.h"
+
+/*
+ Gezaehlt wird in einem von zwei Saetzen, ausgegeben aus dem anderen: zum
+ Ende der Sekunde tauschen sie, wenn die letzte Zusammenfassung draussen
+ ist, sonst laeuft die Zaehlung weiter und "stat" nennt die laengere Dauer.
+ statsRun() schreibt eine Zeile nur, wenn sie ganz in den Sendering passt,
+ so wartet uartWrite() nie und der Empfang stockt nicht.
+*/
+
+typedef struct
+{
+  uint16_t requests;
+  uint16_t responses;
+  uint8_t bins[STATS_BINS];   // Antwortzeiten, bis 255 je Fach
+} statsCmd;
+
+typedef struct
+{
+  uint16_t ms;
+  uint16_t frames;
+  uint16_t lost;
+  uint32_t bits;
+  statsCmd cmds[STATS_CMD_SLOTS + 1];   // der letzte fuer "cmd *"
+  uint8_t hashCount;
+  uint16_t hashes[STATS_HASH_SLOTS];
+  uint16_t hashFrames[STATS_HASH_SLOTS + 1];
+} statsSet;
+
+// offene Anfrage je Befehl: Zeitstempel und die Datenbytes, die die Antwort wiederholt
+typedef struct
+{
+  uint32_t stamp;
+  uint8_t key[4];
+  uint8_t keyLength;
+  bool open;
+} statsRequest;
+
+static const canNode *statsNode;
+static uint32_t busBitrate;
+static statsSet sets[2];
+static statsSet *counting = &sets[0];
+static statsSet *report = &sets[1];
+static uint8_t cmdIds[STATS_CMD_SLOTS];
+static uint8_t cmdCount;
+static statsRequest requests[STATS_CMD_SLOTS];
+static uint8_t reportLine;              // naechste Zeile, 0 = stat, 0xFF = fertig
+static uint32_t periodStart;
+static uint16_t seenOverruns, seenHwOverruns;
+
+static uint8_t cmdSlot(uint8_t cmd){
+  for (uint8_t i = 0; i < cmdCount; i++)
+    if (cmdIds[i] == cmd)
+      return i;
+  if (cmdCount == STATS_CMD_SLOTS)
+    return STATS_CMD_SLOTS;
+  cmdIds[cmdCount] = cmd;
+  return cmdCount++;
+}
+
+static void countHash(uint16_t hash){
+  uint8_t i;
+  for (i = 0; i < counting->hashCount; i++)
+    if (counting->hashes[i] == hash)
+      break;
+  if (i == counting->hashCount) {
+    if (i == STATS_HASH_SLOTS) {
+      counting->hashFrames[STATS_HASH_SLOTS]++;
+      return;
+    }
+    counting->hashes[i] = hash;
+    counting->hashCount++;
+  }
+  counting->hashFrames[i]++;
+}
+
+// Bits auf dem Bus ohne Stopfbits: SOF bis EOF und Pause zwischen den Frames
+static uint8_t frameBits(const CAN_Frame &frame){
+  uint8_t bits = frame.extended ? 67 : 47;
+  if (!frame.rtr)
+    bits += 8 * frame.length;
+  return bits;
+}
+
+// Empfangszeit: Stempel der INT0-Flanke, ohne CAN_RX_STAMPS die Zeit beim Abholen
+static uint32_t frameTime(){
+#ifdef CAN_RX_STAMPS
+  return CAN.rxStamp;
+#else
+  return canTime();
+#endif
+}
+
+static void countLatency(statsCmd *cmd, uint32_t us){
+  uint8_t bin = 0;
+  us >>= 8;
+  while (us && (bin < STATS_BINS - 1)) {
+    us >>= 1;
+    bin++;
+  }
+  if (cmd->bins[bin] < 0xFF)
+    cmd->bins[bin]++;
+}
+
+static void countFrame(const CAN_Frame &frame){
+  uint8_t slot = cmdSlot(frame.cmd);
+  statsCmd *cmd = &counting->cmds[slot];
+  uint8_t keyLength = (frame.length < 4) ? frame.length : 4;
+
+  counting->frames++;
+  counting->bits += frameBits(frame);
+  // ID<15:0>, getCanFrame() fuellt frame.hash nicht
+  countHash((uint16_t) frame.id);
+  if (!frame.resp_bit) {
+    cmd->requests++;
+    if (slot < STATS_CMD_SLOTS) {
+      requests[slot].stamp = frameTime();
+      memcpy(requests[slot].key, frame.data, keyLength);
+      requests[slot].keyLength = keyLength;
+      requests[slot].open = true;
+    }
+    return;
+  }
+  cmd->responses++;
+  if ((slot < STATS_CMD_SLOTS) && requests[slot].open && (frame.length >= requests[slot].keyLength) &&
+      !memcmp(requests[slot].key, frame.data, requests[slot].keyLength)) {
+    requests[slot].open = false;
+    countLatency(cmd, frameTime() - requests[slot].stamp);
+  }
+}
+
+static void printCmd(uint8_t slot){
+  statsCmd *cmd = &report->cmds[slot];
+  uint8_t i, answered = 0;
+
+  uartPrint("cmd ");
+  if (slot < STATS_CMD_SLOTS)
+    uartHex(cmdIds[slot], 2);
+  else
+    uartWrite('*');
+  uartWrite(' ');
+  uartDec(cmd->requests);
+  uartPrint(" req ");
+  uartDec(cmd->responses);
+  uartPrint(" resp");
+  for (i = 0; i < STATS_BINS; i++)
+    answered |= cmd->bins[i];
+  if (answered) {
+    uartPrint(" lat");
+    for (i = 0; i < STATS_BINS; i++) {
+      uartWrite(' ');
+      uartDec(cmd->bins[i]);
+    }
+  }
+  uartPrint("\r\n");
+}
+
+static void printHash(uint8_t i){
+  uartPrint("hash ");
+  if (i < report->hashCount)
+    uartHex(report->hashes[i], 4);
+  else
+    uartWrite('*');
+  uartWrite(' ');
+  uartDec(report->hashFrames[i]);
+  uartPrint("\r\n");
+}
+
+// eine Zeile der Zusammenfassung; Zeilen 1.. Befehle, danach Absender
+static void printLine(){
+  uint8_t i;
+
+  if (reportLine == 0) {
+    uartPrint("stat ");
+    uartDec(report->ms);
+    uartPrint(" ms ");
+    uartDec(report->frames);
+    uartPrint(" frames ");
+    uartDec(busBitrate ? (uint16_t)(report->bits * 100 / ((uint32_t)report->ms * (busBitrate / 1000))) : 0);
+    uartPrint(" % load ");
+    uartDec(report->lost);
+    uartPrint(" lost\r\n");
+    reportLine++;
+    return;
+  }
+  // leere Zeilen ueberspringen
+  for (i = reportLine - 1; i <= STATS_CMD_SLOTS; i++)
+    if (report->cmds[i].requests || report->cmds[i].responses) {
+      printCmd(i);
+      reportLine = i + 2;
+      return;
+    }
+  for (i -= STATS_CMD_SLOTS + 1; i <= STATS_HASH_SLOTS; i++)
+    if (report->hashFrames[i]) {
+      printHash(i);
+      reportLine = STATS_CMD_SLOTS + 3 + i;
+      return;
+    }
+  reportLine = 0xFF;
+}
+
+static void endPeriod(){
+  uint32_t now = millis();
+  uint16_t rxOverruns = CAN.stats.rxOverruns;
+  uint16_t hwOverruns = CAN.stats.hwOverruns;
+  statsSet *done = counting;
+
+  done->ms += now - periodStart;
+  done->lost += (uint16_t)(rxOverruns - seenOverruns) + (uint16_t)(hwOverruns - seenHwOverruns);
+  periodStart = now;
+  seenOverruns = rxOverruns;
+  seenHwOverruns = hwOverruns;
+  if (reportLine != 0xFF)
+    return;
+  counting = report;
+  report = done;
+  memset(counting, 0, sizeof(*counting));
+  reportLine = 0;
+}
+
+void statsBegin(const canNode *node, uint32_t bitrate){
+  statsNode = node;
+  busBitrate = bitrate;
+  memset(sets, 0, sizeof(sets));
+  reportLine = 0xFF;
+  periodStart = millis();
+  uartBegin(STATS_BAUD, 0);
+}
+
+void statsRun(){
+  while (getCanFrame(CAN.incomingMsg)) {
+    countFrame(CAN.incomingMsg);
+    dispatchCanFrame(statsNode);
+  }
+  if (millis() - periodStart >= 1000)
+    endPeriod();
+  if ((reportLine != 0xFF) && (uartTxFree() >= STATS_LINE_SIZE))
+    printLine();
+}
@@ -0,0 +1,49 @@
+/*
+ Busstatistik fuer can2usb: mit "#define busstats" in CAN_Defs.h zaehlt
+ can2usb die Frames selbst, statt jeden einzeln auszugeben, und schreibt
+ jede Sekunde eine Zusammenfassung:
+
+   stat 1000 ms 812 frames 37 % load 0 lost
+   cmd 16 100 req 100 resp lat 0 12 80 8 0 0 0 0
+   cmd 11 0 req 38 resp
+   hash 4B0A 120
+   hash * 12
+
+ stat: Dauer, Frames, Buslast und verlorene Frames der Sekunde. Die Buslast
+ rechnet ohne Stopfbits, liegt also etwas zu niedrig.
+ cmd: Befehl (hex, "*" fuer alle ohne eigenen Platz), Anfragen und
+ Antworten (resp_bit). Hatte eine Antwort
+ eine Anfrage, folgt das Histogramm der Antwortzeiten: Fach 0 unter 256 us,
+ jedes weitere bis zur doppelten Zeit, das letzte ab 16,4 ms. Zur Anfrage
+ gehoert die erste Antwort mit demselben Befehl und denselben ersten vier
+ Datenbytes (bei kuerzeren Anfragen entsprechend weniger).
+ hash: Frames je Absender, "*" fuer die, die keinen Platz mehr fanden.
+*/
+
+#ifndef OWN_STATS_h
+#define OWN_STATS_h
+
+#include "ownCAN.h"
+
+// UART-Takt, wie die Textausgabe
+#ifndef STATS_BAUD
+#define STATS_BAUD        baudrate
+#endif
+// Befehle mit eigener Zeile; sie bleiben belegt, weitere zaehlen als "cmd *"
+#ifndef STATS_CMD_SLOTS
+#define STATS_CMD_SLOTS   12
+#endif
+// Absender je Sekunde mit eigener Zeile
+#ifndef STATS_HASH_SLOTS
+#define STATS_HASH_SLOTS  8
+#endif
+#define STATS_BINS        8
+// laengste Zeile: cmd mit Histogramm, CR LF
+#define STATS_LINE_SIZE   66
+
+// takes over UART0 (ownUART) at STATS_BAUD; bitrate of the bus for the load
+void statsBegin(const canNode *node, uint32_t bitrate);
+// call from loop(): counts and dispatches received frames, prints the summary line by line
+void statsRun();
+
+#endif
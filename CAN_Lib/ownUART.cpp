@@ -0,0 +1,82 @@
+#include "stdafx.h"
+#include "CAN_Defs.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#include "ownUART.h"
+
+static volatile uint8_t txRing[UART_TX_SIZE];
+static volatile uint8_t txHead;
+static volatile uint8_t txTail;
+static uartRxHandler rxHandler;
+
+static const char hexDigits[] PROGMEM = "0123456789ABCDEF";
+
+void uartBegin(uint32_t baud, uartRxHandler handler){
+  rxHandler = handler;
+  txHead = txTail = 0;
+  // U2X0: Teiler 8 statt 16, 500 kBaud und 1 MBaud gehen bei 16 MHz genau auf
+  UCSR0A = _BV(U2X0);
+  UBRR0 = (F_CPU / 8 + baud / 2) / baud - 1;
+  UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+  UCSR0B = _BV(RXCIE0) | _BV(RXEN0) | _BV(TXEN0);
+}
+
+uint8_t uartTxFree(){
+  return UART_TX_SIZE - (uint8_t)(txHead - txTail);
+}
+
+static void txNext(){
+  UDR0 = txRing[txTail & (UART_TX_SIZE - 1)];
+  txTail++;
+}
+
+void uartWrite(uint8_t c){
+  // der UDRE-Interrupt schafft Platz; bei gesperrten Interrupts das Byte
+  // selbst weitergeben, sobald UDR0 frei ist
+  while (!uartTxFree()) {
+    if ((UCSR0A & _BV(UDRE0)) && !(SREG & _BV(SREG_I)))
+      txNext();
+  }
+  txRing[txHead & (UART_TX_SIZE - 1)] = c;
+  txHead++;
+  UCSR0B |= _BV(UDRIE0);
+}
+
+void uartPrint(const char *s){
+  while (*s)
+    uartWrite(*s++);
+}
+
+void uartHex(uint32_t value, uint8_t digits){
+  while (digits--)
+    uartWrite(pgm_read_byte(&hexDigits[(value >> (4 * digits)) & 0x0F]));
+}
+
+void uartDec(uint16_t value){
+  char digits[5];
+  uint8_t n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (n)
+    uartWrite(digits[--n]);
+}
+
+ISR(USART_UDRE_vect){
+  if (txHead == txTail){
+    // Ring leer: bis zum naechsten uartWrite() kein UDRE-Interrupt mehr
+    UCSR0B &= ~_BV(UDRIE0);
+    return;
+  }
+  txNext();
+}
+
+ISR(USART_RX_vect){
+  uint8_t c = UDR0;
+  if (rxHandler)
+    rxHandler(c);
+}
@@ -0,0 +1,34 @@
+/*
+ UART0 ueber Interrupts fuer die Gateways: zu sendende Bytes warten in
+ einem Ring, den der UDRE-Interrupt leert; jedes empfangene Byte geht im
+ RX-Interrupt an einen Handler. Ersetzt Serial (HardwareSerial), beide
+ belegen dieselben Interruptvektoren.
+*/
+
+#ifndef OWN_UART_h
+#define OWN_UART_h
+
+#include <stdint.h>
+
+// Sendering in Bytes, Zweierpotenz bis 128; CAN_Defs.h kann ihn setzen
+#ifndef UART_TX_SIZE
+#define UART_TX_SIZE 64
+#endif
+
+// called from the RX interrupt with each received byte
+typedef void (*uartRxHandler)(uint8_t c);
+
+// 8N1 at baud with double speed (U2X0); handler gets every received byte
+void uartBegin(uint32_t baud, uartRxHandler handler);
+// queues c for sending; waits while the ring is full, with interrupts off it sends itself
+void uartWrite(uint8_t c);
+// bytes uartWrite() takes right now without waiting
+uint8_t uartTxFree();
+// uartWrite() for each character of s
+void uartPrint(const char *s);
+// value as digits upper case hex digits, leading zeros included
+void uartHex(uint32_t value, uint8_t digits);
+// value in decimal, without leading zeros
+void uartDec(uint16_t value);
+
+#endif
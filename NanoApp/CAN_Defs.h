@@ -1,2 +1,6 @@
 #pragma once
 //#define hex2usb
+// Schlafmodus mit sleepCanNode()
+#define CAN_SLEEP
+// auch den MCP2515 nach einer Minute Ruhe schlafen legen; der weckende Frame geht verloren
+//#define CAN_SLEEP_MCP
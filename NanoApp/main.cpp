@@ -26,6 +26,7 @@
 #include <util/delay.h>
 #include <inttypes.h>
 #include <avr/eeprom.h>
+#include <avr/sleep.h>
 
 #include "ownCAN.h"
 #include "CAN.h"
@@ -39,10 +40,7 @@
 
 // EEPROM-Adressen
 #define  setup_done 0x047
-const uint8_t adr_setup_done = 0x00;
-
-const uint8_t adr_HiByte = 0x01;
-const uint8_t adr_LoByte = 0x02;
+// adr_setup_done, adr_HiByte und adr_LoByte siehe ownCAN.h
 const uint8_t adr_SrvDel = 0x03;
 // locids bentigen 2 byte
 #define locid0          0x04
@@ -52,16 +50,12 @@ const uint8_t adr_SrvDel = 0x03;
 const uint8_t reg_locids[num_accs] = {locid0, locid1, locid2, locid3};    //EEPROM-Speicherpltze der Local-IDs
 const uint8_t acc_state  = 0x0C;  // ab dieser Adresse werden die Weichenstellungen gespeichert
 
-// config-Daten
-#define CONFIG_NUM 3     // Anzahl der Konfigurationspunkte
-int config_index = 0;
-bool config_request = false;
-bool uid_request;
-
 #define VERS_HIGH     0x00  // Versionsnummer vor dem Punkt
 #define VERS_LOW      0x06  // Versionsnummer nach dem Punkt
 
 uint32_t UID;
+// nur diese Befehle werden vom MCP2515 durchgelassen
+const uint8_t rx_cmds[] = {SYS_CMD, PING, CONFIG_Status, FOR_APP, FOR_DIAG, SWITCH_ACC};
 
 // EEPROM-Belegung
 // adr_setup_done 00
@@ -71,18 +65,47 @@ uint32_t UID;
 // EEPROM-Speicherpltze der Local-IDs
 // Stellung der Magnetartikel 0xa0
 
-void processRXFrame();
-void boardnumAnswer();
+void setChannel(uint8_t channel, uint8_t value);
+void localAppCommand();
+void accCommand();
 void switchAcc(uint8_t acc_num);
 void acc_report(uint8_t num);
+void fill_acc_report(uint8_t num, position pos);
 void calc_locid(bool report);
-void sendConfig(int index);
+
+// empfangene Befehle und ihre Handler
+const canCommand commands[] PROGMEM = {
+  {SYS_CMD,       false, sysCommand},
+  {PING,          false, pingAnswer},
+  {CONFIG_Status, false, configRequest},
+  {FOR_DIAG,      false, diagAnswer},
+  {FOR_APP,       false, localAppCommand},
+  {SWITCH_ACC,    false, accCommand}
+};
 
 /*
    Variablen der Servos & Magnetartikel
 */
 Sweeper Servos[num_accs];
 uint8_t servoDelay;
+// micros() beim Abarbeiten des letzten SWITCH_ACC
+uint16_t cmdEdge;
+// Artikel, dessen nchste Lagemeldung in TXB0 vorgeladen werden soll; num_accs = keiner
+uint8_t armAcc = num_accs;
+
+// CONFIG_Status: Kanle wie bei SYS_STAT
+const char deviceName[] PROGMEM = "Servo";
+const char servoDelayText[] PROGMEM = "Servoverz\xc3\xb6gerung";
+const char servoDelayUnit[] PROGMEM = "ms";
+const canConfigChannel config[] PROGMEM = {
+  {CONFIG_VALUE, 5, maxservodelay, &servoDelay, servoDelayText, servoDelayUnit},
+  CONFIG_ADDRESS,
+  CONFIG_RESTART
+};
+// SYS_STAT: Kanal 1 Servoverzgerung, 2 Moduladresse, 3 Neustart
+const canNode node PROGMEM = {commands, CAN_COMMAND_COUNT(commands), VERS_HIGH, VERS_LOW,
+  DEVTYPE_SERVO, I_am_a_NanoApp, UID_BASE, 0, 2, 3, setChannel,
+  deviceName, config, CAN_CONFIG_COUNT(config)};
 
 // an diese PINs werden die Magnetartikel angeschlossen
 #define PIN_0 4
@@ -107,9 +130,12 @@ void setup()
     eeprom_update_byte (( uint8_t *) adr_HiByte, '0');
     eeprom_update_byte (( uint8_t *) adr_LoByte, '0');
     eeprom_update_byte (( uint8_t *) adr_SrvDel, stdservodelay);
+    CAN.params.HiByteAddress = '0';
+    CAN.params.LoByteAddress = '0';
 
     // Berechnen der locids
     calc_locid(false);
+    flushEeprom();
 
     // Status der Magnetartikel zu Beginn auf links setzen
     for (int i = 0; i < num_accs; i++) {
@@ -134,12 +160,10 @@ void setup()
   servoDelay = eeprom_read_byte(( uint8_t *) adr_SrvDel);
   CAN.params.moduladr = ( uint8_t ) ((CAN.params.HiByteAddress - '0')*10 + CAN.params.LoByteAddress - '0');
   UID = generateUID(UID_BASE, &CAN.params);
-  CAN.begin(CAN_BPS_250K);
-  _delay_ms(2*wait_time);  // Delay added just so we can have time to open up
-  //serial Monitor and CAN bus monitor. It can be removed later...
+  CAN.beginAuto(MCP2515_MODE_NORMAL, MCP2515_OPT_RXRING | MCP2515_OPT_TXQUEUE | MCP2515_OPT_ROLLOVER);
+  CAN.acceptCommands(rx_cmds, sizeof(rx_cmds), false);
   CAN.hash = generateHash(UID);
-  pinMode(PIN_INT0, INPUT_PULLUP);
-  attachInterrupt(digitalPinToInterrupt(PIN_INT0), processRXFrame, LOW);
+  attachCanInterrupt();
   for (int i = 0; i < num_accs; i++) {
     // Status der Magnetartikel einlesen in lokale arrays
     Servos[i].SetPosCurr((position) eeprom_read_byte(( uint8_t *) acc_state + i));
@@ -152,18 +176,13 @@ void setup()
 void calc_locid(bool report){
   // berechnet die locid aus der Adresse und der Protokollkonstante
 
-  CAN.params.HiByteAddress = eeprom_read_byte(( uint8_t *) adr_HiByte);
-  CAN.params.LoByteAddress = eeprom_read_byte(( uint8_t *) adr_LoByte);
   uint8_t baseaddress = ((CAN.params.HiByteAddress - '0') * 10 + CAN.params.LoByteAddress - '0' - 1) * 4;
 
   for (uint8_t i = 0; i < num_accs; i++) {
     uint16_t locid = PROT + baseaddress + i;
-    eeprom_update_byte(( uint8_t *) ( uint16_t ) Servos[i].GetRegID(), locid >> 8);
-    eeprom_update_byte(( uint8_t *) ( uint16_t ) Servos[i].GetRegID() + 1, locid);
-    // locids einlesen in lokales array
-    Servos[i].SetLocID(
-    ( uint16_t )( eeprom_read_byte(( uint8_t *) ( uint16_t ) Servos[i].GetRegID()) << 8 |
-                  eeprom_read_byte(( uint8_t *) ( uint16_t ) Servos[i].GetRegID() + 1)));
+    deferEepromByte(Servos[i].GetRegID(), locid >> 8);
+    deferEepromByte(Servos[i].GetRegID() + 1, locid);
+    Servos[i].SetLocID(locid);
     if (report==true)
       acc_report(i);
   }
@@ -172,173 +191,65 @@ void calc_locid(bool report){
 // main loop
 void loop()
 {
+  // empfangene Frames abarbeiten
+  while (getCanFrame(CAN.incomingMsg))
+    dispatchCanFrame(&node);
+  // aufgeschobene Arbeit, EEPROM-Bytes
+  runCanWork();
+  // wahrscheinlichste nchste Lagemeldung vorladen, sobald TXB0 frei ist
+  if (armAcc < num_accs) {
+    fill_acc_report(armAcc, (Servos[armAcc].GetPosCurr() == left) ? right : left);
+    if (CAN.arm_answer(6))
+      armAcc = num_accs;
+  }
   for (int i = 0; i < num_accs; i++)
     Servos[i].Update();
-  if (config_request) {
-    config_request = false;
-    sendConfig(config_index);
+  // nichts mehr zu tun: bis zum nchsten Interrupt ruhen;
+  // nur Idle, die Servos brauchen ihre Timer
+  noInterrupts();
+  sleepCanNode(SLEEP_MODE_IDLE);
+}
+
+// SYS_STAT Kanal 1: Servoverzgerung
+void setChannel(uint8_t channel, uint8_t value)
+{
+  if (channel == 1) {
+    servoDelay = value;
+    deferEepromByte(adr_SrvDel, servoDelay);
   }
 }
 
-/*
-   Ausfhren, wenn eine Nachricht verfgbar ist.
-   Nachricht wird geladen und anhngig vom CAN-Befehl verarbeitet.
-*/
-//Interrupt Service Routine for INT0
-void processRXFrame()
+// FOR_APP: vor dem Bootloader die Servos freigeben, nach neuer Boardnum die locids neu berechnen
+void localAppCommand()
 {
-  CAN.incomingMsg = getCanFrame();
-  if (CAN.incomingMsg.resp_bit == false)
-  {
-    switch (CAN.incomingMsg.cmd)
-    {
-     // Konfigurationswert ndern
-     case SYS_CMD:
-        uid_request = true;
-        for (uint8_t i=0; i<uid_num; i++)
-        uid_request = uid_request && (CAN.params.uid_device[i] == CAN.incomingMsg.data[i]);
-        if (uid_request==true &&
-            CAN.incomingMsg.data[4]==SYS_STAT) {
-          switch (CAN.incomingMsg.data[5])
-          {
- 		      // Kanalnummer #1
-           case 1:
-              servoDelay = CAN.incomingMsg.data[6]*16+CAN.incomingMsg.data[7];
-              eeprom_update_byte (( uint8_t *) adr_SrvDel, servoDelay);
-              break;
-		      // Kanalnummer #2
-		      case 2:
-    		      CAN.params.moduladr = CAN.incomingMsg.data[6]*16+CAN.incomingMsg.data[7];
-		          // speichert die neue Adresse
-		          CAN.params.LoByteAddress = CAN.incomingMsg.data[7]+'0';
-    		      CAN.params.HiByteAddress = (uint8_t)CAN.incomingMsg.data[6]+'0';
-		          eeprom_update_byte (( uint8_t *) adr_HiByte, CAN.params.HiByteAddress);
-		          eeprom_update_byte (( uint8_t *) adr_LoByte, CAN.params.LoByteAddress);
-		          break;
-          // Kanalnummer #3
-          case 3:
-          switch (CAN.incomingMsg.data[7])
-          {
-            case 0:
-             // do nothing
-            break;
-            case 1:
-              // Restart, Werte bleiben erhalten
-              // Antworten
-              CAN.outgoingMsg = CAN.incomingMsg;
-              CAN.outgoingMsg.data[6] = 0x01;
-              CAN.can_answer(7);
-              _delay_ms(3*wait_time);  // Delay added just so we can have time to open up
-              // jumping to restart
-              goto*0x0000;
-            break;
-            case 2:
-              // Restart, Werte werden zurckgesetzt
-              // Antworten
-              CAN.outgoingMsg = CAN.incomingMsg;
-              CAN.outgoingMsg.data[6] = 0x01;
-              CAN.can_answer(7);
-              _delay_ms(3*wait_time);  // Delay added just so we can have time to open up
-              // setup_done auf "FALSE" setzen
-              eeprom_update_byte (( uint8_t *) adr_setup_done, 0xFF);
-              // jumping to restart
-              goto*0x0000;
-            break;
-          }
-          break;
-          }
-          // Antworten
-        CAN.outgoingMsg = CAN.incomingMsg;
-        CAN.outgoingMsg.data[6] = 0x01;
-        CAN.can_answer(7);
-        }
-        break;
-      // PING-Abfragen beantworten
-      case PING:
-        CAN.outgoingMsg.cmd = PING;
-        // what_is_your_name(I_am_a_NanoApp, 0, &CAN.outgoingMsg);
-          for (uint8_t i = 0; i < 4; i++) {
-            CAN.outgoingMsg.data[i] = CAN.params.uid_device[i];
-          }
-          CAN.outgoingMsg.data[4] = VERS_HIGH;
-          CAN.outgoingMsg.data[5] = VERS_LOW;
-          CAN.outgoingMsg.data[6] = DEVTYPE_SERVO >> 8;
-          CAN.outgoingMsg.data[7] = DEVTYPE_SERVO;
-          CAN.can_answer(8);
-  	    break;
-      // config
-      case CONFIG_Status:
-        uid_request = true;
-        for (uint8_t i=0; i<uid_num; i++)
-          uid_request = uid_request && (CAN.params.uid_device[i] == CAN.incomingMsg.data[i]);
-        if (uid_request==true) {
-          config_request = true;
-          config_index = CAN.incomingMsg.data[4];
-        }
-      break;
-      // alle Auftrge von usb2can abarbeiten
-      case FOR_APP:
-        CAN.outgoingMsg.data[0] = 'a';
-        if ((CAN.incomingMsg.data[1] == CAN.params.HiByteAddress) &&
-            (CAN.incomingMsg.data[2] == CAN.params.LoByteAddress)) {
-          CAN.outgoingMsg.cmd = APP_ANSWER;
-          switch (CAN.incomingMsg.data[0])
-          {
-            case GO_BTLDR:
-              for (int i = 0; i < num_accs; i++) {
-                // Servos von den PINs entbinden
-                Servos[i].Detach();
-                _delay_ms(2*wait_time);  // Delay added just so we can have time to open up
-              }
-              // setup_done auf "FALSE" setzen
-              eeprom_update_byte (( uint8_t *) adr_setup_done, 0xFF);
-              goIntoBootloader();
-              break;
-            case BOARDNUM_REQUEST:
-              boardnumAnswer();
-              break;
-            case BOARDNUM_CHANGE:
-              // Reihenfolge wichtig, damit mit der alten Boardnum geantwortet wird
-              boardnumAnswer();
-              eeprom_update_byte(( uint8_t *) adr_HiByte, CAN.incomingMsg.data[3]);
-              eeprom_update_byte(( uint8_t *) adr_LoByte, CAN.incomingMsg.data[4]);
-              CAN.params.HiByteAddress = eeprom_read_byte(( uint8_t *) adr_HiByte);
-              CAN.params.LoByteAddress = eeprom_read_byte(( uint8_t *) adr_LoByte);
-              UID = generateUID(UID_BASE, &CAN.params);
-              CAN.hash = generateHash(UID);
-              // berechnet die locids neu
-              calc_locid(true);
-              CAN.params.moduladr = ( uint8_t ) ((CAN.params.HiByteAddress - '0')*10 + CAN.params.LoByteAddress - '0');
-              break;
-          }
-        }
-        break;
-      case SWITCH_ACC:
-        // Umsetzung nur bei gltiger Weichenadresse
-        uint16_t locid = (uint16_t) ((CAN.incomingMsg.data[2] << 8) | CAN.incomingMsg.data[3]);
-        for (int i = 0; i < num_accs; i++) {
-          // Auf benutzte Adresse berprfen
-          if (locid == Servos[i].GetLocID()) {
-            Servos[i].SetPosDest((position) CAN.incomingMsg.data[4]);
-            // muss Artikel gendert werden?
-            if (Servos[i].PosChg())
-              switchAcc(i);
-            break;
-          }
-        }
-        break;
+  if (boardMatches() && (CAN.incomingMsg.data[0] == GO_BTLDR)) {
+    for (int i = 0; i < num_accs; i++) {
+      // Servos von den PINs entbinden
+      Servos[i].Detach();
     }
   }
+  if (runAppCommand() == BOARDNUM_CHANGE)
+    calc_locid(true);
 }
-
-void boardnumAnswer(){
-  CAN.outgoingMsg.data[0] = BOARDNUM_ANSWER;
-  CAN.outgoingMsg.data[1] = CAN.params.HiByteAddress;
-  CAN.outgoingMsg.data[2] = CAN.params.LoByteAddress;
-  what_is_your_name(I_am_a_NanoApp, 3, &CAN.outgoingMsg);
-  CAN.can_answer(6);
+
+// SWITCH_ACC: wird aus loop() aufgerufen; INT0 legt die Frames nur im Empfangsring ab
+void accCommand()
+{
+  cmdEdge = micros();
+  // Umsetzung nur bei gltiger Weichenadresse
+  uint16_t locid = (uint16_t) ((CAN.incomingMsg.data[2] << 8) | CAN.incomingMsg.data[3]);
+  for (int i = 0; i < num_accs; i++) {
+    // Auf benutzte Adresse berprfen
+    if (locid == Servos[i].GetLocID()) {
+      Servos[i].SetPosDest((position) CAN.incomingMsg.data[4]);
+      // muss Artikel gendert werden?
+      if (Servos[i].PosChg())
+        switchAcc(i);
+      break;
+    }
+  }
 }
-
+
 void switchAcc(uint8_t acc_num) {
   position set_pos = Servos[acc_num].GetPosDest();
   switch (set_pos)
@@ -350,51 +261,23 @@ void switchAcc(uint8_t acc_num) {
         Servos[acc_num].GoRight();
         break;
     }
-  acc_report(acc_num);
-  Servos[acc_num].SetPosCurr(set_pos);
-  eeprom_update_byte(( uint8_t *) acc_state + acc_num, set_pos);
+  Servos[acc_num].SetPosCurr(set_pos);
+  // nur noch RTS, wenn die Meldung vorgeladen war
+  fill_acc_report(acc_num, set_pos);
+  CAN.fire_answer(6, cmdEdge);
+  armAcc = acc_num;
+  deferEepromByte(acc_state + acc_num, set_pos);
 }
 
 void acc_report(uint8_t num){
+  fill_acc_report(num, Servos[num].GetPosCurr());
+  CAN.can_answer(6);
+}
+
+void fill_acc_report(uint8_t num, position pos){
   CAN.outgoingMsg.cmd = SWITCH_ACC;
   memset(CAN.outgoingMsg.data, 0x0, 0x8);
   CAN.outgoingMsg.data[2] = (uint8_t) (Servos[num].GetLocID() >> 8);
   CAN.outgoingMsg.data[3] = (uint8_t) Servos[num].GetLocID();
-  CAN.outgoingMsg.data[4] = Servos[num].GetPosCurr();            /* Meldung der Lage fr Mrklin-Gerte.*/
-  CAN.can_answer(6);
-}
-
-void sendConfig(int index) {
-  uint8_t config_len[] = {4, 5, 4, 4};
-  uint8_t config_frames[][5][8] = {
-// #0
-/*1*/    {{CONFIG_NUM-3, CONFIG_NUM, 0, 0, 0, 0, 0, CAN.params.moduladr},
-/*2*/    {( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[0])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[0])),
-          ( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[1])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[1])),
-          ( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[2])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[2])),
-          ( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[3])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[3]))},
-/*3*/    {'C', 'A', 'N', 'g', 'u', 'r', 'u', ' '},
-/*4*/    {'S', 'e', 'r','v', 'o', 0, 0, 0}},
-// #1
-/*1*/    {{CONFIG_NUM-2, 2, 0, 5, 0, maxservodelay, 0, servoDelay},
-/*2*/    {'S', 'e', 'r', 'v', 'o', 'v', 'e', 'r'},
-/*3*/    {'z', 0xc3, 0xb6, 'g', 'e', 'r', 'u', 'n'},
-/*4*/    {'g', 0, '5', 0, (uint8_t)(maxservodelay/10)+'0', maxservodelay-(uint8_t)(maxservodelay/10)*10+'0', 0, 'm'},
-/*5*/    {'s', 0, 0, 0, 0, 0, 0, 0}},
-// #2
-/*1*/    {{CONFIG_NUM-1, 2, 0, 0, 0, maxadr, 0, CAN.params.moduladr},
-/*2*/    {'M', 'o', 'd', 'u', 'l', 'a', 'd', 'r'},
-/*3*/    {'e', 's', 's', 'e', 0, '0', 0, (uint8_t)(maxadr/10)+'0'},
-/*4*/    {maxadr-(uint8_t)(maxadr/10)*10+'0' ,0, 'A', 'd', 'r', 0, 0, 0 }},
-// #3
-/*1*/    {{CONFIG_NUM, 1, 3, 0, 0, 0, 0, 0},
-/*2*/    {'N', 'e', 'u', 's', 't', 'a', 'r', 't'},
-/*3*/    {0, 'N', 'e', 'i', 'n', 0, 'W', 'a'},
-/*4*/    {'r', 'm', 0, 'K', 'a', 'l', 't', 0}}
-};
-
-  for (int i = 0; i < config_len[index]; i++) {
-    CAN.configDataFrame(config_frames[index][i], i);
-  }
-  CAN.configTerminator(index, config_len[index]);
+  CAN.outgoingMsg.data[4] = pos;            /* Meldung der Lage fr Mrklin-Gerte.*/
 }
@@ -1,2 +1,8 @@
 #pragma once
 //#define hex2usb
+// Der Bootloader pollt nur: ohne Empfangsring und Sendewarteschlangen,
+// damit er in die 4 KB ab 0x7000 passt
+#define MCP2515_OPTS 0
+#define CAN_RX_RING_SIZE 1
+#define CAN_TX_QUEUE_SIZE 1
+#define CAN_TX_PRIO_QUEUE_SIZE 1
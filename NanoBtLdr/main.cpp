@@ -18,7 +18,7 @@
 
 CAN_Frame canFrame;
 unsigned char temp; // Variable
-uint16_t hash;
+const uint16_t hash = CAN_HASH(UID_BASE);
   // Datenpuffer fr die Hexdaten
 uint8_t flash_data[SPM_PAGESIZE];
   // Datenpuffer fr die ankommenden Daten
@@ -38,6 +38,31 @@ uint8_t  max_act_dataPtr = 0;
   // Zeiger auf das nchste (!) Datum; von 1 .. length-1
 uint8_t  act_dataPtr = max_hex_data;
 
+/*
+ Senden und Empfangen ohne sendCanFrame()/getCanFrame() aus ownCAN: deren
+ Hash-Wechsel, Befehlsliste und Header-Cache braucht der Bootloader nicht,
+ und er muss in die 4 KB ab 0x7000 passen.
+*/
+// BTLDR_ANSWER mit subcmd als einzigem Datum
+static void btldrAnswer(uint8_t subcmd) {
+  // ID<28:25> Prio, ID<24:17> Kommando, ID<16> Response, ID<15:0> Hash
+  canFrame.id = ((uint32_t)PRIO_BULK << 25) | ((uint32_t)BTLDR_ANSWER << 17)
+              | (1UL << 16) | hash;
+  canFrame.extended = CAN_EXTENDED_FRAME;
+  canFrame.rtr = 0;
+  canFrame.priority = PRIO_BULK;
+  canFrame.length = 1;
+  canFrame.data[0] = subcmd;
+  CAN.tryWrite(canFrame);
+}
+
+// true, wenn canFrame ein BTLDR_ANSWER ohne Response-Bit erhalten hat
+static bool btldrRead() {
+  if (!CAN.tryRead(canFrame))
+    return false;
+  return ((uint8_t)(canFrame.id >> 17) == BTLDR_ANSWER) && !bitRead(canFrame.id, 16);
+}
+
 void setup()
 {
   // Fllen der Puffer mit definierten Werten 
@@ -49,16 +74,9 @@ void setup()
   MCUCR = temp | (1 << IVSEL);
   SREG = sregtemp;
   //Set CAN speed. Note: Speed is now 500kbit/s so adjust your CAN monitor
-  CANBase.begin(CAN_BPS_250K);
-  _delay_ms(5*wait_time);  // Delay added just so we can have time to open up //serial Monitor and CAN bus monitor. It can be removed later...
-  hash = generateHash(UID_BASE);
-  sei();
-  canFrame.cmd = BTLDR_ANSWER;
-  canFrame.data[0] = START_DATA;
-  canFrame.hash = hash;
-  canFrame.resp_bit = true;
-  canFrame.length = 1;
-  sendCanFrame(canFrame);
+  CAN.begin(MCP2515_BITRATE);
+  sei();
+  btldrAnswer(START_DATA);
   _delay_ms(2*wait_time);  // Delay added just so we can have time to open up //serial Monitor and CAN bus monitor. It can be removed later...
 }
 
@@ -105,35 +123,25 @@ static uint8_t can_getc() {
     return((uint8_t) hex_data[act_dataPtr-1]);
   }
   // Mehr Daten anfordern
-  // cmd und data[0] sind vom Eingang noch besetzt
-  // canFrame.cmd = BTLDR_ANSWER;
-  canFrame.data[0] = MORE_DATA;
-  canFrame.hash = hash;
-  canFrame.resp_bit = true;
-  canFrame.length = 1;
-  sendCanFrame(canFrame);
+  btldrAnswer(MORE_DATA);
   do 
   {
-    if (CANBase.available()){
-      canFrame = getCanFrame();
-      // neue Daten ?
-      if ((canFrame.cmd == BTLDR_ANSWER) &&
-         (canFrame.resp_bit == false)){
-        noDATA = false;
-        if(canFrame.data[0] == MORE_DATA) {
-          // Lnge - subcmd - ein hiermit bermitteltes Datum
-          max_act_dataPtr = canFrame.length-2;
-          for (uint8_t i=0; i<=max_act_dataPtr; i++)
-          {
-            hex_data[i] = canFrame.data[i+1];
-          }
-          // 0: subcmd, 1: das hiermit bermitteltes Datum, 2: das nchste Datum
-          act_dataPtr = 1;
-        }
-        if (canFrame.data[0] == END_DATA) {
-          // keine Daten mehr
-          parser_state = PARSER_STATE_FINISH;
+    // neue Daten ?
+    if (btldrRead()){
+      noDATA = false;
+      if(canFrame.data[0] == MORE_DATA) {
+        // Lnge - subcmd - ein hiermit bermitteltes Datum
+        max_act_dataPtr = canFrame.length-2;
+        for (uint8_t i=0; i<=max_act_dataPtr; i++)
+        {
+          hex_data[i] = canFrame.data[i+1];
         }
+        // 0: subcmd, 1: das hiermit bermitteltes Datum, 2: das nchste Datum
+        act_dataPtr = 1;
+      }
+      if (canFrame.data[0] == END_DATA) {
+        // keine Daten mehr
+        parser_state = PARSER_STATE_FINISH;
       }
     }      
   } while (noDATA);
@@ -1,2 +1,24 @@
 #pragma once
 //#define hex2usb
+// SLCAN (Lawicel) fuer slcand/can-utils statt des eigenen Protokolls, siehe ownSlcan.h
+//#define slcan
+#ifdef slcan
+// Zeitstempel fuer "Z1" beim Abholen aus dem MCP2515, nicht erst beim Senden
+#define CAN_RX_STAMPS
+#endif
+// Binaermitschnitt aller Frames fuer u2clink statt der Textausgabe, siehe LINK_CAPTURE in ownCAN.h
+//#define capture
+#ifdef capture
+#define CAN_RX_STAMPS
+#define CAN_STAMP_TIMER1
+#define CAN_RX_RING_SIZE 32
+#define UART_TX_SIZE 128
+#endif
+// Busstatistik im Sekundentakt statt der Textausgabe, siehe ownStats.h
+//#define busstats
+#ifdef busstats
+#define CAN_RX_STAMPS
+#define CAN_STAMP_TIMER1
+#define CAN_RX_RING_SIZE 16
+#define UART_TX_SIZE 128
+#endif
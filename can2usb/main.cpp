@@ -31,30 +31,38 @@
 #include <inttypes.h>
 
 #include "ownCAN.h"
+#include "ownLink.h"
+#include "ownSlcan.h"
+#include "ownStats.h"
+#include "ownUART.h"
 #include "CAN.h"
 #include "SPI.h" // required to resolve #define conflicts
 
 #define VERS_HIGH     0x00  // Versionsnummer vor dem Punkt
 #define VERS_LOW      0x02  // Versionsnummer nach dem Punkt
 
-void processRXFrame();
+void localAppCommand();
 void printFrame();
-void sendConfig(int index);
+void captureRun();
 
 uint32_t UID;
 
 // EEPROM-Adressen
 #define  setup_done 0x047
-const uint8_t adr_setup_done = 0x00;
-
-const uint8_t adr_HiByte = 0x01;
-const uint8_t adr_LoByte = 0x02;
-
-// config-Daten
-#define CONFIG_NUM 1     // Anzahl der Konfigurationspunkte
-int config_index = 0;
-bool config_request = false;
-bool uid_request;
+// adr_setup_done, adr_HiByte und adr_LoByte siehe ownCAN.h
+
+// empfangene Befehle und ihre Handler; angezeigt werden alle Frames
+const canCommand commands[] PROGMEM = {
+  {PING,          false, pingAnswer},
+  {CONFIG_Status, false, configRequest},
+  {FOR_DIAG,      false, diagAnswer},
+  {FOR_APP,       false, localAppCommand}
+};
+// CONFIG_Status: nur Kanal 0
+const char deviceName[] PROGMEM = "Monitor";
+const canNode node PROGMEM = {commands, CAN_COMMAND_COUNT(commands), VERS_HIGH, VERS_LOW,
+  DEVTYPE_CAN2USB, I_am_a_can2usb, UID_BASE, 99, 0, 0, 0,
+  deviceName, 0, 0};
 
 void setup()
 {
@@ -78,145 +86,144 @@ void setup()
     CAN.params.HiByteAddress = eeprom_read_byte(( uint8_t *) adr_HiByte);
     CAN.params.LoByteAddress = eeprom_read_byte(( uint8_t *) adr_LoByte);
   }  
-  //Set CAN speed. Note: Speed is now 250kbit/s so adjust your CAN monitor
-  CAN.begin(CAN_BPS_250K);
-  _delay_ms(500);  // Delay added just so we can have time to open up //serial Monitor and CAN bus monitor. It can be removed later...
+  CAN.params.moduladr = ( uint8_t ) ((CAN.params.HiByteAddress - '0')*10 + CAN.params.LoByteAddress - '0');
+  //Set CAN speed: the first of MCP2515_AUTOBAUD_RATES that fits the bus, normally 250kbit/s
+#ifdef busstats
+  // die Bitrate braucht die Statistik fuer die Buslast
+  uint32_t bitrate = CAN.beginAuto(MCP2515_MODE_NORMAL, MCP2515_OPT_RXRING | MCP2515_OPT_TXQUEUE | MCP2515_OPT_ROLLOVER);
+  attachCanInterrupt();
+#elif defined(capture)
+  // INT0 leert den MCP2515 in den Ring und stempelt jeden Frame
+  CAN.beginAuto(MCP2515_MODE_NORMAL, MCP2515_OPT_RXRING | MCP2515_OPT_TXQUEUE | MCP2515_OPT_ROLLOVER);
+  attachCanInterrupt();
+#else
+  CAN.beginAuto(MCP2515_MODE_NORMAL, MCP2515_OPT_TXQUEUE | MCP2515_OPT_ROLLOVER);
+#endif
   UID = generateUID(UID_BASE, &CAN.params);
-  _delay_ms(2*wait_time);  // Delay added just so we can have time to open up
   CAN.hash = generateHash(UID+99);
-  //
-  Serial.begin(baudrate);
-  Serial.println("--------------------------------------");
-  Serial.println("CAN Monitor-Interface");
-  Serial.println("--------------------------------------");
-  Serial.println("100 Ready");
+#ifdef slcan
+  // Adapter fuer slcand/can-utils, siehe ownSlcan.h
+  slcanBegin(&node);
+#elif defined(capture)
+  // Binaerframes fuer u2clink, siehe LINK_CAPTURE in ownCAN.h
+  linkBegin(capturebaudrate);
+#elif defined(busstats)
+  // Zusammenfassung im Sekundentakt, siehe ownStats.h
+  statsBegin(&node, bitrate);
+#else
+  // ownUART statt Serial: beide belegen die USART-Interrupts
+  uartBegin(baudrate, 0);
+  uartPrint("--------------------------------------\r\n");
+  uartPrint("CAN Monitor-Interface\r\n");
+  uartPrint("--------------------------------------\r\n");
+  uartPrint("100 Ready\r\n");
+#endif
 }
 
 // Test rapid fire ping/pong of extended frames
 void loop()
 {
-  if (CAN.available())
+#ifdef slcan
+  slcanRun();
+  return;
+#endif
+#ifdef capture
+  captureRun();
+  runCanWork();
+  return;
+#endif
+#ifdef busstats
+  statsRun();
+  runCanWork();
+  return;
+#endif
+  // ohne INT0: Sendeschlange hier nachfuellen
+  CAN.handleInterrupt();
+  if (getCanFrame(CAN.incomingMsg))
   {
     // Process
-    processRXFrame();
-  }
-  if (config_request) {
-    config_request = false;
-    sendConfig(config_index);
+    dispatchCanFrame(&node);
+    printFrame();
   }
+  // aufgeschobene Arbeit, EEPROM-Bytes
+  runCanWork();
 }
 
-void boardnumAnswer(){
-  CAN.outgoingMsg.data[0] = BOARDNUM_ANSWER;
-  CAN.outgoingMsg.data[1] = CAN.params.HiByteAddress;
-  CAN.outgoingMsg.data[2] = CAN.params.LoByteAddress;
-  what_is_your_name(I_am_a_NanoApp, 3, &CAN.outgoingMsg);
-  CAN.can_answer(6);
+// FOR_APP: in den Bootloader geht can2usb nicht
+void localAppCommand(){
+  if (CAN.incomingMsg.data[0] != GO_BTLDR)
+    runAppCommand();
+}
+
+#ifdef capture
+static uint16_t seenRxOverruns, seenHwOverruns;
+
+static void putLE(uint8_t *p, uint32_t value, uint8_t bytes){
+  while (bytes--) {
+    *p++ = (uint8_t) value;
+    value >>= 8;
+  }
 }
 
 /*
-   Ausfhren, wenn eine Nachricht verfgbar ist.
-   Nachricht wird geladen und anhngig vom CAN-Befehl verarbeitet.
+ Mitschnitt: ein Frame holt captureRun() erst aus dem Ring, wenn der
+ laengste LINK_CAPTURE in den Sendering passt. Staut sich der Ring, zaehlt
+ der Treiber die verlorenen Frames; LINK_LOST meldet sie dem PC, bevor der
+ naechste Frame hinausgeht, so sieht u2clink die Luecke an der richtigen
+ Stelle.
 */
-void processRXFrame()
-{
-  CAN.incomingMsg = getCanFrame();
-  if (CAN.incomingMsg.resp_bit == false)
-  {
-    switch (CAN.incomingMsg.cmd)
-    {
-      case PING:
-      CAN.outgoingMsg.cmd = PING;
-      for (uint8_t i = 0; i < 4; i++) {
-        CAN.outgoingMsg.data[i] = CAN.params.uid_device[i];
-      }
-      CAN.outgoingMsg.data[4] = VERS_HIGH;
-      CAN.outgoingMsg.data[5] = VERS_LOW;
-      CAN.outgoingMsg.data[6] = DEVTYPE_CAN2USB >> 8;
-      CAN.outgoingMsg.data[7] = DEVTYPE_CAN2USB;
-      CAN.can_answer(8);
-      break;
-      // config
-      case CONFIG_Status:
-      uid_request = true;
-      for (uint8_t i=0; i<uid_num; i++)
-      uid_request = uid_request && (CAN.params.uid_device[i] == CAN.incomingMsg.data[i]);
-      if (uid_request==true) {
-        config_request = true;
-        config_index = CAN.incomingMsg.data[4];
-      }
-      break;
-      // alle Auftrge von usb2can abarbeiten
-      case FOR_APP:
-      CAN.outgoingMsg.data[0] = 'a';
-      if ((CAN.incomingMsg.data[1] == CAN.params.HiByteAddress) &&
-      (CAN.incomingMsg.data[2] == CAN.params.LoByteAddress)) {
-        CAN.outgoingMsg.cmd = APP_ANSWER;
-        switch (CAN.incomingMsg.data[0])
-        {
-//          case GO_BTLDR:
-//          goIntoBootloader();
-//          break;
-          case BOARDNUM_REQUEST:
-          boardnumAnswer();
-          break;
-          case BOARDNUM_CHANGE:
-          // Reihenfolge wichtig, damit mit der alten Boardnum geantwortet wird
-          boardnumAnswer();
-          eeprom_update_byte(( uint8_t *) adr_HiByte, CAN.incomingMsg.data[3]);
-          eeprom_update_byte(( uint8_t *) adr_LoByte, CAN.incomingMsg.data[4]);
-          CAN.params.HiByteAddress = eeprom_read_byte(( uint8_t *) adr_HiByte);
-          CAN.params.LoByteAddress = eeprom_read_byte(( uint8_t *) adr_LoByte);
-          UID = generateUID(UID_BASE, &CAN.params);
-          CAN.hash = generateHash(UID+99);
-          break;
-        }
-      }
-      break;
-    }
-  }
-  printFrame();
+void captureRun(){
+  uint8_t rec[LINK_MAX_SEND];
+  uint16_t rxLost, hwLost;
+  uint32_t id;
+
+  if (linkAvailable()) {
+    if (linkFrame[0] == LINK_HELLO)
+      linkSend(LINK_READY, 0, 0);
+    linkRelease();
+  }
+  rxLost = CAN.stats.rxOverruns - seenRxOverruns;
+  hwLost = CAN.stats.hwOverruns - seenHwOverruns;
+  if (rxLost || hwLost) {
+    putLE(rec, canTime(), 4);
+    putLE(&rec[4], rxLost, 2);
+    putLE(&rec[6], hwLost, 2);
+    if (!linkSend(LINK_LOST, rec, 8))
+      return;
+    seenRxOverruns += rxLost;
+    seenHwOverruns += hwLost;
+  }
+  while (uartTxFree() >= LINK_FRAME_BYTES(LINK_MAX_SEND) && getCanFrame(CAN.incomingMsg)) {
+    id = CAN.incomingMsg.id;
+    if (CAN.incomingMsg.extended)
+      id |= 0x80000000UL;
+    if (CAN.incomingMsg.rtr)
+      id |= 0x40000000UL;
+    putLE(rec, CAN.rxStamp, 4);
+    putLE(&rec[4], id, 4);
+    rec[8] = CAN.incomingMsg.length;
+    memcpy(&rec[9], CAN.incomingMsg.data, CAN.incomingMsg.length);
+    linkSend(LINK_CAPTURE, rec, 9 + CAN.incomingMsg.length);
+    dispatchCanFrame(&node);
+  }
 }
+#endif
 
 void printFrame(){
-  char charVal[5];
-  sprintf(charVal, "%04X", CAN.incomingMsg.hash);
-  Serial.print(charVal);
-  Serial.print(" ");
-  sprintf(charVal, "%02X", CAN.incomingMsg.cmd);
-  Serial.print(charVal);
-  Serial.print(" ");
+  uartHex(CAN.incomingMsg.hash, 4);
+  uartWrite(' ');
+  uartHex(CAN.incomingMsg.cmd, 2);
+  uartWrite(' ');
   if (CAN.incomingMsg.resp_bit==true)
-    Serial.print("R ");
+    uartPrint("R ");
   else
-    Serial.print("  ");
-  sprintf(charVal, "%02X", CAN.incomingMsg.length);
-  Serial.print(charVal);
-  Serial.print(" ");
+    uartPrint("  ");
+  uartHex(CAN.incomingMsg.length, 2);
+  uartWrite(' ');
   for (byte i=0; i<CAN.incomingMsg.length; i++)
   {
-    sprintf(charVal, "%02X", CAN.incomingMsg.data[i]);
-    Serial.print(charVal);
-    Serial.print(" ");
+    uartHex(CAN.incomingMsg.data[i], 2);
+    uartWrite(' ');
   }
-  Serial.println();
-}
-
-void sendConfig(int index) {
-  uint8_t config_len[] = {4, 5, 5};
-  uint8_t config_frames[][5][8] = {{
-    {CONFIG_NUM-1, 1, 0, 0, 0, 0, 0, ( uint8_t ) ((CAN.params.HiByteAddress - '0')*10 + CAN.params.LoByteAddress - '0')},
-    {( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[0])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[0])),
-      ( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[1])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[1])),
-      ( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[2])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[2])),
-    ( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[3])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[3]))},
-    {'C', 'A', 'N', 'g', 'u', 'r', 'u', ' '},
-    {'M', 'o', 'n','i', 't', 'o', 'r', 0}
-    }
-};
-
-for (int i = 0; i < config_len[index]; i++) {
-  CAN.configDataFrame(config_frames[index][i], i);
-}
-CAN.configTerminator(index, config_len[index]);
+  uartPrint("\r\n");
 }
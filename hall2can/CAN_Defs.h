@@ -1,2 +1,6 @@
 #pragma once
 //#define hex2usb
+// Schlafmodus mit sleepCanNode()
+#define CAN_SLEEP
+// canTime() zaehlt den Power-down mit, fuer die Zeit im S88_EVENT
+#define CAN_SLEEP_CLOCK
@@ -26,6 +26,7 @@
 #include <util/delay.h>
 #include <inttypes.h>
 #include <avr/eeprom.h>
+#include <avr/sleep.h>
 
 #include "ownCAN.h"
 #include "CAN.h"
@@ -44,24 +45,32 @@
 
 #define setup_done 0x047
 
-const uint8_t adr_setup_done  = 0x00;
-const uint8_t adr_HiByte      = 0x01;
-const uint8_t adr_LoByte      = 0x02;
+// adr_setup_done, adr_HiByte und adr_LoByte siehe ownCAN.h
 const uint8_t adr_offset      = 0x03;
 const uint8_t adr_modulcount  = 0x04;
 const uint8_t adr_status      = 0x05;
 
 bool gotInput=false;
+// micros() der letzten Flanke an INT1
+volatile uint16_t inputEdge;
+// canTime() der letzten Flanke an INT1
+volatile uint32_t inputStamp;
+// Kontakt, dessen nchste Meldung in TXB0 vorgeladen werden soll; 0 = keiner
+uint8_t armNum = 0;
 uint8_t offset = 0;
 const uint8_t maxoffset = 4;
 
-void processInt0();
+void setChannel(uint8_t channel, uint8_t value);
+void s88Polling();
+void s88Event();
 void processInt1();
-void boardnumAnswer();
+void armInt1();
 void send_sensor_event(uint8_t address, uint8_t value);
+void fill_sensor_event(uint8_t address, uint8_t value, uint16_t time);
+uint16_t contactTime(uint8_t num, uint32_t at);
+void ageContacts();
 void PCF_Init();
 uint8_t PCF_Read(int adr);
-void sendConfig(int index);
 
 // adjust addresses if needed
 const int PCF_base_adrs = 0x38;
@@ -78,16 +87,44 @@ typedef struct __attribute__((__packed__))
 PCFdatastruct PCF[maxmodulcount];
 
 uint8_t status[inp_per_module*maxmodulcount];
-
-// config-Daten
-#define CONFIG_NUM 4     // Anzahl der Konfigurationspunkte
-int config_index = 0;
-bool uid_request;
+// canTime() des letzten Wechsels je Kontakt, fuer die Zeit im S88_EVENT
+uint32_t lastChange[inp_per_module*maxmodulcount + 1];
+// 0xFFFF 10-ms-Schritte, mehr meldet contactTime() nicht
+#define CONTACT_TIME_MAX  (0xFFFFUL * 10000)
 
 #define VERS_HIGH     0x00  // Versionsnummer vor dem Punkt
 #define VERS_LOW      0x05  // Versionsnummer nach dem Punkt
 
 uint32_t UID;
+// nur diese Befehle werden vom MCP2515 durchgelassen
+const uint8_t rx_cmds[] = {SYS_CMD, PING, CONFIG_Status, FOR_APP, FOR_DIAG, S88_Polling, S88_EVENT};
+
+// empfangene Befehle und ihre Handler
+const canCommand commands[] PROGMEM = {
+  {SYS_CMD,       false, sysCommand},
+  {PING,          false, pingAnswer},
+  {CONFIG_Status, false, configRequest},
+  {S88_Polling,   false, s88Polling},
+  {S88_EVENT,     false, s88Event},
+  {FOR_DIAG,      false, diagAnswer},
+  {FOR_APP,       false, appCommand}
+};
+// CONFIG_Status: Kanle wie bei SYS_STAT
+const char deviceName[] PROGMEM = "R\xc3\xbc" "ckmelder";
+const char modulcountText[] PROGMEM = "Anzahl Expander";
+const char modulcountUnit[] PROGMEM = "Stk";
+const char offsetText[] PROGMEM = "Nummer R\xc3\xbc" "ckmelder";
+const char offsetUnit[] PROGMEM = "Num";
+const canConfigChannel config[] PROGMEM = {
+  {CONFIG_VALUE, 1, maxmodulcount, &modulcount, modulcountText, modulcountUnit},
+  {CONFIG_VALUE, 0, maxoffset, &offset, offsetText, offsetUnit},
+  CONFIG_ADDRESS,
+  CONFIG_RESTART
+};
+// SYS_STAT: Kanal 1 Modulanzahl, 2 Offset, 3 Moduladresse, 4 Neustart
+const canNode node PROGMEM = {commands, CAN_COMMAND_COUNT(commands), VERS_HIGH, VERS_LOW,
+  DEVTYPE_RM, I_am_a_hall2can, UID_BASE, 0, 3, 4, setChannel,
+  deviceName, config, CAN_CONFIG_COUNT(config)};
 
 void setup()
 {
@@ -134,18 +171,28 @@ void setup()
   if (offset>maxoffset)
     offset = 0;
   UID = generateUID(UID_BASE, &CAN.params);
-  CAN.begin(CAN_BPS_250K);
-  _delay_ms(2*wait_time);  // Delay added just so we can have time to open up
-  //serial Monitor and CAN bus monitor. It can be removed later...
+  CAN.beginAuto(MCP2515_MODE_NORMAL, MCP2515_OPT_RXRING | MCP2515_OPT_TXQUEUE | MCP2515_OPT_ROLLOVER);
+  CAN.acceptCommands(rx_cmds, sizeof(rx_cmds), false);
   CAN.hash = generateHash(UID);
-  pinMode(PIN_INT0, INPUT_PULLUP);
-  attachInterrupt(digitalPinToInterrupt(PIN_INT0), processInt0, LOW);
+  attachCanInterrupt();
   //
   PCF_Init();
 }
 
 // Test rapid fire ping/pong of extended frames
 void loop() {
+  // empfangene Frames abarbeiten
+  while (getCanFrame(CAN.incomingMsg))
+    dispatchCanFrame(&node);
+  // aufgeschobene Arbeit, EEPROM-Bytes
+  runCanWork();
+  ageContacts();
+  // wahrscheinlichste nchste Meldung vorladen, sobald TXB0 frei ist
+  if (armNum != 0) {
+    fill_sensor_event(armNum, status[armNum] ^ 1, contactTime(armNum, canTime()));
+    if (CAN.arm_answer(8))
+      armNum = 0;
+  }
 // nur bei Interrupt1
   if (gotInput==true) {
     for (uint8_t j = 0; j < modulcount; j++) {
@@ -165,8 +212,13 @@ void loop() {
               status[num] = 0;
             else
               status[num] = 1;
-            eeprom_update_byte (( uint8_t *) adr_status+num, status[num]);
-            send_sensor_event(num, status[num]);
+            deferEepromByte(adr_status+num, status[num]);
+            // war die Meldung vorgeladen, schreibt fire_answer() nur noch die
+            // Zeit in data[6..7] und sendet RTS
+            fill_sensor_event(num, status[num], contactTime(num, inputStamp));
+            lastChange[num] = inputStamp;
+            CAN.fire_answer(8, inputEdge, 2);
+            armNum = num;
           }
           Wire.beginTransmission(PCF[j].address);
           Wire.write(0xFF);
@@ -175,15 +227,22 @@ void loop() {
         mask <<= 1;
       }
     }
-    gotInput=false;
-    _delay_ms(2*wait_time);  // Delay added just so we can have time to open up
-    attachInterrupt(digitalPinToInterrupt(PIN_INT1), processInt1, CHANGE);
+    gotInput=false;
+    // Kontakte entprellen: INT1 erst nach 2*wait_time wieder, CAN luft weiter
+    deferCanWork(armInt1, 2*wait_time);
   }
+  // nichts mehr zu tun: schlafen bis zum nchsten Interrupt
+  noInterrupts();
+  if (gotInput)
+    interrupts();
+  else
+    sleepCanNode(SLEEP_MODE_PWR_DOWN);
 }
 
 void PCF_Init() {
   pinMode(PIN_INT1, INPUT_PULLUP);
-  attachInterrupt(digitalPinToInterrupt(PIN_INT1), processInt1, CHANGE);
+  // der PCF8574 hlt INT bis zum Lesen auf LOW; nur LOW weckt aus dem Power-down
+  attachInterrupt(digitalPinToInterrupt(PIN_INT1), processInt1, LOW);
   /* PCF class */
   Wire.begin();
   for (uint8_t j = 0; j < modulcount; j++) {
@@ -194,8 +253,9 @@ void PCF_Init() {
       PCF[j].sensors[i] = 1;
       // aktuellen status an zentrale melden
       uint8_t num =j * inp_per_module + i;
+      // nur warten, wenn die Sendeschlange voll ist
+      waitCanTx(S88_EVENT);
       send_sensor_event(num, status[num]);
-      _delay_ms(wait_time);  // Delay added just so we can have time to open up
       }
     Wire.beginTransmission(PCF[j].address);
     Wire.write(0xFF);
@@ -220,6 +280,13 @@ uint8_t PCF_Read(int adr){
 }
 
 void send_sensor_event(uint8_t address, uint8_t value)
+{
+  // Zeit unbekannt
+  fill_sensor_event(address, value, 0);
+  CAN.can_answer(8);
+}
+
+void fill_sensor_event(uint8_t address, uint8_t value, uint16_t time)
 {
   CAN.outgoingMsg.cmd = S88_EVENT;
   // Gertekenner
@@ -246,224 +313,93 @@ void send_sensor_event(uint8_t address, uint8_t value)
     // neu
     CAN.outgoingMsg.data[5] = 0;
   }
-  // Zeit
-  CAN.outgoingMsg.data[6] = 0;
-  CAN.outgoingMsg.data[7] = 0;
-  CAN.can_answer(8);
+  // Zeit im alten Zustand, in 10 ms
+  CAN.outgoingMsg.data[6] = time >> 8;
+  CAN.outgoingMsg.data[7] = time;
+}
+
+// 10-ms-Schritte vom letzten Wechsel des Kontakts bis at, hoechstens 0xFFFF
+uint16_t contactTime(uint8_t num, uint32_t at)
+{
+  uint32_t t = (at - lastChange[num]) / 10000;
+  if (t > 0xFFFF)
+    t = 0xFFFF;
+  return t;
+}
+
+// canTime() laeuft nach gut 71 Minuten ueber, danach waere die Zeit eines
+// so lange unveraenderten Kontakts wieder klein. Je Durchlauf von loop()
+// wird darum ein Kontakt, der laenger als CONTACT_TIME_MAX unveraendert
+// ist, auf diese Grenze nachgezogen; contactTime() bleibt dann bei 0xFFFF.
+void ageContacts()
+{
+  static uint8_t num = 0;
+  uint32_t now = canTime();
+  if (now - lastChange[num] > CONTACT_TIME_MAX)
+    lastChange[num] = now - CONTACT_TIME_MAX;
+  if (++num > inp_per_module*maxmodulcount)
+    num = 0;
 }
 
-/*
-   Ausfhren, wenn eine Nachricht verfgbar ist.
-   Nachricht wird geladen und anhngig vom CAN-Befehl verarbeitet.
-*/
-//Interrupt Service Routine for INT0
-void processInt0()
+// SYS_STAT Kanal 1: Modulanzahl, Kanal 2: Offset
+void setChannel(uint8_t channel, uint8_t value)
 {
-  CAN.incomingMsg = getCanFrame();
-  if (CAN.incomingMsg.resp_bit == false)
+  switch (channel)
   {
-    switch (CAN.incomingMsg.cmd)
-    {
-      case SYS_CMD:
-      uid_request = true;
-      for (uint8_t i=0; i<uid_num; i++)
-      uid_request = uid_request && (CAN.params.uid_device[i] == CAN.incomingMsg.data[i]);
-      if (uid_request==true &&
-      CAN.incomingMsg.data[4]==SYS_STAT) {
-        switch (CAN.incomingMsg.data[5])
-        {
-          // Kanalnummer #1
-          case 1:
-            modulcount = CAN.incomingMsg.data[6]*16+CAN.incomingMsg.data[7];
-            // speichert die Anzahl der Module
-            eeprom_update_byte (( uint8_t *) adr_modulcount, modulcount);
-            break;
-          // Kanalnummer #2
-          case 2:
-            offset = CAN.incomingMsg.data[6]*16+CAN.incomingMsg.data[7];
-            // speichert die Anzahl der Rckmelder
-            eeprom_update_byte (( uint8_t *) adr_offset, offset);
-          break;
-          // Kanalnummer #3
-          case 3:
-            CAN.params.moduladr = CAN.incomingMsg.data[6]*16+CAN.incomingMsg.data[7];
-            // speichert die neue Adresse
-            CAN.params.LoByteAddress = (uint8_t)CAN.incomingMsg.data[7]+'0';
-            CAN.params.HiByteAddress = (uint8_t)CAN.incomingMsg.data[6]+'0';
-            eeprom_update_byte (( uint8_t *) adr_HiByte, CAN.params.HiByteAddress);
-            eeprom_update_byte (( uint8_t *) adr_LoByte, CAN.params.LoByteAddress);
-          // Kanalnummer #4
-          case 4:
-            switch (CAN.incomingMsg.data[7])
-            {
-            case 0:
-            // do nothing
-            break;
-            case 1:
-              // Restart, Werte bleiben erhalten
-             // Antworten
-              CAN.outgoingMsg = CAN.incomingMsg;
-              CAN.outgoingMsg.data[6] = 0x01;
-              CAN.can_answer(7);
-              _delay_ms(3*wait_time);  // Delay added just so we can have time to open up
-              // jumping to restart
-              goto*0x0000;
-            break;
-            case 2:
-              // Restart, Werte werden zurckgesetzt
-              // Antworten
-              CAN.outgoingMsg = CAN.incomingMsg;
-              CAN.outgoingMsg.data[6] = 0x01;
-              CAN.can_answer(7);
-              _delay_ms(3*wait_time);  // Delay added just so we can have time to open up
-              // setup_done auf "FALSE" setzen
-              eeprom_update_byte (( uint8_t *) adr_setup_done, 0xFF);
-              // jumping to restart
-              goto*0x0000;
-            break;
-            }
-          break;
-        }
-        // Antworten
-        CAN.outgoingMsg = CAN.incomingMsg;
-        CAN.outgoingMsg.data[6] = 0x01;
-        CAN.can_answer(7);
-      }
+    case 1:
+      modulcount = value;
+      // speichert die Anzahl der Module
+      deferEepromByte(adr_modulcount, modulcount);
       break;
-      // PING-Abfragen beantworten
-      case PING:
-      CAN.outgoingMsg.cmd = PING;
-      // what_is_your_name(I_am_a_NanoApp, 0, &CAN.outgoingMsg);
-      for (uint8_t i = 0; i < 4; i++) {
-        CAN.outgoingMsg.data[i] = CAN.params.uid_device[i];
-      }
-      CAN.outgoingMsg.data[4] = VERS_HIGH;
-      CAN.outgoingMsg.data[5] = VERS_LOW;
-      CAN.outgoingMsg.data[6] = DEVTYPE_RM >> 8;
-      CAN.outgoingMsg.data[7] = DEVTYPE_RM;
-      CAN.can_answer(8);
+    case 2:
+      offset = value;
+      // speichert die Anzahl der Rckmelder
+      deferEepromByte(adr_offset, offset);
       break;
-      // config
-      case CONFIG_Status:
-      uid_request = true;
-      for (uint8_t i=0; i<uid_num; i++)
-      uid_request = uid_request && (CAN.params.uid_device[i] == CAN.incomingMsg.data[i]);
-      if (uid_request==true) {
-        config_index = CAN.incomingMsg.data[4];
-        // Konfiguration kann nicht wie sonst in loop gesendet
-        // werden, da evtl. keine PCF angeschlossen sind und
-        // dann die loop nicht durchlaufen wird. Aber der interrupt 0
-        // funktioniert immer
-        sendConfig(config_index);
-      }
-     break;
-      // S88_Polling-Abfragen beantworten
-      case S88_Polling:
-      // CMD  DLC  0   1   2   3   4
-      // 10   5    Gerte UID      Modul-
-      //           High        Low anzahl
-      // 10   5    01  02  03  04  00
-        CAN.outgoingMsg.cmd = S88_Polling;
-        for (uint8_t i=1; i<= inp_per_module; i++)
-          send_sensor_event(i,0);
-        break;
-      case S88_EVENT:
-      // CMD  DLC  0   1   2   3
-      // 11   4    Gerte UID
-      //           High        Low
-        CAN.outgoingMsg.cmd = S88_EVENT;
-        CAN.outgoingMsg.data[0] = CAN.incomingMsg.data[0];
-        CAN.outgoingMsg.data[1] = CAN.incomingMsg.data[1];
-        CAN.outgoingMsg.data[2] = CAN.incomingMsg.data[2];
-        CAN.outgoingMsg.data[3] = CAN.incomingMsg.data[3];
-        CAN.outgoingMsg.data[4] = 0;
-        CAN.outgoingMsg.data[5] = 0;
-        CAN.outgoingMsg.data[6] = 0;
-        CAN.outgoingMsg.data[7] = 0;
-        CAN.can_answer(8);
-        break;
-      // alle Auftrge von usb2can abarbeiten
-      case FOR_APP:
-        if ((CAN.incomingMsg.data[1] == CAN.params.HiByteAddress) &&
-            (CAN.incomingMsg.data[2] == CAN.params.LoByteAddress)) {
-          CAN.outgoingMsg.cmd = APP_ANSWER;
-          switch (CAN.incomingMsg.data[0])
-          {
-            case GO_BTLDR:
-              // setup_done auf "FALSE" setzen
-              eeprom_update_byte (( uint8_t *) adr_setup_done, 0xFF);
-              goIntoBootloader();
-              break;
-            case BOARDNUM_REQUEST:
-              boardnumAnswer();
-              break;
-            case BOARDNUM_CHANGE:
-              // Reihenfolge wichtig, damit mit der alten Boardnum geantwortet wird
-              boardnumAnswer();
-              eeprom_update_byte(( uint8_t *) adr_HiByte, CAN.incomingMsg.data[3]);
-              eeprom_update_byte(( uint8_t *) adr_LoByte, CAN.incomingMsg.data[4]);
-              CAN.params.HiByteAddress = eeprom_read_byte(( uint8_t *) adr_HiByte);
-              CAN.params.LoByteAddress = eeprom_read_byte(( uint8_t *) adr_LoByte);
-              CAN.hash = generateHash(UID);
-              CAN.params.moduladr = ( uint8_t ) ((CAN.params.HiByteAddress - '0')*10 + CAN.params.LoByteAddress - '0');
-              break;
-          }
-        }
-        break;
-    }
   }
 }
 
-void processInt1()
+// S88_Polling-Abfragen beantworten
+void s88Polling()
 {
- gotInput=true;
- detachInterrupt(digitalPinToInterrupt(PIN_INT1));
+  // CMD  DLC  0   1   2   3   4
+  // 10   5    Gerte UID      Modul-
+  //           High        Low anzahl
+  // 10   5    01  02  03  04  00
+  CAN.outgoingMsg.cmd = S88_Polling;
+  for (uint8_t i=1; i<= inp_per_module; i++) {
+    // die Klasse von S88_EVENT fasst nur 5 Frames, wie in PCF_Init() warten
+    waitCanTx(S88_EVENT);
+    send_sensor_event(i,0);
+  }
 }
-
-void boardnumAnswer(){
-  CAN.outgoingMsg.data[0] = BOARDNUM_ANSWER;
-  CAN.outgoingMsg.data[1] = CAN.params.HiByteAddress;
-  CAN.outgoingMsg.data[2] = CAN.params.LoByteAddress;
-  what_is_your_name(I_am_a_hall2can, 3, &CAN.outgoingMsg);
-  CAN.can_answer(6);
+
+void s88Event()
+{
+  // CMD  DLC  0   1   2   3
+  // 11   4    Gerte UID
+  //           High        Low
+  CAN.outgoingMsg.cmd = S88_EVENT;
+  CAN.outgoingMsg.data[0] = CAN.incomingMsg.data[0];
+  CAN.outgoingMsg.data[1] = CAN.incomingMsg.data[1];
+  CAN.outgoingMsg.data[2] = CAN.incomingMsg.data[2];
+  CAN.outgoingMsg.data[3] = CAN.incomingMsg.data[3];
+  CAN.outgoingMsg.data[4] = 0;
+  CAN.outgoingMsg.data[5] = 0;
+  CAN.outgoingMsg.data[6] = 0;
+  CAN.outgoingMsg.data[7] = 0;
+  CAN.can_answer(8);
 }
 
-void sendConfig(int index) {
-  uint8_t config_len[] = {5, 4, 5, 4, 4};
-  uint8_t config_frames[][5][8] = {
-// #0
-    {{0, CONFIG_NUM, 0, 0, 0, 0, 0, CAN.params.moduladr},
-    {( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[0])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[0])),
-     ( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[1])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[1])),
-     ( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[2])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[2])),
-     ( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[3])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[3]))},
-    {'C', 'A', 'N', 'g', 'u', 'r', 'u', ' '},
-    {'R', 0xc3, 0xbc, 'c', 'k', 'm', 'e', 'l'},
-    {'d', 'e', 'r', 0, 0, 0, 0, 0}},
-// #1
-    {{1, 2, 0, 1, 0, maxmodulcount, 0, modulcount},
-    {'A', 'n', 'z', 'a', 'h', 'l', ' ', 'E'},
-    {'x', 'p', 'a', 'n', 'd', 'e', 'r', 0},
-    {'1', 0, maxmodulcount+'0', 0, 'S', 't', 'k', 0 }},
-// #2
-    {{2, 2, 0, 0, 0, maxoffset, 0, offset},
-    {'N', 'u', 'm', 'm', 'e', 'r', ' ', 'R'},
-    { 0xc3, 0xbc, 'c', 'k', 'm', 'e', 'l', 'd'},
-    {'e', 'r', 0, '0', 0, maxoffset+'0', 0, 'N'},
-    {'u', 'm', 0, 0, 0, 0, 0, 0 }},
-// #3
-    {{3, 2, 0, 0, 0, maxadr, 0, CAN.params.moduladr},
-    {'M', 'o', 'd', 'u', 'l', 'a', 'd', 'r'},
-    {'e', 's', 's', 'e', 0, '0', 0, (uint8_t)(maxadr/10)+'0'},
-    {maxadr-(uint8_t)(maxadr/10)*10+'0' ,0, 'A', 'd', 'r', 0, 0, 0 }},
-// #4
-    {{4, 1, 3, 0, 0, 0, 0, 0},
-    {'N', 'e', 'u', 's', 't', 'a', 'r', 't'},
-    {0, 'N', 'e', 'i', 'n', 0, 'W', 'a'},
-    {'r', 'm', 0, 'K', 'a', 'l', 't', 0}}
-   };
-  for (int i = 0; i < config_len[index]; i++) {
-    CAN.configDataFrame(config_frames[index][i], i);
-  }
-  CAN.configTerminator(index, config_len[index]);
+void armInt1()
+{
+  attachInterrupt(digitalPinToInterrupt(PIN_INT1), processInt1, LOW);
+}
+
+void processInt1()
+{
+ inputEdge = micros();
+ inputStamp = canTime();
+ gotInput=true;
+ detachInterrupt(digitalPinToInterrupt(PIN_INT1));
 }
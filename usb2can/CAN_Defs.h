@@ -1,2 +1,11 @@
 #pragma once
 //#define hex2usb
+// SLCAN (Lawicel) fuer slcand/can-utils statt des eigenen Protokolls, siehe ownSlcan.h
+//#define slcan
+#ifdef slcan
+// Zeitstempel fuer "Z1" beim Abholen aus dem MCP2515, nicht erst beim Senden
+#define CAN_RX_STAMPS
+#endif
+// Binaerframes (COBS, CRC, 500 kBaud) statt "!?=%d...#" mit 19200 Baud, siehe
+// LINK_* in ownCAN.h; erst wenn hex2usb sie spricht, bis dahin nur u2clink
+//#define binlink
@@ -31,148 +31,132 @@
 #include <inttypes.h>
 
 #include "ownCAN.h"
+#include "ownUART.h"
+#include "ownLink.h"
+#include "ownSlcan.h"
 #include "CAN.h"
 #include "SPI.h" // required to resolve #define conflicts
 
-void processRXFrame();
 void appAnswer();
+void btldrAnswer();
 void btldrRequest();
 void appRequest();
-void sendConfig(int index);
-uint8_t char2num (uint8_t ch);
-uint8_t get1byte();
+void linkCommand(const uint8_t *frame, uint8_t len);
+void linkReply(uint8_t cmd);
+#ifndef binlink
+void asciiByte(uint8_t c);
+uint8_t asciiAvailable();
+uint8_t char2num(uint8_t ch);
+#endif
 
 #define VERS_HIGH     0x00  // Versionsnummer vor dem Punkt
-#define VERS_LOW      0x03  // Versionsnummer nach dem Punkt
+#define VERS_LOW      0x04  // Versionsnummer nach dem Punkt
 
 #define waitingforSerial      0
 #define waitingforBoardNum    1
 #define waitingforNewBoardNum 2
 #define waitingforBootLoader  3
 
-char val; // Data received from the serial port
-String strDataIn;
-String strDataOut = "";
 uint8_t subCmd;
 uint8_t bnHi;
 uint8_t bnLo;
+uint8_t bnNewHi;
+uint8_t bnNewLo;
 bool bn_exists;
 bool btldr_exists;
 unsigned long previousMillis;
 unsigned long interval=500;
+#ifdef binlink
+uint16_t linkErrors;
+#else
+// ASCII-Protokoll: Empfangsring des RX-Interrupts und der Befehl bis '#'
+#define ASCII_RX_SIZE 64
+volatile uint8_t asciiRx[ASCII_RX_SIZE];
+volatile uint8_t asciiRxHead;
+uint8_t asciiRxTail;
+uint8_t asciiIn[max_char];
+uint8_t asciiLen;
+uint8_t asciiState;
+uint8_t asciiData; // Datenbytes nach "d#", die noch fehlen
+#define asciiCommand  0
+#define asciiLength   1
+#define asciiBytes    2
+#endif
 
 int processStep;
 
 uint32_t UID;
 
-// config-Daten
-#define CONFIG_NUM 0     // Anzahl der Konfigurationspunkte
-int config_index = 0;
-bool config_request = false;
-bool uid_request;
+// empfangene Befehle und ihre Handler
+const canCommand commands[] PROGMEM = {
+  {PING,          false, pingAnswer},
+  {CONFIG_Status, false, configRequest},
+  {APP_ANSWER,    true,  appAnswer},
+  {BTLDR_ANSWER,  true,  btldrAnswer}
+};
+// CONFIG_Status: nur Kanal 0
+const char deviceName[] PROGMEM = "Gateway";
+const canNode node PROGMEM = {commands, CAN_COMMAND_COUNT(commands), VERS_HIGH, VERS_LOW,
+  DEVTYPE_USB2CAN, I_am_a_usb2can, UID_BASE, 0x99, 0, 0, 0,
+  deviceName, 0, 0};
 
 void setup()
 {
-  //Set CAN speed. Note: Speed is now 250kbit/s so adjust your CAN monitor
-  CAN.begin(CAN_BPS_250K);
-  _delay_ms(500);  // Delay added just so we can have time to open up //serial Monitor and CAN bus monitor. It can be removed later...
+  //Set CAN speed: the first of MCP2515_AUTOBAUD_RATES that fits the bus, normally 250kbit/s
+  CAN.beginAuto(MCP2515_MODE_NORMAL, MCP2515_OPT_TXQUEUE | MCP2515_OPT_ROLLOVER);
   CAN.params.HiByteAddress = '0';
   CAN.params.LoByteAddress = 0x099;
+  CAN.params.moduladr = ( uint8_t ) ((CAN.params.HiByteAddress - '0')*10 + CAN.params.LoByteAddress - '0');
   UID = generateUID(UID_BASE, &CAN.params);
-  _delay_ms(2*wait_time);  // Delay added just so we can have time to open up
-  CAN.hash = generateHash(UID+CAN.params.LoByteAddress);
-  //initialize serial communications at a 19200 baud rate
-  Serial.begin(baudrate);
-  strDataIn = "";
+  CAN.hash = CAN_HASH(CAN_UID(UID_BASE, '0', 0x099) + 0x099);
+#ifdef slcan
+  // Adapter fuer slcand/can-utils, siehe ownSlcan.h
+  slcanBegin(&node);
+#elif defined(binlink)
+  // Binaerframes mit hex2usb, siehe LINK_* in ownCAN.h
+  linkBegin(linkbaudrate);
+#else
+  // "!?=%d...#" wie bisher mit 19200 Baud, siehe asciiAvailable()
+  uartBegin(baudrate, asciiByte);
+#endif
   processStep = waitingforSerial;
 }
 
-// Test rapid fire ping/pong of extended frames
 void loop()
 {
-  if (config_request) {
-    config_request = false;
-    sendConfig(config_index);
-  }
+  uint8_t len;
+
+#ifdef slcan
+  slcanRun();
+  return;
+#endif
+  // ohne INT0: Sendeschlange hier nachfuellen
+  CAN.handleInterrupt();
   switch (processStep)
   {
     case waitingforSerial:
-    if (Serial.available() > 0) { // If data is available to read,
-      val = Serial.read(); // read it and store it in val
-      if (val!=limiter)
-       strDataIn += val;
-      else
-      switch (strDataIn.charAt(0))
-      {
-        case '!':
-        // CMD: '!' Kontakt mit hex2usb herstellen; fr Portnummer
-          Serial.print("$#");   // send a capital $
-          Serial.flush();
-          strDataIn="";
-          break;
-        case '?':
-        // CMD: '?XY#' fragt alle Boards ab; Board mit BoardNum XY (?XY) antwortet
-         bn_exists = false;
-          subCmd = BOARDNUM_REQUEST;
-          bnHi = strDataIn.charAt(1);
-          bnLo = strDataIn.charAt(2);
-          appRequest();
-          processStep = waitingforBoardNum;
-          Serial.flush();
-          strDataIn="";
-          previousMillis = millis();
-          break;
-        case '=':
-        // CMD: '=XYAB#' ndert die Boardnummer des Boards XY in AB ab;
-          bn_exists = false;
-          subCmd = BOARDNUM_CHANGE;
-          bnHi = strDataIn.charAt(1);
-          bnLo = strDataIn.charAt(2);
-          appRequest();
-          processStep = waitingforNewBoardNum;
-          Serial.flush();
-          strDataIn="";
-          previousMillis = millis();
-          break;
-        case '%':
-        // CMD: '&XY#' schickt Board mit BoardNum XY in den Bootloaderstate
-          subCmd = GO_BTLDR;
-          bnHi = strDataIn.charAt(1);
-          bnLo = strDataIn.charAt(2);
-          appRequest();
-          processStep = waitingforBootLoader;
-          Serial.flush();
-          strDataIn="";
-          break;
-        case 'd':
-          CAN.outgoingMsg.cmd = BTLDR_ANSWER;
-          byte cnt = char2num(get1byte()); // length
-          if (cnt==0)
-            CAN.outgoingMsg.data[0] = END_DATA;
-          else
-          {
-            CAN.outgoingMsg.data[0] = MORE_DATA;
-            for (byte i=1; i<=cnt; i++){
-              CAN.outgoingMsg.data[i] = get1byte();
-            }
-          }
-          CAN.can_answer2(cnt+1,false);
-          processStep = waitingforSerial;
-          Serial.flush();
-          strDataIn="";
-          break;
-      } // switch
-    } // if
-    break; // waitingforSerial
+#ifdef binlink
+      // der RX-Interrupt hat den Frame schon zusammengesetzt und geprueft
+      len = linkAvailable();
+      if (len) {
+        linkCommand(linkFrame, len);
+        linkRelease();
+      }
+#else
+      len = asciiAvailable();
+      if (len)
+        linkCommand(asciiIn, len);
+#endif
+      break; // waitingforSerial
     case waitingforBoardNum:
     case waitingforNewBoardNum:
       if (bn_exists==true){
-        Serial.print("1#"); //send the message back
+        linkReply(LINK_YES);
         processStep = waitingforSerial;
       }
       else{
         if ((millis()-previousMillis)>interval){
-          Serial.print("0#"); //send the message back
+          linkReply(LINK_NO);
           processStep = waitingforSerial;
         }
       }
@@ -186,56 +170,178 @@ void loop()
           processStep = waitingforSerial;
         }
       }
-      break; // waitingforBoardNum
+      break; // waitingforBootLoader
   } // switch
-  delay(50);
-  if (CAN.available())
+#ifdef binlink
+  // verworfene Frames: hex2usb wiederholt den letzten Befehl
+  if (linkStats.errors != linkErrors) {
+    linkErrors = linkStats.errors;
+    linkReply(LINK_NAK);
+  }
+#endif
+  if (getCanFrame(CAN.incomingMsg))
   {
     // Process
-    processRXFrame();
+    dispatchCanFrame(&node);
   }
+  // aufgeschobene Arbeit, EEPROM-Bytes
+  runCanWork();
 }
 
-void processRXFrame()
-{
-  CAN.incomingMsg = getCanFrame();
-  if (CAN.incomingMsg.resp_bit == false)
+/*
+   ein Befehl von hex2usb: frame[0] Befehl, dahinter die Daten; die
+   Befehlszeichen sind in beiden Protokollen dieselben
+*/
+void linkCommand(const uint8_t *frame, uint8_t len) {
+  uint8_t cnt = len - 1;
+  switch (frame[0])
   {
-    switch (CAN.incomingMsg.cmd)
-    {
-      case PING:
-      CAN.outgoingMsg.cmd = PING;
-      for (uint8_t i = 0; i < 4; i++) {
-        CAN.outgoingMsg.data[i] = CAN.params.uid_device[i];
-      }
-      CAN.outgoingMsg.data[4] = VERS_HIGH;
-      CAN.outgoingMsg.data[5] = VERS_LOW;
-      CAN.outgoingMsg.data[6] = DEVTYPE_USB2CAN >> 8;
-      CAN.outgoingMsg.data[7] = DEVTYPE_USB2CAN;
-      CAN.can_answer(8);
+    case LINK_HELLO:
+    // CMD: Kontakt mit hex2usb herstellen; fuer Portnummer
+      linkReply(LINK_READY);
+      break;
+    case LINK_ASK:
+    // CMD: '?' X Y fragt alle Boards ab; Board mit BoardNum XY antwortet
+      if (cnt < 2)
+        break;
+      bn_exists = false;
+      subCmd = BOARDNUM_REQUEST;
+      bnHi = frame[1];
+      bnLo = frame[2];
+      appRequest();
+      processStep = waitingforBoardNum;
+      previousMillis = millis();
+      break;
+    case LINK_CHANGE:
+    // CMD: '=' X Y A B aendert die Boardnummer des Boards XY in AB ab
+      if (cnt < 4)
+        break;
+      bn_exists = false;
+      subCmd = BOARDNUM_CHANGE;
+      bnHi = frame[1];
+      bnLo = frame[2];
+      bnNewHi = frame[3];
+      bnNewLo = frame[4];
+      appRequest();
+      processStep = waitingforNewBoardNum;
+      previousMillis = millis();
       break;
-      // config
-      case CONFIG_Status:
-      uid_request = true;
-      for (uint8_t i=0; i<uid_num; i++)
-        uid_request = uid_request && (CAN.params.uid_device[i] == CAN.incomingMsg.data[i]);
-      if (uid_request==true) {
-        config_request = true;
-        config_index = CAN.incomingMsg.data[4];
+    case LINK_BOOT:
+    // CMD: '%' X Y schickt Board mit BoardNum XY in den Bootloaderstate
+      if (cnt < 2)
+        break;
+      btldr_exists = false;
+      subCmd = GO_BTLDR;
+      bnHi = frame[1];
+      bnLo = frame[2];
+      appRequest();
+      processStep = waitingforBootLoader;
+      previousMillis = millis();
+      break;
+    case LINK_DATA:
+    // CMD: 'd' und bis zu 7 Bytes fuer den Bootloader, ohne Bytes Ende der Daten
+      if (cnt > 7)
+        break;
+      CAN.outgoingMsg.cmd = BTLDR_ANSWER;
+      if (cnt==0)
+        CAN.outgoingMsg.data[0] = END_DATA;
+      else
+      {
+        CAN.outgoingMsg.data[0] = MORE_DATA;
+        memcpy(&CAN.outgoingMsg.data[1], &frame[1], cnt);
       }
+      CAN.can_answer2(cnt+1,false);
       break;
-    }    
-  }  
-  appAnswer();
+  } // switch
 }
 
+/*
+   Antwort an hex2usb ohne Daten; ist der Sendering voll, geht sie verloren
+   und hex2usb laeuft in sein Timeout
+*/
+void linkReply(uint8_t cmd) {
+#ifdef binlink
+  linkSend(cmd, 0, 0);
+#else
+  uartWrite(cmd);
+  uartWrite(limiter);
+#endif
+}
+
+#ifndef binlink
+/*
+   RX-Interrupt: jedes Byte von hex2usb in den Ring, loop() setzt daraus
+   die Befehle zusammen
+*/
+void asciiByte(uint8_t c) {
+  if ((uint8_t)(asciiRxHead - asciiRxTail) < ASCII_RX_SIZE) {
+    asciiRx[asciiRxHead & (ASCII_RX_SIZE - 1)] = c;
+    asciiRxHead++;
+  }
+}
+
+/*
+   Laenge des Befehls in asciiIn, sobald er vollstaendig ist, sonst 0.
+   Befehl und Boardnummern kommen als Zeichen bis limiter; nach "d#" folgen
+   die Anzahl als Hex-Ziffer und so viele Bytes fuer den Bootloader ohne
+   Abschluss.
+*/
+uint8_t asciiAvailable() {
+  uint8_t c, len;
+
+  while (asciiRxTail != asciiRxHead) {
+    c = asciiRx[asciiRxTail & (ASCII_RX_SIZE - 1)];
+    asciiRxTail++;
+    switch (asciiState)
+    {
+      case asciiCommand:
+        if (c != limiter) {
+          if (asciiLen < sizeof(asciiIn))
+            asciiIn[asciiLen++] = c;
+          continue;
+        }
+        if ((asciiLen == 0) || (asciiIn[0] != LINK_DATA))
+          break;
+        asciiLen = 1;
+        asciiState = asciiLength;
+        continue;
+      case asciiLength:
+        asciiData = char2num(c);
+        asciiState = asciiBytes;
+        if (asciiData == 0)
+          break;
+        continue;
+      case asciiBytes:
+        if (asciiLen < sizeof(asciiIn))
+          asciiIn[asciiLen++] = c;
+        if (--asciiData > 0)
+          continue;
+        break;
+    }
+    len = asciiLen;
+    asciiLen = 0;
+    asciiState = asciiCommand;
+    if (len > 0)
+      return len;
+  }
+  return 0;
+}
+
+uint8_t char2num (uint8_t ch)
+{
+    // Hex-Ziffer auf ihren Wert abbilden
+    if (ch >= '0' && ch <= '9') ch -= '0';
+    else if (ch >= 'A' && ch <= 'F') ch -= 'A' - 10;
+    else if (ch >= 'a' && ch <= 'f') ch -= 'a' - 10;
+  return ch;
+}
+#endif
+
 /*
    hier rber laufen alle Antworten des Dekoders
 */
 void appAnswer() {
-  if ((CAN.incomingMsg.cmd == APP_ANSWER) &&
-      (CAN.incomingMsg.resp_bit == true) &&
-      (CAN.incomingMsg.data[1] == bnHi) &&
+  if ((CAN.incomingMsg.data[1] == bnHi) &&
       (CAN.incomingMsg.data[2] == bnLo)) {
         switch (CAN.incomingMsg.data[0])
         {
@@ -247,18 +353,21 @@ void appAnswer() {
           break;
         }
   }
-  if ((CAN.incomingMsg.cmd == BTLDR_ANSWER) &&
-      (CAN.incomingMsg.resp_bit == true)) {
-        switch (CAN.incomingMsg.data[0])
-        {
-          case START_DATA:
-           Serial.print("$#"); //send the message back
-            break;
-          case MORE_DATA:
-            Serial.print("/#"); //send the message back
-            break;
-        }
-    }
+}
+
+/*
+   und hier alle Antworten des Bootloaders
+*/
+void btldrAnswer() {
+  switch (CAN.incomingMsg.data[0])
+  {
+    case START_DATA:
+      linkReply(LINK_READY);
+      break;
+    case MORE_DATA:
+      linkReply(LINK_MORE);
+      break;
+  }
 }
 
 /*
@@ -277,8 +386,8 @@ void appRequest() {
       break;
     case BOARDNUM_CHANGE:
     // neue Boardnum
-      CAN.outgoingMsg.data[3] = strDataIn.charAt(3);
-      CAN.outgoingMsg.data[4] = strDataIn.charAt(4);
+      CAN.outgoingMsg.data[3] = bnNewHi;
+      CAN.outgoingMsg.data[4] = bnNewLo;
       CAN.can_answer2(5, false);
       break;
     case GO_BTLDR:
@@ -297,38 +406,3 @@ void btldrRequest() {
   CAN.outgoingMsg.data[2] = bnLo;
   CAN.can_answer2(3, false);
 }
-
-uint8_t char2num (uint8_t ch)
-{
-    // Hex-Ziffer auf ihren Wert abbilden
-    if (ch >= '0' && ch <= '9') ch -= '0';
-    else if (ch >= 'A' && ch <= 'F') ch -= 'A' - 10;
-    else if (ch >= 'a' && ch <= 'f') ch -= 'a' - 10;
-  return ch;
-}
-
-uint8_t get1byte(){
-  do
-    {
-  } while (Serial.available() == 0 );
-  return Serial.read(); // read it and store it in val
-}
-
-void sendConfig(int index) {
-  uint8_t config_len[] = {4, 5, 5};
-  uint8_t config_frames[][5][8] = {{
-    {0, CONFIG_NUM, 0, 0, 0, 0, 0, ( uint8_t ) ((CAN.params.HiByteAddress - '0')*10 + CAN.params.LoByteAddress - '0')},
-    {( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[0])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[0])),
-      ( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[1])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[1])),
-      ( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[2])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[2])),
-    ( uint8_t ) highbyte2char(hex2dec(CAN.params.uid_device[3])), ( uint8_t ) lowbyte2char(hex2dec(CAN.params.uid_device[3]))},
-    {'C', 'A', 'N', 'g', 'u', 'r', 'u', ' '},
-    {'G', 'a', 't','e', 'w', 'a', 'y', 0}
-  }
-};
-
-for (int i = 0; i < config_len[index]; i++) {
-  CAN.configDataFrame(config_frames[index][i], i);
-}
-CAN.configTerminator(index, config_len[index]);
-}